@@ -0,0 +1,568 @@
+// Micro-benchmarks for the drawing and collision hot paths: the game built
+// without its main(), timing each kernel on the real sprites of the asset
+// pack. Run from the repository root, where the assets directory is:
+//
+//   ./benchmark [--filter=TEXT] [--json=FILE] [--baseline=FILE]
+//
+// --json writes the results as JSON, one benchmark per line. A file written
+// that way is the baseline of a later run, which then prints the change of
+// every benchmark and exits with 1 when one got slower by more than
+// --threshold percent.
+#include <cstdarg>
+
+#define GAME_NO_MAIN
+#include "../main.cpp"
+
+#define BENCH_MAX_CASES 128
+#define BENCH_REPEATS 5
+#define BENCH_POSITIONS 64
+#define BENCH_GAME_WIDTH 320 // room for the widest swarm, 16 columns
+#define BENCH_GAME_HEIGHT 384
+#define BENCH_TEXT "SPACE INVADERS SCORE 0123456789"
+
+struct BenchOptions {
+  const char *assets;
+  const char *filter; // only benchmarks whose name contains it
+  const char *json;
+  const char *baseline;
+  double threshold; // percent slower that counts as a regression
+  double min_time;  // seconds spent timing each benchmark
+};
+
+// What the benchmarks draw into and test against. Draw positions cycle
+// through a table so blits start at every alignment.
+struct BenchContext {
+  Buffer buffers[2]; // 32-bit and indexed
+  Buffer *target;
+  Sprite alien_sprites[6], bullet_sprite, player_sprite, text_spritesheet;
+  CompiledSprite compiled_alien_sprites[6], compiled_bullet_sprite;
+  CompiledSprite compiled_player_sprite, compiled_text_spritesheet;
+  SpriteAnimation alien_animation[3];
+  GameAssets assets;
+  size_t x[BENCH_POSITIONS], y[BENCH_POSITIONS];
+  Game *game;
+  BulletHit hits[GAME_MAX_BULLETS];
+  size_t sink; // results of tests, so none are optimized away
+};
+
+typedef void (*BenchFunction)(BenchContext *context, size_t iterations);
+
+struct BenchCase {
+  char name[64];
+  BenchFunction function;
+  const BlitKernels *kernels; // null for benchmarks that draw nothing
+  bool indexed;
+  size_t num_aliens, num_bullets;
+  CollisionMode collision;
+  double pixels; // drawn per op, 0 when not a drawing benchmark
+  double ns_per_op;
+};
+
+//** Benchmarks */
+void bench_clear(BenchContext *context, size_t iterations) {
+  for (size_t i = 0; i < iterations; ++i) {
+    buffer_clear(context->target, i & 3);
+  }
+}
+
+void bench_sprite_texels(BenchContext *context, size_t iterations) {
+  const Sprite &sprite = context->alien_sprites[0];
+  for (size_t i = 0; i < iterations; ++i) {
+    size_t p = i % BENCH_POSITIONS;
+    buffer_sprite_draw(context->target, sprite, context->x[p], context->y[p],
+                       1);
+  }
+}
+
+void bench_sprite_bitmask(BenchContext *context, size_t iterations) {
+  const CompiledSprite &sprite = context->compiled_alien_sprites[0];
+  for (size_t i = 0; i < iterations; ++i) {
+    size_t p = i % BENCH_POSITIONS;
+    buffer_sprite_draw(context->target, sprite, context->x[p], context->y[p],
+                       1);
+  }
+}
+
+void bench_text_texels(BenchContext *context, size_t iterations) {
+  for (size_t i = 0; i < iterations; ++i) {
+    size_t p = i % BENCH_POSITIONS;
+    buffer_draw_text(context->target, context->text_spritesheet, BENCH_TEXT,
+                     context->x[p] / 4, context->y[p], 1);
+  }
+}
+
+void bench_text_bitmask(BenchContext *context, size_t iterations) {
+  for (size_t i = 0; i < iterations; ++i) {
+    size_t p = i % BENCH_POSITIONS;
+    buffer_draw_text(context->target, context->compiled_text_spritesheet,
+                     BENCH_TEXT, context->x[p] / 4, context->y[p], 1);
+  }
+}
+
+// Bullets around an alien, many of them touching its rectangle
+void bench_overlap_aabb(BenchContext *context, size_t iterations) {
+  const Sprite &alien = context->alien_sprites[0];
+  size_t hits = 0;
+  for (size_t i = 0; i < iterations; ++i) {
+    size_t p = i % BENCH_POSITIONS;
+    hits += sprite_overlap_check(context->bullet_sprite, context->x[p] % 24,
+                                 context->y[p] % 16, alien, 8, 4);
+  }
+  context->sink += hits;
+}
+
+void bench_overlap_pixel(BenchContext *context, size_t iterations) {
+  const CompiledSprite &alien = context->compiled_alien_sprites[0];
+  size_t hits = 0;
+  for (size_t i = 0; i < iterations; ++i) {
+    size_t p = i % BENCH_POSITIONS;
+    hits += sprite_pixel_overlap_check(context->compiled_bullet_sprite,
+                                       context->x[p] % 24, context->y[p] % 16,
+                                       alien, 8, 4);
+  }
+  context->sink += hits;
+}
+
+void bench_collision(BenchContext *context, size_t iterations) {
+  size_t hits = 0;
+  for (size_t i = 0; i < iterations; ++i) {
+    hits += game_find_bullet_hits(*context->game, context->assets,
+                                  context->hits);
+  }
+  context->sink += hits;
+}
+
+// A swarm of num_aliens in rows of 16 at the stage spacing, with bullets
+// spread over the field, one in four of them an alien's
+void bench_game_init(BenchContext *context, size_t num_aliens,
+                     size_t num_bullets, CollisionMode collision) {
+  Game &game = *context->game;
+  game.width = BENCH_GAME_WIDTH;
+  game.height = BENCH_GAME_HEIGHT;
+  game.aliens.count = 0;
+  game.aliens.num_live = 0;
+  game.aliens.num_dying = 0;
+  game.bullets.count = 0;
+  game.bullets.num_kills = 0;
+  game.shields.count = 0;
+  game.collision_mode = collision;
+
+  game.player.x = game.width / 2;
+  game.player.y = 32;
+  game.player.life = 3;
+
+  size_t columns = 16;
+  size_t rows = (num_aliens + columns - 1) / columns;
+  formation_init(&game.formation, columns, rows);
+  for (size_t i = 0; i < num_aliens; ++i) {
+    size_t xi = i % columns;
+    size_t yi = i / columns;
+    ptrdiff_t ai = alien_store_add(&game.aliens, 32 + 16 * xi, 64 + 17 * yi,
+                                   1 + yi % 3);
+    if (ai >= 0)
+      formation_add(&game.formation, ai, xi, yi);
+  }
+  animation_clock_init(&game.animation, context->alien_animation, 3);
+  collision_grid_build(&game.alien_grid, game, context->assets);
+  formation_measure(&game.formation, game.aliens, context->assets);
+
+  uint32_t random = 0x9E3779B9u;
+  for (size_t i = 0; i < num_bullets; ++i) {
+    random ^= random << 13;
+    random ^= random >> 17;
+    random ^= random << 5;
+    int16_t x = 8 + random % (game.width - 16);
+    int16_t y = 48 + (random >> 16) % (game.height - 64);
+    bullet_pool_add(&game.bullets, x, y, i % 4 == 3 ? -1 : 1);
+  }
+}
+
+//** Runner */
+// Doubles the iterations until a run takes its share of min_time, then
+// keeps the fastest of BENCH_REPEATS runs
+double bench_time(BenchContext *context, BenchFunction function,
+                  double min_time) {
+  double target = min_time / BENCH_REPEATS;
+  size_t iterations = 1;
+  double elapsed;
+  for (;;) {
+    double start = profiler_now();
+    function(context, iterations);
+    elapsed = profiler_now() - start;
+    if (elapsed >= target || iterations >= ((size_t)1 << 40))
+      break;
+    iterations *= 2;
+  }
+
+  double best = elapsed;
+  for (size_t i = 1; i < BENCH_REPEATS; ++i) {
+    double start = profiler_now();
+    function(context, iterations);
+    best = std::min(best, profiler_now() - start);
+  }
+
+  return best * 1e9 / iterations;
+}
+
+void bench_run(BenchContext *context, BenchCase *bench, double min_time) {
+  if (bench->kernels)
+    blit_kernels = *bench->kernels;
+  context->target = &context->buffers[bench->indexed ? 1 : 0];
+  if (bench->function == bench_collision) {
+    bench_game_init(context, bench->num_aliens, bench->num_bullets,
+                    bench->collision);
+  }
+
+  bench->ns_per_op = bench_time(context, bench->function, min_time);
+}
+
+BenchCase *bench_add(BenchCase *cases, size_t *num_cases,
+                     BenchFunction function, double pixels,
+                     const char *format, ...) {
+  BenchCase *bench = &cases[(*num_cases)++];
+  memset(bench, 0, sizeof(*bench));
+  va_list args;
+  va_start(args, format);
+  vsnprintf(bench->name, sizeof(bench->name), format, args);
+  va_end(args);
+  bench->function = function;
+  bench->pixels = pixels;
+  bench->collision = COLLISION_AABB;
+  return bench;
+}
+
+size_t bench_cases_init(BenchCase *cases, const BenchContext &context) {
+  size_t num_cases = 0;
+  const char *formats[2] = {"rgba", "indexed"};
+  double buffer_pixels =
+      (double)context.buffers[0].width * context.buffers[0].height;
+  double sprite_pixels = (double)context.alien_sprites[0].width *
+                         context.alien_sprites[0].height;
+  double text_pixels = (double)context.text_spritesheet.width *
+                       context.text_spritesheet.height *
+                       (sizeof(BENCH_TEXT) - 1);
+
+  // The byte-per-texel draws take no kernels
+  for (int indexed = 0; indexed < 2; ++indexed) {
+    bench_add(cases, &num_cases, bench_sprite_texels, sprite_pixels,
+              "buffer_sprite_draw/texels/%s", formats[indexed])
+        ->indexed = indexed;
+    bench_add(cases, &num_cases, bench_text_texels, text_pixels,
+              "buffer_draw_text/texels/%s", formats[indexed])
+        ->indexed = indexed;
+  }
+
+  for (size_t k = 0; k < num_blit_kernel_sets; ++k) {
+    const BlitKernels &kernels = blit_kernel_sets[k];
+    if (!blit_kernels_supported(kernels))
+      continue;
+
+    for (int indexed = 0; indexed < 2; ++indexed) {
+      BenchCase *bench =
+          bench_add(cases, &num_cases, bench_clear, buffer_pixels,
+                    "buffer_clear/%s/%s", kernels.name, formats[indexed]);
+      bench->kernels = &kernels;
+      bench->indexed = indexed;
+      bench = bench_add(cases, &num_cases, bench_sprite_bitmask,
+                        sprite_pixels, "buffer_sprite_draw/%s/%s",
+                        kernels.name, formats[indexed]);
+      bench->kernels = &kernels;
+      bench->indexed = indexed;
+      bench = bench_add(cases, &num_cases, bench_text_bitmask, text_pixels,
+                        "buffer_draw_text/%s/%s", kernels.name,
+                        formats[indexed]);
+      bench->kernels = &kernels;
+      bench->indexed = indexed;
+    }
+  }
+
+  bench_add(cases, &num_cases, bench_overlap_aabb, 0,
+            "sprite_overlap_check/aabb");
+  bench_add(cases, &num_cases, bench_overlap_pixel, 0,
+            "sprite_overlap_check/pixel");
+
+  const size_t swarms[3] = {48, 128, 256};
+  const size_t volleys[3] = {1, 16, GAME_MAX_BULLETS};
+  for (int pixel = 0; pixel < 2; ++pixel) {
+    for (size_t s = 0; s < 3; ++s) {
+      for (size_t v = 0; v < 3; ++v) {
+        BenchCase *bench = bench_add(
+            cases, &num_cases, bench_collision, 0,
+            "game_find_bullet_hits/%s/aliens=%zu/bullets=%zu",
+            pixel ? "pixel" : "aabb", swarms[s], volleys[v]);
+        bench->num_aliens = swarms[s];
+        bench->num_bullets = volleys[v];
+        bench->collision = pixel ? COLLISION_PIXEL : COLLISION_AABB;
+      }
+    }
+  }
+
+  return num_cases;
+}
+
+//** Results */
+// One benchmark per line, so a baseline can be read back a line at a time
+bool bench_write_json(const char *path, const char *kernels,
+                      const BenchCase *cases, size_t num_cases) {
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    fprintf(stderr, "Error writing %s\n", path);
+    return false;
+  }
+
+  fprintf(file, "{\n  \"kernels\": \"%s\",\n  \"benchmarks\": [\n",
+          kernels);
+  for (size_t i = 0; i < num_cases; ++i) {
+    const BenchCase &bench = cases[i];
+    double ops_per_s = 1e9 / bench.ns_per_op;
+    fprintf(file,
+            "    {\"name\": \"%s\", \"ns_per_op\": %.3f, \"ops_per_s\": %.1f, ",
+            bench.name, bench.ns_per_op, ops_per_s);
+    if (bench.pixels > 0.0)
+      fprintf(file, "\"pixels_per_s\": %.1f}", ops_per_s * bench.pixels);
+    else
+      fprintf(file, "\"pixels_per_s\": null}");
+    fprintf(file, "%s\n", i + 1 < num_cases ? "," : "");
+  }
+  fprintf(file, "  ]\n}\n");
+
+  bool ok = ferror(file) == 0;
+  ok = fclose(file) == 0 && ok;
+  if (!ok)
+    fprintf(stderr, "Error writing %s\n", path);
+  return ok;
+}
+
+// Looks name up in a file written by bench_write_json. Returns its ns/op,
+// or 0 when the baseline has no such benchmark.
+double bench_baseline_find(FILE *baseline, const char *name) {
+  char key[80];
+  snprintf(key, sizeof(key), "\"name\": \"%s\"", name);
+  rewind(baseline);
+  char line[256];
+  while (fgets(line, sizeof(line), baseline)) {
+    if (!strstr(line, key))
+      continue;
+
+    const char *value = strstr(line, "\"ns_per_op\": ");
+    return value ? strtod(value + 13, 0) : 0.0;
+  }
+
+  return 0.0;
+}
+
+// Prints each benchmark against the baseline. Returns how many got slower
+// by more than threshold percent.
+size_t bench_compare(FILE *baseline, const BenchCase *cases,
+                     size_t num_cases, double threshold) {
+  size_t regressions = 0;
+  printf("\n%-52s %12s %12s %9s\n", "Against baseline", "ns/op", "baseline",
+         "change");
+  for (size_t i = 0; i < num_cases; ++i) {
+    const BenchCase &bench = cases[i];
+    double base = bench_baseline_find(baseline, bench.name);
+    if (base <= 0.0) {
+      printf("%-52s %12.1f %12s %9s\n", bench.name, bench.ns_per_op, "-",
+             "new");
+      continue;
+    }
+
+    double change = (bench.ns_per_op - base) / base * 100.0;
+    bool regressed = change > threshold;
+    regressions += regressed;
+    printf("%-52s %12.1f %12.1f %+8.1f%%%s\n", bench.name, bench.ns_per_op,
+           base, change, regressed ? "  REGRESSED" : "");
+  }
+
+  printf("%zu of %zu benchmarks slower than the baseline by over %.0f%%\n",
+         regressions, num_cases, threshold);
+  return regressions;
+}
+
+bool bench_options_parse(BenchOptions *options, int argc,
+                         char const *argv[]) {
+  options->assets = "assets";
+  options->filter = 0;
+  options->json = 0;
+  options->baseline = 0;
+  options->threshold = 10.0;
+  options->min_time = 0.05;
+
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    if (strncmp(arg, "--assets=", 9) == 0) {
+      options->assets = arg + 9;
+    } else if (strncmp(arg, "--filter=", 9) == 0) {
+      options->filter = arg + 9;
+    } else if (strncmp(arg, "--json=", 7) == 0) {
+      options->json = arg + 7;
+    } else if (strncmp(arg, "--baseline=", 11) == 0) {
+      options->baseline = arg + 11;
+    } else if (strncmp(arg, "--threshold=", 12) == 0) {
+      options->threshold = strtod(arg + 12, 0);
+      if (options->threshold <= 0.0) {
+        fprintf(stderr, "--threshold must be positive\n");
+        return false;
+      }
+    } else if (strncmp(arg, "--min-time=", 11) == 0) {
+      options->min_time = strtod(arg + 11, 0) / 1e3;
+      if (options->min_time <= 0.0) {
+        fprintf(stderr, "--min-time must be positive\n");
+        return false;
+      }
+    } else {
+      fprintf(stderr, "Unknown option: %s\n", arg);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+//** Main */
+int main(int argc, char const *argv[]) {
+  BenchOptions options;
+  if (!bench_options_parse(&options, argc, argv))
+    return -1;
+
+  FILE *baseline = 0;
+  if (options.baseline) {
+    baseline = fopen(options.baseline, "r");
+    if (!baseline) {
+      fprintf(stderr, "Error reading %s\n", options.baseline);
+      return -1;
+    }
+  }
+
+  AssetPack pack;
+  if (!asset_pack_load(&pack, options.assets)) {
+    if (baseline)
+      fclose(baseline);
+    return -1;
+  }
+
+  BenchContext *context = new BenchContext;
+  BenchContext &c = *context;
+  const char *alien_names[3] = {"alien1", "alien2", "alien3"};
+  bool assets_found = true;
+  for (size_t i = 0; i < 3; ++i) {
+    if (!asset_pack_sprite(pack, alien_names[i], 2, &c.alien_sprites[2 * i],
+                           &c.compiled_alien_sprites[2 * i])) {
+      assets_found = false;
+      continue;
+    }
+
+    c.alien_sprites[2 * i + 1] = sprite_frame(c.alien_sprites[2 * i], 1);
+    c.compiled_alien_sprites[2 * i + 1] =
+        compiled_sprite_frame(c.compiled_alien_sprites[2 * i], 1);
+  }
+  if (!assets_found ||
+      !asset_pack_sprite(pack, "bullet", 1, &c.bullet_sprite,
+                         &c.compiled_bullet_sprite) ||
+      !asset_pack_sprite(pack, "player", 1, &c.player_sprite,
+                         &c.compiled_player_sprite) ||
+      !asset_pack_sprite(pack, "font", 65, &c.text_spritesheet,
+                         &c.compiled_text_spritesheet)) {
+    delete context;
+    asset_pack_close(&pack);
+    if (baseline)
+      fclose(baseline);
+    return -1;
+  }
+
+  for (size_t i = 0; i < 3; ++i) {
+    c.alien_animation[i].loop = true;
+    c.alien_animation[i].num_frames = 2;
+    c.alien_animation[i].frame_duration = 10;
+    for (size_t frame = 0; frame < 2; ++frame) {
+      c.alien_animation[i].frames[frame] = &c.alien_sprites[2 * i + frame];
+      c.alien_animation[i].compiled_frames[frame] =
+          &c.compiled_alien_sprites[2 * i + frame];
+    }
+  }
+
+  // Only the collision pass reads these, and it never draws a death or
+  // blasts a shield
+  c.assets.player_sprite = &c.player_sprite;
+  c.assets.compiled_player_sprite = &c.compiled_player_sprite;
+  c.assets.bullet_sprite = &c.bullet_sprite;
+  c.assets.alien_death_sprite = 0;
+  c.assets.compiled_bullet_sprite = &c.compiled_bullet_sprite;
+  c.assets.compiled_shield_hit = 0;
+  c.assets.alien_animation = c.alien_animation;
+
+  // Buffers at the game's default resolution
+  size_t num_pixels = GAME_MIN_WIDTH * GAME_MIN_HEIGHT;
+  Arena arena;
+  arena_init(&arena, "benchmark",
+             num_pixels * (sizeof(uint32_t) + 1) + sizeof(Game) +
+                 ARENA_SLACK);
+  for (size_t i = 0; i < 2; ++i) {
+    Buffer &buffer = c.buffers[i];
+    buffer.width = GAME_MIN_WIDTH;
+    buffer.height = GAME_MIN_HEIGHT;
+    buffer.data = i == 0 ? arena_push<uint32_t>(&arena, num_pixels) : 0;
+    buffer.indices = i == 1 ? arena_push<uint8_t>(&arena, num_pixels) : 0;
+    buffer.dirty = 0;
+    buffer.raster = 0;
+  }
+  c.game = arena_push<Game>(&arena);
+  c.sink = 0;
+
+  uint32_t random = 2654435761u;
+  for (size_t i = 0; i < BENCH_POSITIONS; ++i) {
+    random ^= random << 13;
+    random ^= random >> 17;
+    random ^= random << 5;
+    c.x[i] = random % (GAME_MIN_WIDTH - 16);
+    c.y[i] = (random >> 16) % (GAME_MIN_HEIGHT - 16);
+  }
+
+  BenchCase *cases = new BenchCase[BENCH_MAX_CASES];
+  size_t num_cases = bench_cases_init(cases, c);
+
+  // Cases left out by the filter are dropped before anything is timed
+  size_t num_run = 0;
+  for (size_t i = 0; i < num_cases; ++i) {
+    if (!options.filter || strstr(cases[i].name, options.filter))
+      cases[num_run++] = cases[i];
+  }
+
+  // Widest set, which is what the game draws with and what is restored
+  // after the benchmarks that pick their own
+  blit_kernels_init();
+  BlitKernels default_kernels = blit_kernels;
+  printf("%-52s %12s %14s %12s\n", "Benchmark", "ns/op", "ops/s", "Mpixels/s");
+  for (size_t i = 0; i < num_run; ++i) {
+    BenchCase &bench = cases[i];
+    bench_run(&c, &bench, options.min_time);
+    double ops_per_s = 1e9 / bench.ns_per_op;
+    if (bench.pixels > 0.0) {
+      printf("%-52s %12.1f %14.0f %12.1f\n", bench.name, bench.ns_per_op,
+             ops_per_s, ops_per_s * bench.pixels / 1e6);
+    } else {
+      printf("%-52s %12.1f %14.0f %12s\n", bench.name, bench.ns_per_op,
+             ops_per_s, "-");
+    }
+    fflush(stdout);
+  }
+  blit_kernels = default_kernels;
+
+  int result = 0;
+  if (options.json &&
+      !bench_write_json(options.json, default_kernels.name, cases, num_run))
+    result = -1;
+  if (baseline) {
+    if (bench_compare(baseline, cases, num_run, options.threshold) > 0 &&
+        result == 0)
+      result = 1;
+    fclose(baseline);
+  }
+
+  delete[] cases;
+  arena_free(&arena);
+  delete context;
+  asset_pack_close(&pack);
+
+  return result;
+}
@@ -1,21 +1,150 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <type_traits>
 
+#include <sys/stat.h>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+#include <immintrin.h>
+#define BLIT_KERNELS_X86
+#if defined(__GNUC__)
+#define BLIT_KERNELS_AVX2
+#endif
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define BLIT_KERNELS_NEON
+#endif
+
+#ifndef GAME_MAX_BULLETS
 #define GAME_MAX_BULLETS 128
+#endif
+#ifndef GAME_MAX_ALIENS
+#define GAME_MAX_ALIENS 256
+#endif
+#define GAME_ALIEN_DEATH_TICKS 10
+#define GAME_ALIEN_BULLET_SPEED 1
+#define BULLET_HIT_BOUNDS 0xFFFF
+#define BULLET_HIT_PLAYER 0xFFFE
+#define BULLET_HIT_SHIELD 0xFFFD
+#define GAME_MAX_SHIELDS 8
+#define SHIELD_MAX_HEIGHT 32
+#define FORMATION_STEP_X 2       // pixels per march step
+#define FORMATION_STEP_Y 8       // drop at a playfield edge
+#define FORMATION_STEP_TICKS 30  // between steps with every alien alive
+#define FORMATION_FIRE_TICKS 40  // between alien shots
+#define GAME_GRID_CELL_SIZE 16
+#define GAME_GRID_MAX_CELLS 1024
+// Enough for every alien to overlap 4 cells, as one of at most the cell
+// size does; the grid coarsens when aliens cover more
+#define GAME_GRID_MAX_ITEMS (4 * GAME_MAX_ALIENS)
+#define GAME_MAX_TICKS_PER_FRAME 8
+#define ANIMATION_MAX 16
+#define ANIMATION_MAX_FRAMES 4
+#define INPUT_QUEUE_SIZE 64 // a power of two
+#define GAME_MIN_WIDTH 224  // the stage layout needs this much room
+#define GAME_MIN_HEIGHT 256
+#define GAME_MAX_SIZE 4096 // positions are int16_t
+#define DIRTY_TILE_SIZE 16
+#define DIRTY_REGION_MAX_HISTORY 4
+#define PIXEL_STREAM_MAX_SLOTS 3
+#define DISPLAY_MAX_DIRTY_RECTS 64 // uploads per frame, at most
+#define PALETTE_SIZE 16
+#define SPRITE_ATLAS_WIDTH 256
+#define SPRITE_ATLAS_MAX_ENTRIES 128
+#define SPRITE_RENDERER_MAX_INSTANCES 1024
+#define RENDER_LIST_MAX_SPRITES 64
+#define RENDER_LIST_MAX_BITMAPS 16
+#define RENDER_LIST_MAX_COMMANDS 1024
+#define PROFILE_HISTORY 128
+#define PROFILE_GPU_QUERIES 8 // two ranges a frame with the CRT pass
+#define PACING_MIN_SPIN 0.0005 // seconds a capped wait spins at least
+#define PACING_MAX_SPIN 0.004  // and at most
+#define ASSET_CACHE_MAGIC 0x53414953 // "SIAS"
+#define ASSET_CACHE_VERSION 2
+#define ASSET_NAME_SIZE 24
+#define ASSET_MAX_SPRITES 64
+#define ASSET_MAX_STAGES 64
+#define ASSET_MAX_PATH 1024
+#define PROGRAM_CACHE_MAGIC 0x50474953 // "SIGP"
+#define PROGRAM_CACHE_MAX 8
+#define CACHE_LINE_SIZE 64
+#define ARENA_ALIGNMENT CACHE_LINE_SIZE
+#define ARENA_SLACK (64 * 1024)
+#define RASTER_MAX_THREADS 16
+#define RASTER_MAX_BANDS 32
+#define RASTER_MAX_COMMANDS 4096
+#define BATCH_MAX_THREADS 64
+#define BATCH_CHUNK 16 // environments a worker claims at a time
+
+// What a key press or release does to the input state
+struct InputAction {
+  int8_t move;     // added to move_dir
+  bool fire;       // one shot; presses queue up rather than merge
+  int8_t snapshot; // 1 saves the game state, -1 rolls back to it
+  double time;     // glfwGetTime() when the key event was handled
+};
+
+// Single-producer single-consumer ring carrying key input to the
+// simulation, which may run on another thread. head and tail only count
+// up and each is written by one side, so neither side ever locks; they
+// also number the actions, which is how frames tell the inputs they show.
+struct InputQueue {
+  InputAction actions[INPUT_QUEUE_SIZE];
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> head; // producer side
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail; // consumer side
+};
+
+// Drops the action when the consumer is a full queue behind
+inline void input_queue_push(InputQueue *queue, const InputAction &action) {
+  size_t head = queue->head.load(std::memory_order_relaxed);
+  if (head - queue->tail.load(std::memory_order_acquire) == INPUT_QUEUE_SIZE)
+    return;
+
+  queue->actions[head % INPUT_QUEUE_SIZE] = action;
+  queue->head.store(head + 1, std::memory_order_release);
+}
 
 bool game_running = false;
-int move_dir = 0;
-bool fire_pressed = 0;
+InputQueue input_queue;
+bool framebuffer_resized = false;
+bool crt_toggled = false;   // picked up by display_begin_frame
+bool pacing_cycled = false; // likewise
 
 //* Callbacks */
 void error_callback(int error, const char *description) {
   fprintf(stderr, "Error: %s\n", description);
 }
 
+// The size in pixels, which differs from the window size on HiDPI screens,
+// is read back at the start of the next frame
+void framebuffer_size_callback(GLFWwindow *window, int width, int height) {
+  framebuffer_resized = true;
+}
+
 void key_callback(GLFWwindow *window, int key, int scancode, int action,
                   int mods) {
+  InputAction input = {0, false, 0, glfwGetTime()};
   switch (key) {
   case GLFW_KEY_ESCAPE:
     if (action == GLFW_PRESS)
@@ -23,23 +152,42 @@ void key_callback(GLFWwindow *window, int key, int scancode, int action,
     break;
   case GLFW_KEY_RIGHT:
     if (action == GLFW_PRESS)
-      move_dir += 1;
+      input.move = 1;
     else if (action == GLFW_RELEASE)
-      move_dir -= 1;
+      input.move = -1;
     break;
   case GLFW_KEY_LEFT:
     if (action == GLFW_PRESS)
-      move_dir -= 1;
+      input.move = -1;
     else if (action == GLFW_RELEASE)
-      move_dir += 1;
+      input.move = 1;
     break;
   case GLFW_KEY_SPACE:
     if (action == GLFW_RELEASE)
-      fire_pressed = true;
+      input.fire = true;
+    break;
+  case GLFW_KEY_F5:
+    if (action == GLFW_PRESS)
+      input.snapshot = 1;
+    break;
+  case GLFW_KEY_F9:
+    if (action == GLFW_PRESS)
+      input.snapshot = -1;
+    break;
+  case GLFW_KEY_C:
+    if (action == GLFW_PRESS)
+      crt_toggled = true;
+    break;
+  case GLFW_KEY_P:
+    if (action == GLFW_PRESS)
+      pacing_cycled = true;
     break;
   default:
     break;
   }
+
+  if (input.move != 0 || input.fire || input.snapshot != 0)
+    input_queue_push(&input_queue, input);
 }
 
 //* Enums */
@@ -50,10 +198,126 @@ enum AlienType : uint8_t {
   ALIEN_TYPE_C = 3
 };
 
+enum CollisionMode : uint8_t {
+  COLLISION_AABB = 0, // sprite rectangles only
+  COLLISION_PIXEL = 1 // rectangles, then sprite bitmasks
+};
+
+// How the buffer is mapped onto a framebuffer of a different size
+enum ScalingMode : uint8_t {
+  SCALING_INTEGER = 0, // largest whole multiple, letterboxed; fit if none
+  SCALING_FIT = 1,     // as large as the aspect ratio allows
+  SCALING_STRETCH = 2  // the whole framebuffer
+};
+
+enum RendererMode : uint8_t {
+  RENDERER_SOFTWARE = 0, // rasterized into the Buffer, uploaded as a texture
+  RENDERER_GPU = 1       // instanced quads from the sprite atlas
+};
+
+// What each pixel of a batch observation shows, as bit flags. Downsampling
+// ORs the pixels of a block, so a block shows everything that is in it.
+enum ObservationFlag : uint8_t {
+  OBSERVE_EMPTY = 0,
+  OBSERVE_SHIELD = 1,
+  OBSERVE_ALIEN = 2,
+  OBSERVE_ALIEN_BULLET = 4,
+  OBSERVE_PLAYER_BULLET = 8,
+  OBSERVE_PLAYER = 16
+};
+
+enum PixelUploadMode : uint8_t {
+  UPLOAD_DIRECT = 0,
+  UPLOAD_ORPHAN = 1,
+  UPLOAD_PERSISTENT = 2
+};
+
+// How display_present paces frames
+enum PacingMode : uint8_t {
+  PACING_VSYNC = 0,    // swaps wait for the swap interval's vblank
+  PACING_ADAPTIVE = 1, // like vsync, but late frames swap at once and tear
+  PACING_UNCAPPED = 2, // no waiting at all, for benchmarks
+  PACING_CAPPED = 3,   // vsync off and a timer wait to max_fps
+  PACING_NUM_MODES
+};
+
 //* Structs */
+// Linear allocator: allocations are bumps of used and are all given back at
+// once by resetting it, so memory with a common lifetime is contiguous and
+// costs nothing to free
+struct Arena {
+  const char *name; // for out of memory reports
+  uint8_t *base;
+  size_t capacity;
+  size_t used;
+};
+
+// Per-tile flags of what the draw calls touched in each of the last few
+// frames, so only the changed part of a Buffer is cleared and uploaded.
+struct DirtyRegion {
+  size_t tiles_x, tiles_y;
+  size_t history; // frames kept, including the current one
+  size_t current;
+  uint8_t *frames[DIRTY_REGION_MAX_HISTORY];
+};
+
+struct DirtyRect {
+  size_t x, y, width, height;
+};
+
+// Pixels are either 0xAARRGGBB in data or palette indices in indices, the
+// other pointer being null. Draw calls take a color in the buffer's format.
 struct Buffer {
   size_t width, height;
   uint32_t *data;
+  uint8_t *indices;
+  DirtyRegion *dirty; // null when the whole buffer is redrawn every frame
+  struct Rasterizer *raster; // null to draw immediately
+};
+
+struct PixelStream {
+  PixelUploadMode mode;
+  size_t num_slots;
+  size_t slot; // slot drawn and uploaded this frame
+  size_t size; // bytes per slot
+  GLuint pbos[PIXEL_STREAM_MAX_SLOTS];
+  uint8_t *mapped[PIXEL_STREAM_MAX_SLOTS];
+  GLsync fences[PIXEL_STREAM_MAX_SLOTS];
+};
+
+// What is bound on the one GL context, so binding it again is skipped.
+// Zero means unknown; code that binds behind it must call gl_state_reset.
+struct GlState {
+  GLuint program;
+  GLuint texture; // on unit 0, the only one used
+  GLuint vao;
+};
+
+// programs.bin is a ProgramCacheHeader and then, per program, a record
+// followed by its binary
+struct ProgramCacheHeader {
+  uint32_t magic;
+  uint32_t num_programs;
+  uint64_t driver; // binaries only load on the driver that made them
+};
+
+struct ProgramCacheRecord {
+  uint64_t key; // hash of the driver and both shader sources
+  uint32_t format, size;
+};
+
+// Linked program binaries from glGetProgramBinary, loaded at startup and
+// written back on exit when a program had to be compiled
+struct ProgramCache {
+  bool enabled; // the driver can hand out program binaries
+  bool changed;
+  char path[ASSET_MAX_PATH];
+  uint64_t driver;
+  size_t num_programs;
+  ProgramCacheRecord records[PROGRAM_CACHE_MAX];
+  uint8_t *binaries[PROGRAM_CACHE_MAX]; // new[]
+  size_t hits, misses;
+  double seconds; // spent creating programs
 };
 
 struct Sprite {
@@ -61,9 +325,79 @@ struct Sprite {
   uint8_t *data;
 };
 
-struct Alien {
-  size_t x, y;
-  uint8_t type;
+// Row-major 1-bit form of a Sprite, built once at load time. Bit xi of word
+// (yi * stride + xi / 32) is set when texel (xi, yi) is opaque.
+struct CompiledSprite {
+  size_t width, height;
+  size_t stride; // 32-bit words per row
+  uint32_t *rows;
+};
+
+enum RasterCommandType : uint8_t {
+  RASTER_FILL = 0,  // a clipped rectangle
+  RASTER_SPRITE = 1 // a compiled sprite blit
+};
+
+struct RasterCommand {
+  RasterCommandType type;
+  uint32_t color;
+  size_t x, y;          // as given to the draw call
+  size_t width, height; // of a fill
+  CompiledSprite sprite;
+};
+
+// Tiled parallel rasterizer. Buffer draws are recorded into a command list
+// binned by horizontal band, and a flush draws the bands in parallel on a
+// persistent worker pool. Each band replays its commands in recording
+// order, so the result is the same as drawing immediately. Sprite rows
+// must stay valid until the flush.
+struct Rasterizer {
+  size_t num_threads; // including the one flushing
+  std::thread workers[RASTER_MAX_THREADS];
+  size_t num_bands;
+  size_t band_height; // in rows
+
+  size_t num_commands;
+  RasterCommand commands[RASTER_MAX_COMMANDS];
+  size_t bin_sizes[RASTER_MAX_BANDS];
+  uint16_t bins[RASTER_MAX_BANDS][RASTER_MAX_COMMANDS]; // command indices
+
+  Buffer *buffer; // being flushed
+  std::mutex mutex;
+  std::condition_variable wake, done;
+  size_t generation; // flushes started
+  size_t band_end;   // the current flush's bands are the tickets below
+  bool quit;
+  std::atomic<size_t> next_band; // band tickets, never reset
+  std::atomic<size_t> bands_done;
+};
+
+// A string pre-rasterized into one bitmask strip so it blits in a single
+// call. Number runs remember their value and are only rebuilt on change.
+struct TextRun {
+  Arena *arena; // rows come from here
+  CompiledSprite sprite;
+  size_t capacity; // words allocated in sprite.rows
+  size_t number;
+  bool valid;
+};
+
+// Structure-of-arrays alien storage. A slot keeps its index for the whole
+// stage (the collision grid refers to it), while live and dying are compact
+// index lists so every pass only visits the aliens it has work for.
+struct AlienStore {
+  size_t count; // slots in use
+  int16_t x[GAME_MAX_ALIENS];
+  int16_t y[GAME_MAX_ALIENS];
+  uint8_t type[GAME_MAX_ALIENS];
+  uint8_t death_counter[GAME_MAX_ALIENS]; // ticks left on the death sprite
+
+  size_t num_live;
+  uint16_t live[GAME_MAX_ALIENS];
+  uint16_t live_index[GAME_MAX_ALIENS]; // position of each slot in live
+
+  size_t num_dying;
+  uint16_t dying[GAME_MAX_ALIENS];
 };
 
 struct Player {
@@ -71,557 +405,5483 @@ struct Player {
   size_t life;
 };
 
-struct Bullet {
-  size_t x, y;
-  int dir;
+// Bullets are killed into a deferred list during a tick and compacted out
+// once at its end, so no pass ever sees the arrays shift under it.
+struct BulletPool {
+  size_t count;
+  int16_t x[GAME_MAX_BULLETS];
+  int16_t y[GAME_MAX_BULLETS];
+  int8_t dir[GAME_MAX_BULLETS];
+
+  size_t num_kills;
+  uint16_t kills[GAME_MAX_BULLETS];
+  uint8_t killed[GAME_MAX_BULLETS];
+};
+
+// Shields are occupancy bitmaps in the CompiledSprite row layout, one word
+// per row, so hit tests are the same word-parallel AND as pixel collision
+// and a blast clears a whole row of a shield with one AND-NOT. They live in
+// the game state and are copied with each snapshot.
+struct ShieldStore {
+  size_t count;
+  size_t width, height; // of every shield, width at most 32
+  int16_t x[GAME_MAX_SHIELDS];
+  int16_t y[GAME_MAX_SHIELDS];
+  uint32_t rows[GAME_MAX_SHIELDS][SHIELD_MAX_HEIGHT]; // top row first
+};
+
+// What a bullet ran into this tick
+struct BulletHit {
+  uint16_t bullet;
+  uint16_t alien; // or BULLET_HIT_BOUNDS / BULLET_HIT_PLAYER / _SHIELD
+  uint8_t shield; // for BULLET_HIT_SHIELD
+};
+
+// Uniform grid over the playfield for the bullet-vs-alien broad phase. Cell
+// c lists the live aliens overlapping it in
+// items[cell_start[c] .. cell_start[c] + cell_count[c]).
+struct CollisionGrid {
+  size_t cols, rows;
+  size_t cell_size;
+  uint16_t cell_start[GAME_GRID_MAX_CELLS];
+  uint16_t cell_count[GAME_GRID_MAX_CELLS];
+  uint16_t items[GAME_GRID_MAX_ITEMS];
+};
+
+struct SpriteAnimation {
+  bool loop;
+  size_t num_frames;
+  size_t frame_duration; // in ticks
+  const Sprite *frames[ANIMATION_MAX_FRAMES];
+  const CompiledSprite *compiled_frames[ANIMATION_MAX_FRAMES];
+};
+
+// One clock for every animation. Each tick resolves the current frame of
+// all of them into a flat table, so drawing and collision look a frame up
+// with a single index. It is game state, so it holds no pointers; the
+// animations themselves are assets.
+struct AnimationClock {
+  size_t tick;
+  size_t num_animations;
+  uint8_t frame[ANIMATION_MAX]; // current frame of each
+};
+
+// The aliens move as one: their AlienStore positions are relative to the
+// formation, so marching changes a single offset, and each column keeps
+// its bottom-most live alien, the only one that may fire. Per-column
+// arrays are sized for the widest stage, which has GAME_MAX_ALIENS cells.
+struct Formation {
+  int16_t x, y; // added to every alien's position
+  int8_t dir;   // marching direction, 1 right or -1 left
+  size_t columns, rows;
+  size_t count;      // aliens placed
+  size_t step_timer; // ticks until the next march step
+  size_t fire_timer; // ticks until the next alien shot
+  uint32_t random;   // picks the firing column
+  int16_t cells[GAME_MAX_ALIENS]; // alien slot or -1, bottom row first
+  uint8_t column_of[GAME_MAX_ALIENS];
+  uint8_t row_of[GAME_MAX_ALIENS];
+  int16_t bottom[GAME_MAX_ALIENS]; // slot per column, -1 once it is empty
+  int16_t column_left[GAME_MAX_ALIENS]; // x extent of a column's aliens
+  int16_t column_right[GAME_MAX_ALIENS];
 };
 
 struct Game {
   size_t width, height;
-  size_t num_aliens;
-  size_t num_bullets;
-  Alien *aliens;
+  AlienStore aliens;
+  Formation formation;
+  ShieldStore shields;
+  BulletPool bullets;
   Player player;
-  Bullet bullets[GAME_MAX_BULLETS];
+  CollisionGrid alien_grid;
+  CollisionMode collision_mode;
+  AnimationClock animation; // alien type t plays animation t - 1
+  size_t score;
+};
+
+// The game as of one simulation tick, with what drawing it needs besides.
+// Everything the next tick depends on is in here and none of it is a
+// pointer, so a snapshot is saved or restored with one copy.
+struct GameSnapshot {
+  Game game;
+  size_t previous_player_x; // a tick earlier, for interpolation
+  size_t tick;              // ticks run so far
+  int move_dir;             // held input the last tick ran with
+  size_t inputs;            // queued input actions applied so far
+  double time;              // glfwGetTime() the last tick was due at
+  bool over;                // see game_is_over
+};
+
+// Phases of a frame the profiler times. PROFILE_GPU and PROFILE_POST come
+// from timer queries and lag the CPU phases by a few frames. PROFILE_INPUT
+// and PROFILE_LATE aren't phases but go through the same stats.
+enum ProfilePhase {
+  PROFILE_FRAME,
+  PROFILE_SIMULATION,
+  PROFILE_CLEAR,
+  PROFILE_HUD,
+  PROFILE_ALIENS,
+  PROFILE_BULLETS,
+  PROFILE_RASTER,
+  PROFILE_UPLOAD,
+  PROFILE_DRAW,
+  PROFILE_SWAP,
+  PROFILE_GPU,
+  PROFILE_POST,  // the CRT pass, on the GPU
+  PROFILE_INPUT, // input to photon, for frames showing new input
+  PROFILE_LATE,  // how late each missed frame was, see FramePacer
+  PROFILE_NUM_PHASES
+};
+
+struct Profiler {
+  bool enabled;
+  bool gpu; // timer queries need a GL context
+  double start[PROFILE_NUM_PHASES];   // open timers, in seconds
+  double current[PROFILE_NUM_PHASES]; // this frame so far
+  float history[PROFILE_NUM_PHASES][PROFILE_HISTORY]; // rolling window
+  size_t count[PROFILE_NUM_PHASES];                   // samples ever taken
+  double total[PROFILE_NUM_PHASES];
+
+  GLuint gpu_queries[PROFILE_GPU_QUERIES];
+  ProfilePhase gpu_phases[PROFILE_GPU_QUERIES]; // what each query times
+  size_t gpu_issued; // queries begun
+  size_t gpu_read;   // queries whose result has been taken
+};
+
+struct ProfileStats {
+  double min;
+  double avg;
+  double p99;
+};
+
+// Input to apply from a given tick on; move_dir holds until the next event,
+// fire is a single press
+struct InputEvent {
+  size_t tick;
+  int move_dir;
+  bool fire;
+};
+
+struct InputScript {
+  size_t num_events;
+  size_t capacity;
+  InputEvent *events;
+  size_t next;       // replay position
+  int last_move_dir; // recording state
+};
+
+// Runs the game in fixed ticks. Pipelined, the ticks run on their own
+// thread and each one is published into a double buffer, so simulating the
+// next tick overlaps drawing and presenting the last one. The render side
+// draws from the latest published snapshot and never sees the working
+// state. Otherwise the caller runs the ticks and draws the working state.
+struct Simulation {
+  GameSnapshot *state; // working state, simulation side only
+  struct GameAssets *assets;
+  InputScript *replay, *record; // null when unused
+  int move_dir;
+  size_t fire_presses; // queued, one is fired per tick
+  GameSnapshot saved;  // quicksave slot, see simulation_restore
+  bool has_saved;
+
+  bool pipelined;
+  double tick_duration;
+  std::thread thread;
+  GameSnapshot *snapshots[2];
+  std::mutex mutex;
+  std::condition_variable released;
+  size_t latest;  // last published snapshot
+  size_t reading; // snapshot the render side holds, 2 for none
+  bool quit;
+  double busy; // seconds spent in ticks since the render side last asked
+};
+
+// Input to one environment for one batch step
+struct BatchAction {
+  int8_t move_dir; // -1, 0 or 1
+  bool fire;
+  bool observe; // draw its observation after the step
+};
+
+// Independent games stepped together for training and evaluating bots.
+// Each environment is a GameSnapshot advanced by game_step, so nothing
+// but the simulation bounds throughput. A step splits the environments
+// into chunks and a persistent worker pool takes them as tickets, the way
+// the Rasterizer takes bands. Results are contiguous, environment i at
+// index i; observation i is obs_width x obs_height ObservationFlags,
+// bottom row first like the buffer.
+struct BatchRunner {
+  size_t num_envs;
+  GameSnapshot *envs;
+  const GameSnapshot *initial; // what an environment resets to
+  GameAssets *assets;
+  const BatchAction *actions; // of the step being run
+
+  int32_t *rewards; // score gained in the last step
+  uint8_t *done;    // the game ended in the last step and was reset
+  size_t scale;     // buffer pixels per observation pixel each way, 0 none
+  size_t obs_width, obs_height;
+  uint8_t *observations;
+  Buffer scratch[BATCH_MAX_THREADS]; // full-size observation, per thread
+
+  size_t num_threads; // including the one stepping
+  std::thread workers[BATCH_MAX_THREADS];
+  size_t num_chunks;
+  std::mutex mutex;
+  std::condition_variable wake, done_stepping;
+  size_t generation; // steps started
+  size_t chunk_end;  // the current step's chunks are the tickets below
+  bool quit;
+  std::atomic<size_t> next_chunk; // chunk tickets, never reset
+  std::atomic<size_t> chunks_done;
+};
+
+struct Options {
+  size_t width, height;               // internal resolution of the buffer
+  size_t window_width, window_height; // 0 matches the buffer
+  bool fullscreen;
+  ScalingMode scaling;
+  const char *blit_kernels; // null picks the widest supported set
+  bool dirty_rects;
+  bool sim_thread; // pipelined simulation, unless headless
+  size_t raster_threads; // 1 draws immediately, 0 uses every core
+  const char *upload; // "direct", "pbo" (persistent if available) or "orphan"
+  size_t pbo_slots;
+  double tick_rate; // simulation ticks per second
+  PacingMode pacing;
+  int swap_interval; // for PACING_VSYNC
+  double max_fps;    // for PACING_CAPPED, 0 caps at the refresh rate
+  bool interpolate;
+  CollisionMode collision_mode;
+  bool profile;
+  const char *profile_csv; // stats are written here on exit
+  bool headless;           // no window or GL; one tick per frame
+  size_t frames;           // stop after this many frames, 0 runs on
+  size_t seek;             // tick to fast-forward to before the first frame
+  size_t batch;            // environments for the batch runner, 0 for none
+  size_t batch_threads;    // 0 uses every core
+  size_t batch_observe;    // observation downsampling, 0 skips observations
+  const char *replay;      // input script to drive the game from
+  const char *record;      // input script to write the session to
+  RendererMode renderer;
+  bool indexed; // 8-bit palette-indexed buffer
+  bool crt;     // start with the CRT pass on
+  const char *assets; // directory with the sprite and stage sources
+  size_t stage;       // from 1
+};
+
+// Frame pacing state of a Display. A frame is late when it misses the
+// vblank or deadline it was paced for; uncapped frames never are.
+struct FramePacer {
+  PacingMode mode;
+  bool tear_control; // EXT_swap_control_tear, needed by PACING_ADAPTIVE
+  int swap_interval;
+  double refresh_interval; // seconds between vblanks
+  double cap_interval;     // seconds per frame in PACING_CAPPED
+  double spin;             // how long before a deadline a wait stops sleeping
+  double deadline;         // when the current capped frame is due, 0 unset
+  double last_swap;        // when the last swap returned, 0 unset
+  size_t frames, late;
+};
+
+// Window and GL objects presenting the buffer; unused when headless
+struct Display {
+  GLFWwindow *window;
+  GLuint texture;
+  GLuint vao;
+  GLuint program;
+  GLint palette_location; // -1 unless the buffer is indexed
+  PixelStream pixel_stream;
+  ProgramCache programs;
+  FramePacer pacer;
+
+  // With the CRT pass on, a frame is drawn into crt_texture at viewport
+  // size and then through crt_program onto the screen. Its cost is per
+  // output pixel on the GPU and a few calls on the CPU.
+  bool crt;
+  GLuint crt_program; // 0 when the pass couldn't be set up
+  GLuint crt_framebuffer, crt_texture;
+
+  ScalingMode scaling;
+  size_t buffer_width, buffer_height;
+  int viewport_x, viewport_y, viewport_width, viewport_height;
+  bool letterboxed; // the viewport leaves bars to clear
+};
+
+// Where a sprite bitmap sits in the atlas texture
+struct AtlasEntry {
+  uint16_t x, y;
+  uint16_t width, height;
+  const uint8_t *data; // source bitmap, copied in by sprite_atlas_rasterize
+};
+
+// Every sprite bitmap shelf-packed into one GL_R8 texture
+struct SpriteAtlas {
+  size_t width, height;
+  size_t num_entries;
+  AtlasEntry entries[SPRITE_ATLAS_MAX_ENTRIES];
+  size_t shelf_x, shelf_y, shelf_height; // packing cursor
+};
+
+// One quad of the instanced draw, in buffer pixels with y going up.
+// atlas_x is -1 for a solid fill.
+struct SpriteInstance {
+  int16_t x, y;
+  int16_t width, height;
+  int16_t atlas_x, atlas_y;
+  uint32_t color; // 0xAARRGGBB, fed to GL as GL_BGRA bytes
+};
+
+// Alternative to rasterizing into the Buffer: sprites are batched as
+// instances and drawn straight from the atlas with one draw call
+struct SpriteRenderer {
+  GLuint program;
+  GLuint vao;
+  GLuint instance_vbo;
+  GLuint atlas_texture;
+  GLint viewport_location;
+  size_t viewport_width, viewport_height;
+  size_t num_instances;
+  SpriteInstance instances[SPRITE_RENDERER_MAX_INSTANCES];
+};
+
+// Layers are drawn in this order. Within a layer draws are reordered to
+// batch them, so draws that overlap in one layer need the same color.
+enum RenderLayer : uint8_t {
+  LAYER_HUD,
+  LAYER_ALIENS,
+  LAYER_SHIELDS,
+  LAYER_BULLETS,
+  LAYER_PLAYER,
+  LAYER_NUM_LAYERS
+};
+
+enum RenderCommandType : uint8_t {
+  RENDER_SPRITE, // a sprite registered with the list
+  RENDER_BITMAP, // a bitmap of this frame only, like a text run or shield
+  RENDER_FILL,   // a rectangle
+  RENDER_NUM_TYPES
 };
 
-struct SpriteAnimation {
-  bool loop;
-  size_t num_frames;
-  size_t frame_duration;
-  size_t time;
-  Sprite **frames;
-};
+// One draw of a frame. Colors are palette indices, so the same list serves
+// either buffer format and the GPU renderer.
+struct RenderCommand {
+  uint8_t layer;
+  uint8_t type;
+  uint16_t sprite; // index into RenderList::sprites or ::bitmaps
+  int16_t x, y;
+  int16_t width, height; // of a fill
+  uint8_t color;
+};
+
+// A sprite as each backend draws it: a bitmask for the software paths and
+// an atlas entry for the GPU renderer
+struct RenderSprite {
+  CompiledSprite compiled;
+  int32_t atlas_entry; // -1 when not in the atlas
+};
+
+// What a frame draws, filled from a snapshot and sorted by layer and then
+// sprite, so a backend walks runs of the same sprite with its bitmask hot
+// in L1. Sprites are registered once at startup; bitmaps and commands are
+// reset every frame.
+struct RenderList {
+  size_t num_sprites;
+  RenderSprite sprites[RENDER_LIST_MAX_SPRITES];
+  size_t num_bitmaps;
+  CompiledSprite bitmaps[RENDER_LIST_MAX_BITMAPS];
+  size_t num_commands;
+  RenderCommand commands[RENDER_LIST_MAX_COMMANDS];
+};
+
+
+// The binary asset cache is these records at 4-byte aligned offsets from
+// the start of the file, in host byte order; a cache from another host
+// fails the magic check and is rebuilt.
+struct AssetCacheHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t source_stamp; // asset_source_stamp of the text it was built from
+  uint32_t size;         // of the whole file
+  uint32_t num_sprites, num_stages, num_atlas_entries;
+  uint32_t atlas_width, atlas_height;
+  uint32_t sprites_offset, stages_offset, atlas_offset;
+};
+
+struct AssetSprite {
+  char name[ASSET_NAME_SIZE];
+  uint16_t width, height;
+  uint16_t num_frames;
+  uint16_t stride;      // CompiledSprite::stride
+  uint32_t data_offset; // width * height texels per frame
+  uint32_t rows_offset; // height * stride words per frame
+  uint32_t atlas_entry; // of the first frame, the rest follow
+};
+
+// A formation of columns * rows cells holding alien types, 0 for none
+struct AssetStage {
+  char name[ASSET_NAME_SIZE];
+  uint16_t columns, rows;
+  uint16_t spacing_x, spacing_y; // between cell origins
+  uint16_t origin_x, origin_y;   // bottom-left cell on a 224x256 stage
+  uint16_t shields;              // at most GAME_MAX_SHIELDS
+  uint32_t cells_offset;
+};
+
+struct AssetAtlasEntry {
+  uint16_t x, y;
+  uint16_t width, height;
+  uint32_t data_offset;
+};
+
+// A cache while it is being built
+struct AssetBlob {
+  uint8_t *data;
+  size_t size, capacity;
+};
+
+struct AssetPack {
+  const uint8_t *base;
+  size_t size;
+  bool mapped; // else base is new[] memory holding a cache that was built
+               // but couldn't be written
+  const AssetCacheHeader *header;
+  const AssetSprite *sprites;
+  const AssetStage *stages;
+  const AssetAtlasEntry *atlas_entries;
+};
+
+//** Blit Kernels */
+// Wide fill and masked row store used by buffer_clear and the compiled
+// sprite blit, for 32-bit pixels and for 8-bit palette indices. The best
+// set for the running CPU is picked once by blit_kernels_init; the scalar
+// set is the reference.
+struct BlitKernels {
+  const char *name;
+  void (*fill)(uint32_t *dst, size_t count, uint32_t color);
+  // Writes color to dst[i] for every set bit i of mask. Bits at or above
+  // count are zero and dst[count..] is never touched.
+  void (*store_row)(uint32_t *dst, uint32_t mask, size_t count,
+                    uint32_t color);
+  void (*fill8)(uint8_t *dst, size_t count, uint8_t index);
+  void (*store_row8)(uint8_t *dst, uint32_t mask, size_t count,
+                     uint8_t index);
+};
+
+inline unsigned bit_scan_forward(uint32_t bits) {
+#if defined(_MSC_VER)
+  unsigned long index;
+  _BitScanForward(&index, bits);
+  return index;
+#else
+  return __builtin_ctz(bits);
+#endif
+}
+
+void fill_scalar(uint32_t *dst, size_t count, uint32_t color) {
+  for (size_t i = 0; i < count; ++i) {
+    dst[i] = color;
+  }
+}
+
+// Walks the set bits only, and mask is zero at and above count, so the
+// reference kernels need no bound of their own
+void store_row_scalar(uint32_t *dst, uint32_t mask, size_t /* count */,
+                      uint32_t color) {
+  while (mask) {
+    dst[bit_scan_forward(mask)] = color;
+    mask &= mask - 1;
+  }
+}
+
+void fill8_scalar(uint8_t *dst, size_t count, uint8_t index) {
+  for (size_t i = 0; i < count; ++i) {
+    dst[i] = index;
+  }
+}
+
+void store_row8_scalar(uint8_t *dst, uint32_t mask, size_t /* count */,
+                       uint8_t index) {
+  while (mask) {
+    dst[bit_scan_forward(mask)] = index;
+    mask &= mask - 1;
+  }
+}
+
+#if defined(BLIT_KERNELS_X86)
+void fill_sse2(uint32_t *dst, size_t count, uint32_t color) {
+  __m128i c = _mm_set1_epi32((int)color);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    _mm_storeu_si128((__m128i *)(dst + i), c);
+    _mm_storeu_si128((__m128i *)(dst + i + 4), c);
+    _mm_storeu_si128((__m128i *)(dst + i + 8), c);
+    _mm_storeu_si128((__m128i *)(dst + i + 12), c);
+  }
+  for (; i + 4 <= count; i += 4) {
+    _mm_storeu_si128((__m128i *)(dst + i), c);
+  }
+  for (; i < count; ++i) {
+    dst[i] = color;
+  }
+}
+
+void store_row_sse2(uint32_t *dst, uint32_t mask, size_t count,
+                    uint32_t color) {
+  const __m128i lanes = _mm_setr_epi32(1, 2, 4, 8);
+  __m128i c = _mm_set1_epi32((int)color);
+  size_t i = 0;
+  // SSE2 has no dword masked store, so blend whole 4-pixel groups that are
+  // known to lie inside the row
+  for (; i + 4 <= count; i += 4) {
+    uint32_t m = (mask >> i) & 0xF;
+    if (!m)
+      continue;
+
+    __m128i *p = (__m128i *)(dst + i);
+    if (m == 0xF) {
+      _mm_storeu_si128(p, c);
+    } else {
+      __m128i select =
+          _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32((int)m), lanes), lanes);
+      __m128i old = _mm_loadu_si128(p);
+      _mm_storeu_si128(p, _mm_or_si128(_mm_and_si128(select, c),
+                                       _mm_andnot_si128(select, old)));
+    }
+  }
+  if (i < count)
+    store_row_scalar(dst + i, mask >> i, count - i, color);
+}
+
+void fill8_sse2(uint8_t *dst, size_t count, uint8_t index) {
+  __m128i c = _mm_set1_epi8((char)index);
+  size_t i = 0;
+  for (; i + 64 <= count; i += 64) {
+    _mm_storeu_si128((__m128i *)(dst + i), c);
+    _mm_storeu_si128((__m128i *)(dst + i + 16), c);
+    _mm_storeu_si128((__m128i *)(dst + i + 32), c);
+    _mm_storeu_si128((__m128i *)(dst + i + 48), c);
+  }
+  for (; i + 16 <= count; i += 16) {
+    _mm_storeu_si128((__m128i *)(dst + i), c);
+  }
+  for (; i < count; ++i) {
+    dst[i] = index;
+  }
+}
+
+void store_row8_sse2(uint8_t *dst, uint32_t mask, size_t count,
+                     uint8_t index) {
+  const __m128i lanes = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char)128, 1, 2,
+                                      4, 8, 16, 32, 64, (char)128);
+  __m128i c = _mm_set1_epi8((char)index);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    uint32_t m = (mask >> i) & 0xFFFF;
+    if (!m)
+      continue;
+
+    __m128i *p = (__m128i *)(dst + i);
+    if (m == 0xFFFF) {
+      _mm_storeu_si128(p, c);
+    } else {
+      // Low byte of m to bytes 0-7, high byte to bytes 8-15
+      __m128i bytes = _mm_cvtsi32_si128((int)m);
+      bytes = _mm_unpacklo_epi8(bytes, bytes);
+      bytes = _mm_unpacklo_epi16(bytes, bytes);
+      bytes = _mm_unpacklo_epi32(bytes, bytes);
+      __m128i select = _mm_cmpeq_epi8(_mm_and_si128(bytes, lanes), lanes);
+      __m128i old = _mm_loadu_si128(p);
+      _mm_storeu_si128(p, _mm_or_si128(_mm_and_si128(select, c),
+                                       _mm_andnot_si128(select, old)));
+    }
+  }
+  if (i < count)
+    store_row8_scalar(dst + i, mask >> i, count - i, index);
+}
+
+#if defined(BLIT_KERNELS_AVX2)
+__attribute__((target("avx2"))) void fill_avx2(uint32_t *dst, size_t count,
+                                                uint32_t color) {
+  __m256i c = _mm256_set1_epi32((int)color);
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32) {
+    _mm256_storeu_si256((__m256i *)(dst + i), c);
+    _mm256_storeu_si256((__m256i *)(dst + i + 8), c);
+    _mm256_storeu_si256((__m256i *)(dst + i + 16), c);
+    _mm256_storeu_si256((__m256i *)(dst + i + 24), c);
+  }
+  for (; i + 8 <= count; i += 8) {
+    _mm256_storeu_si256((__m256i *)(dst + i), c);
+  }
+  for (; i < count; ++i) {
+    dst[i] = color;
+  }
+}
+
+__attribute__((target("avx2"))) void
+store_row_avx2(uint32_t *dst, uint32_t mask, size_t count, uint32_t color) {
+  const __m256i lanes = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  __m256i c = _mm256_set1_epi32((int)color);
+  // Masked-out lanes are neither written nor faulted, so every 8-pixel group
+  // is a single store even at the end of the row
+  for (size_t i = 0; i < count; i += 8) {
+    uint32_t m = (mask >> i) & 0xFF;
+    if (!m)
+      continue;
+
+    __m256i select = _mm256_cmpeq_epi32(
+        _mm256_and_si256(_mm256_set1_epi32((int)m), lanes), lanes);
+    _mm256_maskstore_epi32((int *)(dst + i), select, c);
+  }
+}
+
+__attribute__((target("avx2"))) void fill8_avx2(uint8_t *dst, size_t count,
+                                                 uint8_t index) {
+  __m256i c = _mm256_set1_epi8((char)index);
+  size_t i = 0;
+  for (; i + 128 <= count; i += 128) {
+    _mm256_storeu_si256((__m256i *)(dst + i), c);
+    _mm256_storeu_si256((__m256i *)(dst + i + 32), c);
+    _mm256_storeu_si256((__m256i *)(dst + i + 64), c);
+    _mm256_storeu_si256((__m256i *)(dst + i + 96), c);
+  }
+  for (; i + 32 <= count; i += 32) {
+    _mm256_storeu_si256((__m256i *)(dst + i), c);
+  }
+  for (; i < count; ++i) {
+    dst[i] = index;
+  }
+}
+
+// There is no byte maskstore, so only a full 32-pixel word is blended in
+// one go; shorter rows take the 16-pixel path
+__attribute__((target("avx2"))) void
+store_row8_avx2(uint8_t *dst, uint32_t mask, size_t count, uint8_t index) {
+  if (count < 32) {
+    store_row8_sse2(dst, mask, count, index);
+    return;
+  }
+
+  const __m256i spread =
+      _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2,
+                       2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+  const __m256i lanes = _mm256_set1_epi64x(0x8040201008040201ll);
+  __m256i c = _mm256_set1_epi8((char)index);
+  __m256i *p = (__m256i *)dst;
+  if (mask == 0xFFFFFFFFu) {
+    _mm256_storeu_si256(p, c);
+    return;
+  }
+
+  // Byte j of the mask goes to bytes 8j..8j+7, then each byte to its bit
+  __m256i bytes =
+      _mm256_shuffle_epi8(_mm256_set1_epi32((int)mask), spread);
+  __m256i select =
+      _mm256_cmpeq_epi8(_mm256_and_si256(bytes, lanes), lanes);
+  _mm256_storeu_si256(p, _mm256_blendv_epi8(_mm256_loadu_si256(p), c, select));
+}
+#endif
+#endif
+
+#if defined(BLIT_KERNELS_NEON)
+void fill_neon(uint32_t *dst, size_t count, uint32_t color) {
+  uint32x4_t c = vdupq_n_u32(color);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    vst1q_u32(dst + i, c);
+    vst1q_u32(dst + i + 4, c);
+    vst1q_u32(dst + i + 8, c);
+    vst1q_u32(dst + i + 12, c);
+  }
+  for (; i + 4 <= count; i += 4) {
+    vst1q_u32(dst + i, c);
+  }
+  for (; i < count; ++i) {
+    dst[i] = color;
+  }
+}
+
+void store_row_neon(uint32_t *dst, uint32_t mask, size_t count,
+                    uint32_t color) {
+  const uint32_t lane_bits[4] = {1, 2, 4, 8};
+  const uint32x4_t lanes = vld1q_u32(lane_bits);
+  uint32x4_t c = vdupq_n_u32(color);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    uint32_t m = (mask >> i) & 0xF;
+    if (!m)
+      continue;
+
+    if (m == 0xF) {
+      vst1q_u32(dst + i, c);
+    } else {
+      uint32x4_t select = vtstq_u32(vdupq_n_u32(m), lanes);
+      vst1q_u32(dst + i, vbslq_u32(select, c, vld1q_u32(dst + i)));
+    }
+  }
+  if (i < count)
+    store_row_scalar(dst + i, mask >> i, count - i, color);
+}
+
+void fill8_neon(uint8_t *dst, size_t count, uint8_t index) {
+  uint8x16_t c = vdupq_n_u8(index);
+  size_t i = 0;
+  for (; i + 64 <= count; i += 64) {
+    vst1q_u8(dst + i, c);
+    vst1q_u8(dst + i + 16, c);
+    vst1q_u8(dst + i + 32, c);
+    vst1q_u8(dst + i + 48, c);
+  }
+  for (; i + 16 <= count; i += 16) {
+    vst1q_u8(dst + i, c);
+  }
+  for (; i < count; ++i) {
+    dst[i] = index;
+  }
+}
+
+void store_row8_neon(uint8_t *dst, uint32_t mask, size_t count,
+                     uint8_t index) {
+  const uint8_t lane_bits[16] = {1, 2, 4, 8, 16, 32, 64, 128,
+                                 1, 2, 4, 8, 16, 32, 64, 128};
+  const uint8x16_t lanes = vld1q_u8(lane_bits);
+  uint8x16_t c = vdupq_n_u8(index);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    uint32_t m = (mask >> i) & 0xFFFF;
+    if (!m)
+      continue;
+
+    if (m == 0xFFFF) {
+      vst1q_u8(dst + i, c);
+    } else {
+      uint8x16_t bytes =
+          vcombine_u8(vdup_n_u8(m & 0xFF), vdup_n_u8((m >> 8) & 0xFF));
+      uint8x16_t select = vtstq_u8(bytes, lanes);
+      vst1q_u8(dst + i, vbslq_u8(select, c, vld1q_u8(dst + i)));
+    }
+  }
+  if (i < count)
+    store_row8_scalar(dst + i, mask >> i, count - i, index);
+}
+#endif
+
+const BlitKernels blit_kernel_sets[] = {
+#if defined(BLIT_KERNELS_AVX2)
+    {"avx2", fill_avx2, store_row_avx2, fill8_avx2, store_row8_avx2},
+#endif
+#if defined(BLIT_KERNELS_X86)
+    {"sse2", fill_sse2, store_row_sse2, fill8_sse2, store_row8_sse2},
+#endif
+#if defined(BLIT_KERNELS_NEON)
+    {"neon", fill_neon, store_row_neon, fill8_neon, store_row8_neon},
+#endif
+    {"scalar", fill_scalar, store_row_scalar, fill8_scalar,
+     store_row8_scalar},
+};
+const size_t num_blit_kernel_sets =
+    sizeof(blit_kernel_sets) / sizeof(blit_kernel_sets[0]);
+
+BlitKernels blit_kernels = {"scalar", fill_scalar, store_row_scalar,
+                            fill8_scalar, store_row8_scalar};
+
+bool blit_kernels_supported(const BlitKernels &kernels) {
+#if defined(BLIT_KERNELS_AVX2)
+  if (kernels.fill == fill_avx2)
+    return __builtin_cpu_supports("avx2");
+#endif
+  (void)kernels;
+  return true;
+}
+
+// Picks the kernel set called name, or the widest one the CPU supports when
+// name is null. Returns false if the requested set is unavailable.
+bool blit_kernels_init(const char *name = 0) {
+  for (size_t i = 0; i < num_blit_kernel_sets; ++i) {
+    const BlitKernels &kernels = blit_kernel_sets[i];
+    if (name && strcmp(name, kernels.name) != 0)
+      continue;
+    if (!blit_kernels_supported(kernels))
+      continue;
+
+    blit_kernels = kernels;
+    return true;
+  }
+
+  return false;
+}
+
+// Sprites the simulation needs for collision and placement
+struct GameAssets {
+  const Sprite *player_sprite;
+  const CompiledSprite *compiled_player_sprite;
+  const Sprite *bullet_sprite;
+  const Sprite *alien_death_sprite;
+  const CompiledSprite *compiled_bullet_sprite;
+  const CompiledSprite *compiled_shield_hit; // blasted out of a shield
+  const SpriteAnimation *alien_animation;    // one per alien type
+};
+
+//** Arena */
+void arena_init(Arena *arena, const char *name, size_t capacity) {
+  arena->name = name;
+  arena->base = new uint8_t[capacity];
+  arena->capacity = capacity;
+  arena->used = 0;
+}
+
+void arena_free(Arena *arena) {
+  delete[] arena->base;
+  arena->base = 0;
+  arena->capacity = 0;
+  arena->used = 0;
+}
+
+// Returns size zeroed bytes, or null when the arena is full. Arenas are
+// sized up front, so only allocations of unbounded size need to check.
+void *arena_alloc(Arena *arena, size_t size) {
+  size_t offset = (arena->used + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+  if (offset > arena->capacity || size > arena->capacity - offset) {
+    fprintf(stderr, "Arena %s out of memory: %zu of %zu bytes used, %zu more\n",
+            arena->name, arena->used, arena->capacity, size);
+    return 0;
+  }
+
+  arena->used = offset + size;
+  return memset(arena->base + offset, 0, size);
+}
+
+template <typename T> T *arena_push(Arena *arena, size_t count = 1) {
+  return (T *)arena_alloc(arena, count * sizeof(T));
+}
+
+// Frees everything allocated since used was mark
+void arena_reset(Arena *arena, size_t mark = 0) { arena->used = mark; }
+
+//** Helper Functions */
+// history must exceed the age of the memory the buffer is drawn into (see
+// buffer_begin_frame), 2 for a buffer that is reused every frame.
+void dirty_region_init(DirtyRegion *region, Arena *arena, size_t width,
+                       size_t height, size_t history = 2) {
+  region->tiles_x = (width + DIRTY_TILE_SIZE - 1) / DIRTY_TILE_SIZE;
+  region->tiles_y = (height + DIRTY_TILE_SIZE - 1) / DIRTY_TILE_SIZE;
+  region->history = history;
+  region->current = 0;
+
+  // Nothing is known about the buffer yet, so the first frames clear and
+  // upload all of it
+  size_t num_tiles = region->tiles_x * region->tiles_y;
+  for (size_t i = 0; i < history; ++i) {
+    region->frames[i] = arena_push<uint8_t>(arena, num_tiles);
+    memset(region->frames[i], 1, num_tiles);
+  }
+}
+
+// Flags of the frame drawn age frames ago, 0 being the current one
+inline uint8_t *dirty_region_frame(const DirtyRegion &region, size_t age) {
+  return region.frames[(region.current + region.history - age) %
+                       region.history];
+}
+
+// Marks the rectangle x..x+width-1, y..y+height-1. Coordinates that wrapped
+// below zero are clipped the same way the draw calls clip them.
+void buffer_mark_dirty(Buffer *buffer, size_t x, size_t y, size_t width,
+                       size_t height) {
+  DirtyRegion *region = buffer->dirty;
+  if (!region)
+    return;
+
+  ptrdiff_t x0 = (ptrdiff_t)x;
+  ptrdiff_t y0 = (ptrdiff_t)y;
+  ptrdiff_t x1 = x0 + (ptrdiff_t)width;
+  ptrdiff_t y1 = y0 + (ptrdiff_t)height;
+  if (x0 < 0)
+    x0 = 0;
+  if (y0 < 0)
+    y0 = 0;
+  if (x1 > (ptrdiff_t)buffer->width)
+    x1 = buffer->width;
+  if (y1 > (ptrdiff_t)buffer->height)
+    y1 = buffer->height;
+  if (x0 >= x1 || y0 >= y1)
+    return;
+
+  for (ptrdiff_t ty = y0 / DIRTY_TILE_SIZE; ty <= (y1 - 1) / DIRTY_TILE_SIZE;
+       ++ty) {
+    uint8_t *flags = region->frames[region->current] + ty * region->tiles_x;
+    for (ptrdiff_t tx = x0 / DIRTY_TILE_SIZE;
+         tx <= (x1 - 1) / DIRTY_TILE_SIZE; ++tx) {
+      flags[tx] = 1;
+    }
+  }
+}
+
+size_t buffer_pixel_size(const Buffer &buffer) {
+  return buffer.indices ? 1 : sizeof(uint32_t);
+}
+
+uint8_t *buffer_pixels(const Buffer &buffer) {
+  return buffer.indices ? buffer.indices : (uint8_t *)buffer.data;
+}
+
+// Fills count pixels starting at pixel offset
+inline void buffer_fill_span(Buffer *buffer, size_t offset, size_t count,
+                             uint32_t color) {
+  if (buffer->indices)
+    blit_kernels.fill8(buffer->indices + offset, count, color);
+  else
+    blit_kernels.fill(buffer->data + offset, count, color);
+}
+
+// Fills an already clipped rectangle
+void buffer_fill_rows(Buffer *buffer, size_t x, size_t y, size_t width,
+                      size_t height, uint32_t color) {
+  if (width == buffer->width) {
+    buffer_fill_span(buffer, y * buffer->width, width * height, color);
+    return;
+  }
+
+  for (size_t yi = y; yi < y + height; ++yi) {
+    buffer_fill_span(buffer, yi * buffer->width + x, width, color);
+  }
+}
+
+// The compiled blit restricted to buffer rows row_begin..row_end-1. Clips
+// once per blit, including the wrap-around clipping of coordinates that
+// went "negative", and hands each clipped row mask to the masked row store.
+void buffer_sprite_draw_rows(Buffer *buffer, const CompiledSprite &sprite,
+                             size_t x, size_t y, uint32_t color,
+                             size_t row_begin, size_t row_end) {
+  ptrdiff_t x0 = (ptrdiff_t)x;
+  ptrdiff_t y0 = (ptrdiff_t)y;
+  ptrdiff_t width = (ptrdiff_t)sprite.width;
+  ptrdiff_t height = (ptrdiff_t)sprite.height;
+
+  ptrdiff_t xi_begin = x0 < 0 ? -x0 : 0;
+  ptrdiff_t xi_end = (ptrdiff_t)buffer->width - x0;
+  if (xi_end > width)
+    xi_end = width;
+
+  // Row yi lands on buffer row y + height - 1 - yi
+  ptrdiff_t yi_begin = y0 + height - (ptrdiff_t)row_end;
+  if (yi_begin < 0)
+    yi_begin = 0;
+  ptrdiff_t yi_end = y0 + height - (ptrdiff_t)row_begin;
+  if (yi_end > height)
+    yi_end = height;
+
+  if (xi_begin >= xi_end || yi_begin >= yi_end)
+    return;
+
+  size_t word_begin = xi_begin / 32;
+  size_t word_end = (xi_end + 31) / 32;
+
+  for (ptrdiff_t yi = yi_begin; yi < yi_end; ++yi) {
+    ptrdiff_t row = (y0 + height - 1 - yi) * (ptrdiff_t)buffer->width + x0;
+    const uint32_t *words = sprite.rows + yi * sprite.stride;
+
+    for (size_t w = word_begin; w < word_end; ++w) {
+      ptrdiff_t bit0 = (ptrdiff_t)w * 32;
+      ptrdiff_t lo = xi_begin > bit0 ? xi_begin : bit0;
+      ptrdiff_t hi = xi_end < bit0 + 32 ? xi_end : bit0 + 32;
+
+      uint32_t bits = words[w] >> (lo - bit0);
+      if (hi - lo < 32)
+        bits &= ~(~0u << (hi - lo));
+      if (!bits)
+        continue;
+      if (buffer->indices)
+        blit_kernels.store_row8(buffer->indices + row + lo, bits, hi - lo,
+                                color);
+      else
+        blit_kernels.store_row(buffer->data + row + lo, bits, hi - lo, color);
+    }
+  }
+}
+
+void rasterizer_draw_band(Rasterizer *raster, size_t band) {
+  Buffer *buffer = raster->buffer;
+  size_t row_begin = band * raster->band_height;
+  size_t row_end = std::min(row_begin + raster->band_height, buffer->height);
+
+  for (size_t i = 0; i < raster->bin_sizes[band]; ++i) {
+    const RasterCommand &command = raster->commands[raster->bins[band][i]];
+    if (command.type == RASTER_SPRITE) {
+      buffer_sprite_draw_rows(buffer, command.sprite, command.x, command.y,
+                              command.color, row_begin, row_end);
+    } else {
+      size_t y = std::max(command.y, row_begin);
+      size_t y_end = std::min(command.y + command.height, row_end);
+      buffer_fill_rows(buffer, command.x, y, command.width, y_end - y,
+                       command.color);
+    }
+  }
+}
+
+// Draws bands until the tickets below end are taken. Tickets only count
+// up, so a worker still leaving an earlier flush never takes one of this
+// flush's bands.
+void rasterizer_run(Rasterizer *raster, size_t end) {
+  size_t first = end - raster->num_bands;
+  size_t ticket = raster->next_band.load();
+  while (ticket < end) {
+    if (!raster->next_band.compare_exchange_weak(ticket, ticket + 1))
+      continue;
+
+    rasterizer_draw_band(raster, ticket - first);
+    if (raster->bands_done.fetch_add(1) + 1 == end) {
+      std::lock_guard<std::mutex> lock(raster->mutex);
+      raster->done.notify_one();
+    }
+    ticket = raster->next_band.load();
+  }
+}
+
+void rasterizer_worker(Rasterizer *raster) {
+  size_t generation = 0;
+  for (;;) {
+    size_t end;
+    {
+      std::unique_lock<std::mutex> lock(raster->mutex);
+      while (!raster->quit && raster->generation == generation)
+        raster->wake.wait(lock);
+      if (raster->quit)
+        return;
+      generation = raster->generation;
+      end = raster->band_end;
+    }
+    rasterizer_run(raster, end);
+  }
+}
+
+// Splits the buffer into about four bands per thread, each starting on a
+// cache line so no two threads write the same line, and starts
+// num_threads - 1 workers; the thread flushing makes up the rest.
+void rasterizer_init(Rasterizer *raster, const Buffer &buffer,
+                     size_t num_threads) {
+  size_t row_size = buffer.width * buffer_pixel_size(buffer);
+  size_t common = CACHE_LINE_SIZE;
+  for (size_t rest = row_size % common; rest;) {
+    size_t next = common % rest;
+    common = rest;
+    rest = next;
+  }
+  size_t line_rows = CACHE_LINE_SIZE / common;
+
+  size_t num_bands = std::min((size_t)RASTER_MAX_BANDS, 4 * num_threads);
+  size_t band_height = (buffer.height + num_bands - 1) / num_bands;
+  band_height = (band_height + line_rows - 1) / line_rows * line_rows;
+  raster->band_height = band_height;
+  raster->num_bands = (buffer.height + band_height - 1) / band_height;
+
+  raster->num_threads = num_threads;
+  raster->num_commands = 0;
+  memset(raster->bin_sizes, 0, sizeof(raster->bin_sizes));
+  raster->buffer = 0;
+  raster->generation = 0;
+  raster->band_end = 0;
+  raster->quit = false;
+  raster->next_band.store(0);
+  raster->bands_done.store(0);
+  for (size_t i = 0; i + 1 < num_threads; ++i) {
+    raster->workers[i] = std::thread(rasterizer_worker, raster);
+  }
+}
+
+void rasterizer_free(Rasterizer *raster) {
+  {
+    std::lock_guard<std::mutex> lock(raster->mutex);
+    raster->quit = true;
+  }
+  raster->wake.notify_all();
+  for (size_t i = 0; i + 1 < raster->num_threads; ++i) {
+    raster->workers[i].join();
+  }
+}
+
+// Draws everything queued; returns once the buffer holds the result
+void rasterizer_flush(Rasterizer *raster, Buffer *buffer) {
+  if (raster->num_commands == 0)
+    return;
+
+  size_t end;
+  {
+    std::lock_guard<std::mutex> lock(raster->mutex);
+    raster->buffer = buffer;
+    raster->band_end += raster->num_bands;
+    end = raster->band_end;
+    ++raster->generation;
+  }
+  raster->wake.notify_all();
+  rasterizer_run(raster, end);
+
+  {
+    std::unique_lock<std::mutex> lock(raster->mutex);
+    while (raster->bands_done.load() != end)
+      raster->done.wait(lock);
+  }
+  raster->num_commands = 0;
+  memset(raster->bin_sizes, 0, sizeof(raster->bin_sizes));
+}
+
+// Queues a command touching buffer rows row_begin..row_end-1 and bins it
+// into the bands those rows fall in. A full list is flushed first.
+void rasterizer_push(Rasterizer *raster, Buffer *buffer,
+                     const RasterCommand &command, size_t row_begin,
+                     size_t row_end) {
+  if (row_begin >= row_end)
+    return;
+  if (raster->num_commands == RASTER_MAX_COMMANDS)
+    rasterizer_flush(raster, buffer);
+
+  size_t index = raster->num_commands++;
+  raster->commands[index] = command;
+  for (size_t band = row_begin / raster->band_height;
+       band <= (row_end - 1) / raster->band_height; ++band) {
+    raster->bins[band][raster->bin_sizes[band]++] = index;
+  }
+}
+
+// Fills an already clipped rectangle, or queues the fill
+void buffer_fill_clipped(Buffer *buffer, size_t x, size_t y, size_t width,
+                         size_t height, uint32_t color) {
+  if (!buffer->raster) {
+    buffer_fill_rows(buffer, x, y, width, height, color);
+    return;
+  }
+
+  RasterCommand command;
+  command.type = RASTER_FILL;
+  command.color = color;
+  command.x = x;
+  command.y = y;
+  command.width = width;
+  command.height = height;
+  rasterizer_push(buffer->raster, buffer, command, y, y + height);
+}
+
+void buffer_fill_rect(Buffer *buffer, size_t x, size_t y, size_t width,
+                      size_t height, uint32_t color) {
+  if (x >= buffer->width || y >= buffer->height)
+    return;
+  if (width > buffer->width - x)
+    width = buffer->width - x;
+  if (height > buffer->height - y)
+    height = buffer->height - y;
+
+  buffer_fill_clipped(buffer, x, y, width, height, color);
+  buffer_mark_dirty(buffer, x, y, width, height);
+}
+
+// Starts a frame by resetting the buffer to color, which must be the same
+// color every frame. age is how many frames ago the pixels last held a
+// finished frame: 1 for a single buffer, the ring size when frames rotate
+// through several. Only the tiles drawn in that frame need clearing, the
+// rest still hold color from an earlier clear.
+void buffer_begin_frame(Buffer *buffer, uint32_t color, size_t age = 1) {
+  DirtyRegion *region = buffer->dirty;
+  if (!region) {
+    buffer_fill_clipped(buffer, 0, 0, buffer->width, buffer->height, color);
+    return;
+  }
+
+  region->current = (region->current + 1) % region->history;
+  memset(region->frames[region->current], 0,
+         region->tiles_x * region->tiles_y);
+  const uint8_t *drawn = dirty_region_frame(*region, age);
+
+  for (size_t ty = 0; ty < region->tiles_y; ++ty) {
+    const uint8_t *flags = drawn + ty * region->tiles_x;
+    size_t y = ty * DIRTY_TILE_SIZE;
+    size_t height = buffer->height - y < DIRTY_TILE_SIZE ? buffer->height - y
+                                                         : DIRTY_TILE_SIZE;
+
+    for (size_t tx = 0; tx < region->tiles_x;) {
+      if (!flags[tx]) {
+        ++tx;
+        continue;
+      }
+
+      size_t run_begin = tx;
+      while (tx < region->tiles_x && flags[tx])
+        ++tx;
+
+      size_t x = run_begin * DIRTY_TILE_SIZE;
+      size_t width = tx * DIRTY_TILE_SIZE - x;
+      if (width > buffer->width - x)
+        width = buffer->width - x;
+      buffer_fill_clipped(buffer, x, y, width, height, color);
+    }
+  }
+}
+
+// Collects the pixels that changed since the last frame shown, i.e. the
+// union of this and last frame's dirty tiles, as horizontal runs of tiles.
+// A run that repeats the one on the tile row above extends that rectangle
+// instead.
+// Returns the number of rectangles: one full-buffer rectangle when untracked
+// or when the region is too fragmented for max_rects.
+size_t buffer_dirty_rects(const Buffer *buffer, DirtyRect *rects,
+                          size_t max_rects) {
+  const DirtyRegion *region = buffer->dirty;
+  size_t num_rects = 0;
+
+  for (size_t ty = 0; region && ty < region->tiles_y; ++ty) {
+    const uint8_t *current =
+        dirty_region_frame(*region, 0) + ty * region->tiles_x;
+    const uint8_t *previous =
+        dirty_region_frame(*region, 1) + ty * region->tiles_x;
+    size_t y = ty * DIRTY_TILE_SIZE;
+    size_t height = buffer->height - y < DIRTY_TILE_SIZE ? buffer->height - y
+                                                         : DIRTY_TILE_SIZE;
+
+    for (size_t tx = 0; tx < region->tiles_x;) {
+      if (!(current[tx] | previous[tx])) {
+        ++tx;
+        continue;
+      }
+
+      size_t run_begin = tx;
+      while (tx < region->tiles_x && (current[tx] | previous[tx]))
+        ++tx;
+
+      size_t x = run_begin * DIRTY_TILE_SIZE;
+      size_t width = tx * DIRTY_TILE_SIZE - x;
+      if (width > buffer->width - x)
+        width = buffer->width - x;
+
+      size_t i = 0;
+      while (i < num_rects && !(rects[i].x == x && rects[i].width == width &&
+                                rects[i].y + rects[i].height == y))
+        ++i;
+
+      if (i < num_rects) {
+        rects[i].height += height;
+      } else if (num_rects < max_rects) {
+        DirtyRect &rect = rects[num_rects++];
+        rect.x = x;
+        rect.y = y;
+        rect.width = width;
+        rect.height = height;
+      } else {
+        region = 0;
+        break;
+      }
+    }
+  }
+
+  if (!region && max_rects > 0) {
+    rects[0].x = 0;
+    rects[0].y = 0;
+    rects[0].width = buffer->width;
+    rects[0].height = buffer->height;
+    num_rects = 1;
+  }
+
+  return num_rects;
+}
+
+void buffer_sprite_draw(Buffer *buffer, const Sprite &sprite, size_t x,
+                        size_t y, uint32_t color) {
+  buffer_mark_dirty(buffer, x, y, sprite.width, sprite.height);
+  if (buffer->raster)
+    rasterizer_flush(buffer->raster, buffer); // keep the drawing order
+  for (size_t xi = 0; xi < sprite.width; ++xi) {
+    for (size_t yi = 0; yi < sprite.height; ++yi) {
+      size_t sy = sprite.height - 1 + y - yi;
+      size_t sx = x + xi;
+      if (sprite.data[yi * sprite.width + xi] && sy < buffer->height &&
+          sx < buffer->width) {
+        if (buffer->indices)
+          buffer->indices[sy * buffer->width + sx] = color;
+        else
+          buffer->data[sy * buffer->width + sx] = color;
+      }
+    }
+  }
+}
+
+// Compiles num_frames consecutive bitmaps of the sprite's size (e.g. a
+// spritesheet) into row bitmasks.
+CompiledSprite sprite_compile(const Sprite &sprite, size_t num_frames = 1) {
+  CompiledSprite compiled;
+  compiled.width = sprite.width;
+  compiled.height = sprite.height;
+  compiled.stride = (sprite.width + 31) / 32;
+
+  size_t num_rows = sprite.height * num_frames;
+  compiled.rows = new uint32_t[num_rows * compiled.stride]();
+  for (size_t row = 0; row < num_rows; ++row) {
+    const uint8_t *texels = sprite.data + row * sprite.width;
+    uint32_t *words = compiled.rows + row * compiled.stride;
+    for (size_t xi = 0; xi < sprite.width; ++xi) {
+      if (texels[xi])
+        words[xi / 32] |= 1u << (xi % 32);
+    }
+  }
+
+  return compiled;
+}
+
+Sprite sprite_frame(const Sprite &sheet, size_t frame) {
+  Sprite sprite = sheet;
+  sprite.data = sheet.data + frame * sheet.width * sheet.height;
+  return sprite;
+}
+
+CompiledSprite compiled_sprite_frame(const CompiledSprite &sheet,
+                                     size_t frame) {
+  CompiledSprite sprite = sheet;
+  sprite.rows = sheet.rows + frame * sheet.height * sheet.stride;
+  return sprite;
+}
+
+// Pixel-identical to buffer_sprite_draw, but clips once per blit and
+// stores whole row masks (see buffer_sprite_draw_rows)
+void buffer_sprite_draw(Buffer *buffer, const CompiledSprite &sprite,
+                        size_t x, size_t y, uint32_t color) {
+  buffer_mark_dirty(buffer, x, y, sprite.width, sprite.height);
+  if (!buffer->raster) {
+    buffer_sprite_draw_rows(buffer, sprite, x, y, color, 0, buffer->height);
+    return;
+  }
+
+  ptrdiff_t y0 = (ptrdiff_t)y;
+  ptrdiff_t y1 = y0 + (ptrdiff_t)sprite.height;
+  if (y1 <= 0 || y0 >= (ptrdiff_t)buffer->height)
+    return;
+
+  RasterCommand command;
+  command.type = RASTER_SPRITE;
+  command.color = color;
+  command.x = x;
+  command.y = y;
+  command.sprite = sprite;
+  rasterizer_push(buffer->raster, buffer, command, y0 < 0 ? 0 : y0,
+                  std::min(y1, (ptrdiff_t)buffer->height));
+}
+
+void buffer_draw_text(Buffer *buffer, const Sprite &text_spritesheet,
+                      const char *text, size_t x, size_t y, uint32_t color) {
+  size_t xp = x;
+  size_t stride = text_spritesheet.width * text_spritesheet.height;
+  Sprite sprite = text_spritesheet;
+  for (const char *charp = text; *charp != '\0'; ++charp) {
+    char character = *charp - 32;
+    if (character < 0 || character >= 65)
+      continue;
+
+    sprite.data = text_spritesheet.data + character * stride;
+    buffer_sprite_draw(buffer, sprite, xp, y, color);
+    xp += sprite.width + 1;
+  }
+}
+
+void buffer_draw_number(Buffer *buffer, const Sprite &number_spritesheet,
+                        size_t number, size_t x, size_t y, uint32_t color) {
+  uint8_t digits[64];
+  size_t num_digits = 0;
+
+  size_t current_number = number;
+  do {
+    digits[num_digits++] = current_number % 10;
+    current_number = current_number / 10;
+  } while (current_number > 0);
+
+  size_t xp = x;
+  size_t stride = number_spritesheet.width * number_spritesheet.height;
+  Sprite sprite = number_spritesheet;
+  for (size_t i = 0; i < num_digits; ++i) {
+    uint8_t digit = digits[num_digits - i - 1];
+    sprite.data = number_spritesheet.data + digit * stride;
+    buffer_sprite_draw(buffer, sprite, xp, y, color);
+    xp += sprite.width + 1;
+  }
+}
+
+void buffer_draw_text(Buffer *buffer, const CompiledSprite &text_spritesheet,
+                      const char *text, size_t x, size_t y, uint32_t color) {
+  size_t xp = x;
+  for (const char *charp = text; *charp != '\0'; ++charp) {
+    char character = *charp - 32;
+    if (character < 0 || character >= 65)
+      continue;
+
+    buffer_sprite_draw(buffer,
+                       compiled_sprite_frame(text_spritesheet, character), xp,
+                       y, color);
+    xp += text_spritesheet.width + 1;
+  }
+}
+
+void buffer_draw_number(Buffer *buffer,
+                        const CompiledSprite &number_spritesheet,
+                        size_t number, size_t x, size_t y, uint32_t color) {
+  uint8_t digits[64];
+  size_t num_digits = 0;
+
+  size_t current_number = number;
+  do {
+    digits[num_digits++] = current_number % 10;
+    current_number = current_number / 10;
+  } while (current_number > 0);
+
+  size_t xp = x;
+  for (size_t i = 0; i < num_digits; ++i) {
+    uint8_t digit = digits[num_digits - i - 1];
+    buffer_sprite_draw(buffer, compiled_sprite_frame(number_spritesheet, digit),
+                       xp, y, color);
+    xp += number_spritesheet.width + 1;
+  }
+}
+
+void text_run_init(TextRun *run, Arena *arena) {
+  run->arena = arena;
+  run->sprite.width = 0;
+  run->sprite.height = 0;
+  run->sprite.stride = 0;
+  run->sprite.rows = 0;
+  run->capacity = 0;
+  run->number = 0;
+  run->valid = false;
+}
+
+// Lays the glyphs out the way buffer_draw_text spaces them
+void text_run_build(TextRun *run, const CompiledSprite &spritesheet,
+                    const uint8_t *glyphs, size_t num_glyphs) {
+  CompiledSprite &sprite = run->sprite;
+  sprite.width = num_glyphs ? num_glyphs * (spritesheet.width + 1) - 1 : 0;
+  sprite.height = spritesheet.height;
+  sprite.stride = (sprite.width + 31) / 32;
+
+  size_t words = sprite.height * sprite.stride;
+  // Outgrown rows stay in the arena; a number only outgrows them a few
+  // times
+  if (words > run->capacity) {
+    sprite.rows = arena_push<uint32_t>(run->arena, words);
+    run->capacity = words;
+  }
+  memset(sprite.rows, 0, words * sizeof(uint32_t));
+
+  for (size_t i = 0; i < num_glyphs; ++i) {
+    CompiledSprite glyph = compiled_sprite_frame(spritesheet, glyphs[i]);
+    size_t xp = i * (spritesheet.width + 1);
+    for (size_t yi = 0; yi < glyph.height; ++yi) {
+      // Glyphs are narrower than a word, so each row is one mask to shift
+      uint64_t mask = (uint64_t)glyph.rows[yi * glyph.stride] << (xp % 32);
+      uint32_t *row = sprite.rows + yi * sprite.stride + xp / 32;
+      row[0] |= (uint32_t)mask;
+      if (mask >> 32)
+        row[1] |= (uint32_t)(mask >> 32);
+    }
+  }
+  run->valid = true;
+}
+
+void text_run_set_text(TextRun *run, const CompiledSprite &text_spritesheet,
+                       const char *text) {
+  uint8_t glyphs[256];
+  size_t num_glyphs = 0;
+  for (const char *charp = text; *charp != '\0' && num_glyphs < 256;
+       ++charp) {
+    char character = *charp - 32;
+    if (character < 0 || character >= 65)
+      continue;
+    glyphs[num_glyphs++] = character;
+  }
+  text_run_build(run, text_spritesheet, glyphs, num_glyphs);
+}
+
+void text_run_set_number(TextRun *run,
+                         const CompiledSprite &number_spritesheet,
+                         size_t number) {
+  if (run->valid && run->number == number)
+    return;
+
+  uint8_t digits[64];
+  size_t num_digits = 0;
+  size_t current_number = number;
+  do {
+    digits[num_digits++] = current_number % 10;
+    current_number = current_number / 10;
+  } while (current_number > 0);
+
+  for (size_t i = 0; i < num_digits / 2; ++i) {
+    uint8_t digit = digits[i];
+    digits[i] = digits[num_digits - i - 1];
+    digits[num_digits - i - 1] = digit;
+  }
+  text_run_build(run, number_spritesheet, digits, num_digits);
+  run->number = number;
+}
+
+bool sprite_overlap_check(const Sprite &sp_a, size_t x_a, size_t y_a,
+                          const Sprite &sp_b, size_t x_b, size_t y_b) {
+  // NOTE: For simplicity we just check for overlap of the sprite
+  // rectangles. sprite_pixel_overlap_check further checks if any pixel
+  // of sprite A overlaps with any of sprite B.
+  if (x_a < x_b + sp_b.width && x_a + sp_a.width > x_b &&
+      y_a < y_b + sp_b.height && y_a + sp_a.height > y_b) {
+    return true;
+  }
+
+  return false;
+}
+
+// 32 bits of a compiled sprite row starting at bit pos, which may lie
+// outside the row (missing bits read as transparent)
+inline uint32_t compiled_sprite_row_window(const CompiledSprite &sprite,
+                                           size_t row, ptrdiff_t pos) {
+  const uint32_t *words = sprite.rows + row * sprite.stride;
+  ptrdiff_t word = pos >= 0 ? pos / 32 : (pos - 31) / 32;
+  unsigned shift = (unsigned)(pos - word * 32);
+
+  uint64_t pair = 0;
+  if (word >= 0 && word < (ptrdiff_t)sprite.stride)
+    pair = words[word];
+  if (word + 1 >= 0 && word + 1 < (ptrdiff_t)sprite.stride)
+    pair |= (uint64_t)words[word + 1] << 32;
+  return (uint32_t)(pair >> shift);
+}
+
+// Pixel-exact test: after the rectangle test passes, the rows both sprites
+// cover are shifted into line and ANDed a word at a time.
+bool sprite_pixel_overlap_check(const CompiledSprite &sp_a, size_t x_a,
+                                size_t y_a, const CompiledSprite &sp_b,
+                                size_t x_b, size_t y_b) {
+  if (!(x_a < x_b + sp_b.width && x_a + sp_a.width > x_b &&
+        y_a < y_b + sp_b.height && y_a + sp_a.height > y_b)) {
+    return false;
+  }
+
+  // Row yi of a sprite covers y + height - 1 - yi
+  size_t y_begin = y_a > y_b ? y_a : y_b;
+  size_t y_end = y_a + sp_a.height < y_b + sp_b.height ? y_a + sp_a.height
+                                                        : y_b + sp_b.height;
+  ptrdiff_t dx = (ptrdiff_t)(x_a - x_b);
+
+  for (size_t y = y_begin; y < y_end; ++y) {
+    size_t row_a = y_a + sp_a.height - 1 - y;
+    size_t row_b = y_b + sp_b.height - 1 - y;
+    const uint32_t *words_a = sp_a.rows + row_a * sp_a.stride;
+    for (size_t w = 0; w < sp_a.stride; ++w) {
+      if (words_a[w] &
+          compiled_sprite_row_window(sp_b, row_b, dx + (ptrdiff_t)w * 32))
+        return true;
+    }
+  }
+
+  return false;
+}
+
+// Packed as 0xAARRGGBB, which the texture takes as GL_BGRA with
+// GL_UNSIGNED_INT_8_8_8_8_REV: the drivers' native layout, so uploads need
+// no swizzle or conversion.
+uint32_t rgb_to_uint32(uint8_t r, uint8_t g, uint8_t b) {
+  return (255u << 24) | ((uint32_t)r << 16) | (g << 8) | b;
+}
+
+void buffer_clear(Buffer *buffer, uint32_t color) {
+  buffer_fill_clipped(buffer, 0, 0, buffer->width, buffer->height, color);
+  buffer_mark_dirty(buffer, 0, 0, buffer->width, buffer->height);
+}
+
+// FNV-1a over the pixels, byte order fixed so hashes compare across hosts
+uint64_t buffer_hash(const Buffer &buffer) {
+  uint64_t hash = 14695981039346656037ull;
+  size_t pixel_size = buffer_pixel_size(buffer);
+  for (size_t i = 0; i < buffer.width * buffer.height; ++i) {
+    uint32_t pixel = buffer.indices ? buffer.indices[i] : buffer.data[i];
+    for (size_t byte = 0; byte < pixel_size; ++byte) {
+      hash ^= (pixel >> (8 * byte)) & 0xFF;
+      hash *= 1099511628211ull;
+    }
+  }
+  return hash;
+}
+
+//** Entity Stores */
+// Adds an alien in a new slot. Returns the slot, or -1 when the store is
+// full.
+ptrdiff_t alien_store_add(AlienStore *aliens, int16_t x, int16_t y,
+                          uint8_t type) {
+  if (aliens->count == GAME_MAX_ALIENS)
+    return -1;
+
+  size_t ai = aliens->count++;
+  aliens->x[ai] = x;
+  aliens->y[ai] = y;
+  aliens->type[ai] = type;
+  aliens->death_counter[ai] = GAME_ALIEN_DEATH_TICKS;
+
+  aliens->live_index[ai] = aliens->num_live;
+  aliens->live[aliens->num_live++] = ai;
+  return ai;
+}
+
+// Moves a live alien onto the dying list, keeping the live list compact
+void alien_store_kill(AlienStore *aliens, size_t ai) {
+  size_t index = aliens->live_index[ai];
+  uint16_t last = aliens->live[--aliens->num_live];
+  aliens->live[index] = last;
+  aliens->live_index[last] = index;
+
+  aliens->type[ai] = ALIEN_DEAD;
+  aliens->dying[aliens->num_dying++] = ai;
+}
+
+// Counts down the death sprites, dropping aliens whose time is up
+void alien_store_update_dying(AlienStore *aliens) {
+  size_t kept = 0;
+  for (size_t i = 0; i < aliens->num_dying; ++i) {
+    uint16_t ai = aliens->dying[i];
+    if (--aliens->death_counter[ai])
+      aliens->dying[kept++] = ai;
+  }
+  aliens->num_dying = kept;
+}
+
+void bullet_pool_add(BulletPool *bullets, int16_t x, int16_t y, int8_t dir) {
+  if (bullets->count == GAME_MAX_BULLETS)
+    return;
+
+  size_t bi = bullets->count++;
+  bullets->x[bi] = x;
+  bullets->y[bi] = y;
+  bullets->dir[bi] = dir;
+  bullets->killed[bi] = 0;
+}
+
+// Queues bullet bi for removal at the next compaction. Killing a bullet
+// twice in a tick is a no-op.
+void bullet_pool_kill(BulletPool *bullets, size_t bi) {
+  if (bullets->killed[bi])
+    return;
+
+  bullets->killed[bi] = 1;
+  bullets->kills[bullets->num_kills++] = bi;
+}
+
+// Drops the killed bullets in one pass, keeping the survivors in order
+void bullet_pool_compact(BulletPool *bullets) {
+  if (!bullets->num_kills)
+    return;
+
+  size_t kept = 0;
+  for (size_t bi = 0; bi < bullets->count; ++bi) {
+    if (bullets->killed[bi])
+      continue;
+
+    bullets->x[kept] = bullets->x[bi];
+    bullets->y[kept] = bullets->y[bi];
+    bullets->dir[kept] = bullets->dir[bi];
+    bullets->killed[kept] = 0;
+    ++kept;
+  }
+  bullets->count = kept;
+  bullets->num_kills = 0;
+}
+
+//** Collision Grid */
+// Largest rectangle any animation frame of a live alien of this type covers
+void alien_extent(const GameAssets &assets, uint8_t type, size_t *width,
+                  size_t *height) {
+  const SpriteAnimation &animation = assets.alien_animation[type - 1];
+  *width = 0;
+  *height = 0;
+  for (size_t i = 0; i < animation.num_frames; ++i) {
+    const Sprite &frame = *animation.frames[i];
+    if (frame.width > *width)
+      *width = frame.width;
+    if (frame.height > *height)
+      *height = frame.height;
+  }
+}
+
+// Inclusive cell range covered by a rectangle. Returns false when the
+// rectangle lies outside the grid.
+bool collision_grid_range(const CollisionGrid &grid, size_t x, size_t y,
+                          size_t width, size_t height, size_t *col_begin,
+                          size_t *row_begin, size_t *col_end,
+                          size_t *row_end) {
+  ptrdiff_t x0 = (ptrdiff_t)x;
+  ptrdiff_t y0 = (ptrdiff_t)y;
+  ptrdiff_t x1 = x0 + (ptrdiff_t)width - 1;
+  ptrdiff_t y1 = y0 + (ptrdiff_t)height - 1;
+  ptrdiff_t extent_x = (ptrdiff_t)(grid.cols * grid.cell_size);
+  ptrdiff_t extent_y = (ptrdiff_t)(grid.rows * grid.cell_size);
+  if (x1 < 0 || y1 < 0 || x0 >= extent_x || y0 >= extent_y)
+    return false;
+
+  *col_begin = x0 < 0 ? 0 : x0 / grid.cell_size;
+  *row_begin = y0 < 0 ? 0 : y0 / grid.cell_size;
+  *col_end = (x1 >= extent_x ? extent_x - 1 : x1) / grid.cell_size;
+  *row_end = (y1 >= extent_y ? extent_y - 1 : y1) / grid.cell_size;
+  return true;
+}
+
+// With fill false, counts the aliens of each cell and returns the total;
+// with fill true, lays the counted cells out back to back and fills them
+size_t collision_grid_bucket(CollisionGrid *grid, const Game &game,
+                             const GameAssets &assets, bool fill) {
+  size_t num_cells = grid->cols * grid->rows;
+  size_t start = 0;
+  if (fill) {
+    for (size_t cell = 0; cell < num_cells; ++cell) {
+      grid->cell_start[cell] = start;
+      start += grid->cell_count[cell];
+      grid->cell_count[cell] = 0;
+    }
+  } else {
+    memset(grid->cell_count, 0, num_cells * sizeof(grid->cell_count[0]));
+  }
+
+  size_t num_items = 0;
+  const AlienStore &aliens = game.aliens;
+  for (size_t i = 0; i < aliens.num_live; ++i) {
+    size_t ai = aliens.live[i];
+    size_t width, height, c0, r0, c1, r1;
+    alien_extent(assets, aliens.type[ai], &width, &height);
+    if (!collision_grid_range(*grid, aliens.x[ai], aliens.y[ai], width,
+                              height, &c0, &r0, &c1, &r1))
+      continue;
+
+    for (size_t row = r0; row <= r1; ++row) {
+      for (size_t col = c0; col <= c1; ++col) {
+        size_t cell = row * grid->cols + col;
+        if (fill)
+          grid->items[grid->cell_start[cell] + grid->cell_count[cell]] = ai;
+        ++grid->cell_count[cell];
+        ++num_items;
+      }
+    }
+  }
+
+  return num_items;
+}
+
+// Buckets every live alien into the cells its largest frame overlaps. Done
+// once per stage; deaths are removed incrementally afterwards. Cells double
+// in size until the grid and its items fit, which a single cell over the
+// whole playfield always does.
+void collision_grid_build(CollisionGrid *grid, const Game &game,
+                          const GameAssets &assets) {
+  grid->cell_size = GAME_GRID_CELL_SIZE;
+  for (;;) {
+    grid->cols = (game.width + grid->cell_size - 1) / grid->cell_size;
+    grid->rows = (game.height + grid->cell_size - 1) / grid->cell_size;
+    if (grid->cols * grid->rows <= GAME_GRID_MAX_CELLS &&
+        collision_grid_bucket(grid, game, assets, false) <=
+            GAME_GRID_MAX_ITEMS)
+      break;
+    grid->cell_size *= 2;
+  }
+
+  collision_grid_bucket(grid, game, assets, true);
+}
+
+// Drops alien ai from the cells of the rectangle it was bucketed with
+void collision_grid_remove(CollisionGrid *grid, size_t ai, size_t x, size_t y,
+                           size_t width, size_t height) {
+  size_t c0, r0, c1, r1;
+  if (!collision_grid_range(*grid, x, y, width, height, &c0, &r0, &c1, &r1))
+    return;
+
+  for (size_t row = r0; row <= r1; ++row) {
+    for (size_t col = c0; col <= c1; ++col) {
+      size_t cell = row * grid->cols + col;
+      uint16_t *items = grid->items + grid->cell_start[cell];
+      size_t count = grid->cell_count[cell];
+      for (size_t i = 0; i < count; ++i) {
+        if (items[i] == ai) {
+          items[i] = items[count - 1];
+          --grid->cell_count[cell];
+          break;
+        }
+      }
+    }
+  }
+}
+
+//** Shields */
+// Spaces count copies of sprite, whose stride must be 1, evenly across a
+// playfield width wide with their bottom at y
+void shield_store_init(ShieldStore *store, const CompiledSprite &sprite,
+                       size_t count, size_t width, size_t y) {
+  store->count = count;
+  store->width = sprite.width;
+  store->height = sprite.height;
+  size_t gap = (width - count * sprite.width) / (count + 1);
+  for (size_t si = 0; si < count; ++si) {
+    store->x[si] = gap + si * (sprite.width + gap);
+    store->y[si] = y;
+    memcpy(store->rows[si], sprite.rows, sprite.height * sizeof(uint32_t));
+  }
+}
+
+// Shield si as a sprite for drawing and overlap tests. It aliases the
+// store, so it only stays valid as long as the store does.
+CompiledSprite shield_store_sprite(const ShieldStore &store, size_t si) {
+  CompiledSprite sprite;
+  sprite.width = store.width;
+  sprite.height = store.height;
+  sprite.stride = 1;
+  sprite.rows = const_cast<uint32_t *>(store.rows[si]);
+  return sprite;
+}
+
+// The first shield with a pixel left under a sprite at (x, y), or -1. A
+// worn shield has holes, so this is pixel-exact whatever the collision
+// mode.
+ptrdiff_t shield_store_hit(const ShieldStore &store,
+                           const CompiledSprite &sprite, size_t x, size_t y) {
+  for (size_t si = 0; si < store.count; ++si) {
+    if (sprite_pixel_overlap_check(sprite, x, y,
+                                   shield_store_sprite(store, si),
+                                   store.x[si], store.y[si]))
+      return si;
+  }
+  return -1;
+}
+
+// Clears the pixels of shield si under mask at (x, y), one AND-NOT per row
+void shield_store_erode(ShieldStore *store, size_t si,
+                        const CompiledSprite &mask, ptrdiff_t x,
+                        ptrdiff_t y) {
+  ptrdiff_t shield_top = store->y[si] + (ptrdiff_t)store->height - 1;
+  ptrdiff_t mask_top = y + (ptrdiff_t)mask.height - 1;
+  for (size_t yi = 0; yi < store->height; ++yi) {
+    ptrdiff_t mask_row = mask_top - (shield_top - (ptrdiff_t)yi);
+    if (mask_row < 0 || mask_row >= (ptrdiff_t)mask.height)
+      continue;
+
+    store->rows[si][yi] &=
+        ~compiled_sprite_row_window(mask, mask_row, store->x[si] - x);
+  }
+}
+
+//** Formation */
+// Returns false, leaving formation untouched, when a stage of columns x rows
+// has more cells than the per-column and per-cell arrays hold
+bool formation_init(Formation *formation, size_t columns, size_t rows) {
+  if (columns > GAME_MAX_ALIENS || rows > GAME_MAX_ALIENS ||
+      columns * rows > GAME_MAX_ALIENS)
+    return false;
+
+  formation->x = 0;
+  formation->y = 0;
+  formation->dir = 1;
+  formation->columns = columns;
+  formation->rows = rows;
+  formation->count = 0;
+  formation->step_timer = FORMATION_STEP_TICKS;
+  formation->fire_timer = FORMATION_FIRE_TICKS;
+  formation->random = 0x9E3779B9u; // any nonzero seed; replays need a fixed one
+  for (size_t i = 0; i < columns * rows; ++i) {
+    formation->cells[i] = -1;
+  }
+  for (size_t c = 0; c < columns; ++c) {
+    formation->bottom[c] = -1;
+    formation->column_left[c] = INT16_MAX;
+    formation->column_right[c] = INT16_MIN;
+  }
+  return true;
+}
+
+// Places alien slot ai in a cell; row 0 is the bottom row
+void formation_add(Formation *formation, size_t ai, size_t column,
+                   size_t row) {
+  formation->cells[row * formation->columns + column] = ai;
+  formation->column_of[ai] = column;
+  formation->row_of[ai] = row;
+  ptrdiff_t bottom = formation->bottom[column];
+  if (bottom < 0 || row < formation->row_of[bottom])
+    formation->bottom[column] = ai;
+  ++formation->count;
+}
+
+// Finds the x extent of each column once every alien has been added
+void formation_measure(Formation *formation, const AlienStore &aliens,
+                       const GameAssets &assets) {
+  for (size_t i = 0; i < formation->columns * formation->rows; ++i) {
+    int16_t ai = formation->cells[i];
+    if (ai < 0)
+      continue;
+
+    size_t column = i % formation->columns;
+    size_t width, height;
+    alien_extent(assets, aliens.type[ai], &width, &height);
+    formation->column_left[column] =
+        std::min<int16_t>(formation->column_left[column], aliens.x[ai]);
+    formation->column_right[column] = std::max<int16_t>(
+        formation->column_right[column], aliens.x[ai] + width);
+  }
+}
+
+// Call once alien ai has been killed: the next live alien up its column,
+// if any, becomes the column's bottom
+void formation_remove(Formation *formation, const AlienStore &aliens,
+                      size_t ai) {
+  size_t column = formation->column_of[ai];
+  if (formation->bottom[column] != (ptrdiff_t)ai)
+    return;
+
+  formation->bottom[column] = -1;
+  for (size_t row = formation->row_of[ai] + 1; row < formation->rows; ++row) {
+    int16_t slot = formation->cells[row * formation->columns + column];
+    if (slot >= 0 && aliens.type[slot] != ALIEN_DEAD) {
+      formation->bottom[column] = slot;
+      break;
+    }
+  }
+}
+
+// Playfield x range covered by the columns with aliens left. Returns false
+// when there are none.
+bool formation_edges(const Formation &formation, int *left, int *right) {
+  bool found = false;
+  for (size_t c = 0; c < formation.columns; ++c) {
+    if (formation.bottom[c] < 0)
+      continue;
+
+    int column_left = formation.x + formation.column_left[c];
+    int column_right = formation.x + formation.column_right[c];
+    *left = found ? std::min(*left, column_left) : column_left;
+    *right = found ? std::max(*right, column_right) : column_right;
+    found = true;
+  }
+  return found;
+}
+
+// Playfield y of the lowest alien left. Returns false when there is none.
+bool formation_lowest(const Formation &formation, const AlienStore &aliens,
+                      int *y) {
+  bool found = false;
+  for (size_t c = 0; c < formation.columns; ++c) {
+    if (formation.bottom[c] < 0)
+      continue;
+
+    int bottom_y = formation.y + aliens.y[formation.bottom[c]];
+    *y = found ? std::min(*y, bottom_y) : bottom_y;
+    found = true;
+  }
+  return found;
+}
+
+// Steps the whole formation sideways, or down and back at an edge of a
+// playfield width wide. Steps come quicker as fewer of the count aliens
+// placed are left alive.
+void formation_march(Formation *formation, size_t num_live, size_t width) {
+  if (--formation->step_timer > 0)
+    return;
+
+  formation->step_timer =
+      1 + num_live * (FORMATION_STEP_TICKS - 1) / formation->count;
+  int left, right;
+  if (!formation_edges(*formation, &left, &right))
+    return;
+
+  int step = formation->dir * FORMATION_STEP_X;
+  if (left + step < 0 || right + step > (int)width) {
+    formation->y -= FORMATION_STEP_Y;
+    formation->dir = -formation->dir;
+  } else {
+    formation->x += step;
+  }
+}
+
+// Counts down to the next alien shot. Returns the slot of the alien taking
+// it, the bottom one of a random column with aliens left, or -1.
+ptrdiff_t formation_fire(Formation *formation) {
+  if (--formation->fire_timer > 0)
+    return -1;
+
+  formation->fire_timer = FORMATION_FIRE_TICKS;
+  size_t num_columns = 0;
+  for (size_t c = 0; c < formation->columns; ++c) {
+    if (formation->bottom[c] >= 0)
+      ++num_columns;
+  }
+  if (num_columns == 0)
+    return -1;
+
+  // xorshift32
+  uint32_t random = formation->random;
+  random ^= random << 13;
+  random ^= random >> 17;
+  random ^= random << 5;
+  formation->random = random;
+
+  size_t pick = random % num_columns;
+  for (size_t c = 0;; ++c) {
+    if (formation->bottom[c] >= 0 && pick-- == 0)
+      return formation->bottom[c];
+  }
+}
+
+//** Animation */
+void animation_clock_resolve(AnimationClock *clock,
+                             const SpriteAnimation *animations) {
+  for (size_t i = 0; i < clock->num_animations; ++i) {
+    const SpriteAnimation &animation = animations[i];
+    size_t frame = clock->tick / animation.frame_duration;
+    if (animation.loop)
+      frame %= animation.num_frames;
+    else if (frame >= animation.num_frames)
+      frame = animation.num_frames - 1;
+
+    clock->frame[i] = frame;
+  }
+}
+
+void animation_clock_init(AnimationClock *clock,
+                          const SpriteAnimation *animations,
+                          size_t num_animations) {
+  clock->tick = 0;
+  clock->num_animations = num_animations;
+  animation_clock_resolve(clock, animations);
+}
+
+void animation_clock_tick(AnimationClock *clock,
+                          const SpriteAnimation *animations) {
+  ++clock->tick;
+  animation_clock_resolve(clock, animations);
+}
+
+// The current sprite of animation i, for a clock driving animations
+inline const Sprite &animation_sprite(const AnimationClock &clock,
+                                      const SpriteAnimation *animations,
+                                      size_t i) {
+  return *animations[i].frames[clock.frame[i]];
+}
+
+inline const CompiledSprite &
+animation_compiled_sprite(const AnimationClock &clock,
+                          const SpriteAnimation *animations, size_t i) {
+  return *animations[i].compiled_frames[clock.frame[i]];
+}
+
+//** Game Logic */
+// Finds what each bullet runs into this tick without touching the game
+// state; returns the number of entries written to hits, in bullet order
+size_t game_find_bullet_hits(const Game &game, const GameAssets &assets,
+                             BulletHit *hits) {
+  const Sprite &bullet_sprite = *assets.bullet_sprite;
+  const BulletPool &bullets = game.bullets;
+  const AlienStore &aliens = game.aliens;
+  const CollisionGrid &grid = game.alien_grid;
+  const Formation &formation = game.formation;
+
+  size_t num_hits = 0;
+  for (size_t bi = 0; bi < bullets.count; ++bi) {
+    int16_t bullet_x = bullets.x[bi];
+    int16_t bullet_y = bullets.y[bi];
+    if (bullet_y >= (int)game.height || bullet_y < (int)bullet_sprite.height) {
+      hits[num_hits].bullet = bi;
+      hits[num_hits].alien = BULLET_HIT_BOUNDS;
+      ++num_hits;
+      continue;
+    }
+
+    // Shields stop bullets from either side
+    ptrdiff_t shield = shield_store_hit(
+        game.shields, *assets.compiled_bullet_sprite, bullet_x, bullet_y);
+    if (shield >= 0) {
+      hits[num_hits].bullet = bi;
+      hits[num_hits].alien = BULLET_HIT_SHIELD;
+      hits[num_hits].shield = shield;
+      ++num_hits;
+      continue;
+    }
+
+    // Alien bullets fly down and only hit the player
+    if (bullets.dir[bi] < 0) {
+      bool overlap;
+      if (game.collision_mode == COLLISION_PIXEL) {
+        overlap = sprite_pixel_overlap_check(
+            *assets.compiled_bullet_sprite, bullet_x, bullet_y,
+            *assets.compiled_player_sprite, game.player.x, game.player.y);
+      } else {
+        overlap = sprite_overlap_check(bullet_sprite, bullet_x, bullet_y,
+                                       *assets.player_sprite, game.player.x,
+                                       game.player.y);
+      }
+      if (overlap) {
+        hits[num_hits].bullet = bi;
+        hits[num_hits].alien = BULLET_HIT_PLAYER;
+        ++num_hits;
+      }
+      continue;
+    }
+
+    // Test only the aliens bucketed in the cells the bullet overlaps. The
+    // grid is laid out in formation space.
+    size_t c0, r0, c1, r1;
+    if (!collision_grid_range(grid, bullet_x - formation.x,
+                              bullet_y - formation.y, bullet_sprite.width,
+                              bullet_sprite.height, &c0, &r0, &c1, &r1))
+      continue;
+
+    bool hit = false;
+    for (size_t row = r0; row <= r1 && !hit; ++row) {
+      for (size_t col = c0; col <= c1 && !hit; ++col) {
+        size_t cell = row * grid.cols + col;
+        const uint16_t *items = grid.items + grid.cell_start[cell];
+        for (size_t i = 0; i < grid.cell_count[cell]; ++i) {
+          size_t ai = items[i];
+          size_t animation = aliens.type[ai] - 1;
+
+          bool overlap;
+          if (game.collision_mode == COLLISION_PIXEL) {
+            overlap = sprite_pixel_overlap_check(
+                *assets.compiled_bullet_sprite, bullet_x, bullet_y,
+                animation_compiled_sprite(game.animation,
+                                          assets.alien_animation, animation),
+                aliens.x[ai] + formation.x, aliens.y[ai] + formation.y);
+          } else {
+            overlap = sprite_overlap_check(
+                bullet_sprite, bullet_x, bullet_y,
+                animation_sprite(game.animation, assets.alien_animation,
+                                 animation),
+                aliens.x[ai] + formation.x, aliens.y[ai] + formation.y);
+          }
+          if (overlap) {
+            hits[num_hits].bullet = bi;
+            hits[num_hits].alien = ai;
+            ++num_hits;
+            hit = true;
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  return num_hits;
+}
+
+// Aliens that have marched down into the shields wear away what they
+// cover. Only the bottom alien of each column can get there first, so this
+// is at most columns x shields sprite tests and none above the shields.
+void game_erode_shields(Game *game, const GameAssets &assets) {
+  ShieldStore &shields = game->shields;
+  const Formation &formation = game->formation;
+  int lowest;
+  if (shields.count == 0 ||
+      !formation_lowest(formation, game->aliens, &lowest) ||
+      lowest >= shields.y[0] + (int)shields.height)
+    return;
+
+  for (size_t c = 0; c < formation.columns; ++c) {
+    ptrdiff_t ai = formation.bottom[c];
+    if (ai < 0)
+      continue;
+
+    const CompiledSprite &sprite = animation_compiled_sprite(
+        game->animation, assets.alien_animation, game->aliens.type[ai] - 1);
+    int x = game->aliens.x[ai] + formation.x;
+    int y = game->aliens.y[ai] + formation.y;
+    for (size_t si = 0; si < shields.count; ++si) {
+      if (x >= 0 && y >= 0 &&
+          sprite_pixel_overlap_check(sprite, x, y,
+                                     shield_store_sprite(shields, si),
+                                     shields.x[si], shields.y[si]))
+        shield_store_erode(&shields, si, sprite, x, y);
+    }
+  }
+}
+
+// Advances the game by one fixed simulation tick
+void game_update(Game *game, GameAssets *assets, int move_dir, bool fire) {
+  const Sprite &player_sprite = *assets->player_sprite;
+  const Sprite &alien_death_sprite = *assets->alien_death_sprite;
+
+  // Player's move animation
+  int player_move_dir = 2 * move_dir;
+
+  // Alien simulation
+  alien_store_update_dying(&game->aliens);
+
+  // Bullets simulation
+  BulletPool &bullets = game->bullets;
+  for (size_t bi = 0; bi < bullets.count; ++bi) {
+    bullets.y[bi] += bullets.dir[bi];
+  }
+
+  // Collision is found against a frozen snapshot of the tick, then applied
+  // in bullet order
+  BulletHit hits[GAME_MAX_BULLETS];
+  size_t num_hits = game_find_bullet_hits(*game, *assets, hits);
+
+  AlienStore &aliens = game->aliens;
+  for (size_t i = 0; i < num_hits; ++i) {
+    size_t bi = hits[i].bullet;
+    if (hits[i].alien == BULLET_HIT_BOUNDS) {
+      bullet_pool_kill(&bullets, bi);
+      continue;
+    }
+    if (hits[i].alien == BULLET_HIT_PLAYER) {
+      if (game->player.life > 0)
+        --game->player.life;
+      bullet_pool_kill(&bullets, bi);
+      continue;
+    }
+    if (hits[i].alien == BULLET_HIT_SHIELD) {
+      // The blast is centered on the bullet
+      const CompiledSprite &bullet = *assets->compiled_bullet_sprite;
+      const CompiledSprite &blast = *assets->compiled_shield_hit;
+      ptrdiff_t dx = ((ptrdiff_t)bullet.width - (ptrdiff_t)blast.width) / 2;
+      ptrdiff_t dy = ((ptrdiff_t)bullet.height - (ptrdiff_t)blast.height) / 2;
+      shield_store_erode(&game->shields, hits[i].shield, blast,
+                         bullets.x[bi] + dx, bullets.y[bi] + dy);
+      bullet_pool_kill(&bullets, bi);
+      continue;
+    }
+
+    // An earlier bullet already took this alien; this one flies on and is
+    // tested again next tick
+    size_t ai = hits[i].alien;
+    uint8_t type = aliens.type[ai];
+    if (type == ALIEN_DEAD)
+      continue;
+
+    const Sprite &alien_sprite =
+        animation_sprite(game->animation, assets->alien_animation, type - 1);
+    game->score += 10 * (4 - type);
+
+    size_t width, height;
+    alien_extent(*assets, type, &width, &height);
+    collision_grid_remove(&game->alien_grid, ai, aliens.x[ai], aliens.y[ai],
+                          width, height);
+
+    alien_store_kill(&aliens, ai);
+    formation_remove(&game->formation, aliens, ai);
+    // NOTE: Hack to recenter death sprite
+    aliens.x[ai] -= (alien_death_sprite.width - alien_sprite.width) / 2;
+    bullet_pool_kill(&bullets, bi);
+  }
+  bullet_pool_compact(&bullets);
+
+  if (player_move_dir != 0) {
+    if (game->player.x + player_sprite.width + player_move_dir >=
+        game->width) {
+      game->player.x = game->width - player_sprite.width - player_move_dir;
+    } else if (game->player.x + player_move_dir <= 0) {
+      game->player.x = 0;
+    } else {
+      game->player.x += player_move_dir;
+    }
+  }
+
+  // Process bullet events
+  if (fire) {
+    bullet_pool_add(&bullets, game->player.x + player_sprite.width / 2,
+                    game->player.y + player_sprite.height, 2);
+  }
+
+  // The formation marches and one of its bottom aliens may fire
+  Formation &formation = game->formation;
+  formation_march(&formation, aliens.num_live, game->width);
+  game_erode_shields(game, *assets);
+  ptrdiff_t shooter = formation_fire(&formation);
+  if (shooter >= 0) {
+    const Sprite &alien_sprite =
+        animation_sprite(game->animation, assets->alien_animation,
+                         aliens.type[shooter] - 1);
+    const Sprite &bullet_sprite = *assets->bullet_sprite;
+    bullet_pool_add(&bullets,
+                    aliens.x[shooter] + formation.x + alien_sprite.width / 2,
+                    aliens.y[shooter] + formation.y - bullet_sprite.height,
+                    -GAME_ALIEN_BULLET_SPEED);
+  }
+
+  // Animations run on simulation time, not frames
+  animation_clock_tick(&game->animation, assets->alien_animation);
+}
+
+// The stage ends when every alien is gone, the player is out of lives or
+// the formation has come down to the player
+bool game_is_over(const Game &game, const GameAssets &assets) {
+  if (game.aliens.num_live == 0 && game.aliens.num_dying == 0)
+    return true;
+  if (game.player.life == 0)
+    return true;
+
+  int lowest;
+  return formation_lowest(game.formation, game.aliens, &lowest) &&
+         lowest <= (int)(game.player.y + assets.player_sprite->height);
+}
+
+//** Snapshots */
+static_assert(std::is_trivially_copyable<GameSnapshot>::value,
+              "snapshots are saved and restored with memcpy");
+
+void game_snapshot_save(const GameSnapshot &state, GameSnapshot *saved) {
+  memcpy(saved, &state, sizeof(GameSnapshot));
+}
+
+void game_snapshot_restore(GameSnapshot *state, const GameSnapshot &saved) {
+  memcpy(state, &saved, sizeof(GameSnapshot));
+}
+
+// Advances state by one tick with the given input, without drawing. It
+// reads nothing but state and assets, so the same snapshot and inputs
+// always give the same result, on any thread.
+void game_step(GameSnapshot *state, GameAssets *assets, int move_dir,
+               bool fire) {
+  state->previous_player_x = state->game.player.x;
+  state->move_dir = move_dir;
+  game_update(&state->game, assets, move_dir, fire);
+  ++state->tick;
+  state->over = game_is_over(state->game, *assets);
+}
+
+// Sleeps until glfwGetTime() reaches time
+void sleep_until(double time) {
+  double remaining = time - glfwGetTime();
+  if (remaining > 0.0) {
+    std::this_thread::sleep_for(std::chrono::duration<double>(remaining));
+  }
+}
+
+//** Input Script */
+// Scripts are text, one "tick move_dir fire" event per line in tick order;
+// lines starting with # are comments.
+void input_script_init(InputScript *script) {
+  script->num_events = 0;
+  script->capacity = 0;
+  script->events = 0;
+  script->next = 0;
+  script->last_move_dir = 0;
+}
+
+void input_script_free(InputScript *script) {
+  delete[] script->events;
+  input_script_init(script);
+}
+
+void input_script_push(InputScript *script, const InputEvent &event) {
+  if (script->num_events == script->capacity) {
+    size_t capacity = script->capacity ? 2 * script->capacity : 64;
+    InputEvent *events = new InputEvent[capacity];
+    for (size_t i = 0; i < script->num_events; ++i)
+      events[i] = script->events[i];
+    delete[] script->events;
+    script->events = events;
+    script->capacity = capacity;
+  }
+  script->events[script->num_events++] = event;
+}
+
+bool input_script_load(InputScript *script, const char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file)
+    return false;
+
+  char line[256];
+  size_t line_number = 0;
+  bool ok = true;
+  while (ok && fgets(line, sizeof(line), file)) {
+    ++line_number;
+    if (line[0] == '#' || line[0] == '\n')
+      continue;
+
+    unsigned long tick;
+    int move_dir, fire;
+    ok = sscanf(line, "%lu %d %d", &tick, &move_dir, &fire) == 3 &&
+         move_dir >= -1 && move_dir <= 1 &&
+         (script->num_events == 0 ||
+          tick >= script->events[script->num_events - 1].tick);
+    if (!ok) {
+      fprintf(stderr, "%s:%zu: bad input event\n", path, line_number);
+      break;
+    }
+
+    InputEvent event = {tick, move_dir, fire != 0};
+    input_script_push(script, event);
+  }
+
+  fclose(file);
+  return ok;
+}
+
+bool input_script_save(const InputScript &script, const char *path) {
+  FILE *file = fopen(path, "w");
+  if (!file)
+    return false;
+
+  fprintf(file, "# tick move_dir fire\n");
+  for (size_t i = 0; i < script.num_events; ++i) {
+    const InputEvent &event = script.events[i];
+    fprintf(file, "%zu %d %d\n", event.tick, event.move_dir, event.fire);
+  }
+
+  fclose(file);
+  return true;
+}
+
+// Sets the input state the way key_callback would for every event due by
+// tick
+void input_script_apply(InputScript *script, size_t tick, int *move_dir,
+                        bool *fire) {
+  while (script->next < script->num_events &&
+         script->events[script->next].tick <= tick) {
+    const InputEvent &event = script->events[script->next++];
+    *move_dir = event.move_dir;
+    if (event.fire)
+      *fire = true;
+  }
+}
+
+// Appends an event for tick when the input differs from what the script
+// already implies
+void input_script_record(InputScript *script, size_t tick, int move_dir,
+                         bool fire) {
+  if (move_dir == script->last_move_dir && !fire)
+    return;
+
+  InputEvent event = {tick, move_dir, fire};
+  input_script_push(script, event);
+  script->last_move_dir = move_dir;
+}
+
+// Makes tick the next one applied; move_dir is what the input was held at
+// before it. Replaying from there continues as if played through.
+void input_script_seek(InputScript *script, size_t tick, int move_dir) {
+  script->next = std::lower_bound(script->events,
+                                  script->events + script->num_events, tick,
+                                  [](const InputEvent &event, size_t tick) {
+                                    return event.tick < tick;
+                                  }) -
+                 script->events;
+  script->last_move_dir = move_dir;
+}
+
+// Forgets what was recorded from tick on, for a recording rolled back
+void input_script_truncate(InputScript *script, size_t tick, int move_dir) {
+  input_script_seek(script, tick, move_dir);
+  script->num_events = script->next;
+}
+
+//** Simulation */
+// Applies every queued action; returns how many have been applied ever.
+// snapshot gets the last save or restore request, if any.
+size_t input_queue_drain(InputQueue *queue, int *move_dir,
+                         size_t *fire_presses, int *snapshot) {
+  size_t tail = queue->tail.load(std::memory_order_relaxed);
+  size_t head = queue->head.load(std::memory_order_acquire);
+  for (; tail != head; ++tail) {
+    const InputAction &action = queue->actions[tail % INPUT_QUEUE_SIZE];
+    *move_dir += action.move;
+    if (action.fire)
+      ++*fire_presses;
+    if (action.snapshot != 0)
+      *snapshot = action.snapshot;
+  }
+  queue->tail.store(tail, std::memory_order_release);
+  return tail;
+}
+
+// When action number sequence was queued. Producer side only: the slot is
+// rewritten once the ring has wrapped past it, and then this returns false.
+bool input_queue_time(const InputQueue &queue, size_t sequence, double *time) {
+  if (queue.head.load(std::memory_order_relaxed) - sequence > INPUT_QUEUE_SIZE)
+    return false;
+
+  *time = queue.actions[sequence % INPUT_QUEUE_SIZE].time;
+  return true;
+}
+
+void simulation_init(Simulation *sim, GameSnapshot *state, GameAssets *assets,
+                     InputScript *replay, InputScript *record) {
+  sim->state = state;
+  sim->assets = assets;
+  sim->replay = replay;
+  sim->record = record;
+  sim->move_dir = 0;
+  sim->fire_presses = 0;
+  sim->has_saved = false;
+  sim->pipelined = false;
+  sim->tick_duration = 0.0;
+  sim->snapshots[0] = sim->snapshots[1] = 0;
+  sim->latest = 0;
+  sim->reading = 2;
+  sim->quit = false;
+  sim->busy = 0.0;
+}
+
+// Rolls the working state back (or forward) to saved. Replay and recording
+// pick up at the saved tick; the clock and the input count run on, and
+// keys held stay held.
+void simulation_restore(Simulation *sim, const GameSnapshot &saved) {
+  GameSnapshot *state = sim->state;
+  double time = state->time;
+  size_t inputs = state->inputs;
+  game_snapshot_restore(state, saved);
+  state->time = time;
+  state->inputs = inputs;
+
+  if (sim->replay) {
+    input_script_seek(sim->replay, saved.tick, saved.move_dir);
+    sim->move_dir = saved.move_dir;
+  }
+  if (sim->record)
+    input_script_truncate(sim->record, saved.tick, saved.move_dir);
+}
+
+// Advances the working state by one tick that was due at time
+void simulation_tick(Simulation *sim, double time) {
+  GameSnapshot *state = sim->state;
+  int snapshot = 0;
+  state->inputs = input_queue_drain(&input_queue, &sim->move_dir,
+                                    &sim->fire_presses, &snapshot);
+  if (snapshot > 0) {
+    game_snapshot_save(*state, &sim->saved);
+    sim->has_saved = true;
+  } else if (snapshot < 0 && sim->has_saved) {
+    simulation_restore(sim, sim->saved);
+  }
+
+  bool fire = false;
+  if (sim->replay)
+    input_script_apply(sim->replay, state->tick, &sim->move_dir, &fire);
+  if (!fire && sim->fire_presses > 0) {
+    fire = true;
+    --sim->fire_presses;
+  }
+  if (sim->record)
+    input_script_record(sim->record, state->tick, sim->move_dir, fire);
+
+  game_step(state, sim->assets, sim->move_dir, fire);
+  state->time = time;
+}
+
+// Runs the working state up to tick on the replay's input alone, as fast
+// as the simulation goes; stops early if the game ends
+void simulation_fast_forward(Simulation *sim, size_t tick) {
+  GameSnapshot *state = sim->state;
+  while (state->tick < tick && !state->over) {
+    bool fire = false;
+    if (sim->replay)
+      input_script_apply(sim->replay, state->tick, &sim->move_dir, &fire);
+    if (sim->record)
+      input_script_record(sim->record, state->tick, sim->move_dir, fire);
+    game_step(state, sim->assets, sim->move_dir, fire);
+  }
+}
+
+// Copies the working state into the snapshot not last published, waiting
+// if the render side still holds it, and makes it the latest
+void simulation_publish(Simulation *sim) {
+  size_t slot = 1 - sim->latest;
+  {
+    std::unique_lock<std::mutex> lock(sim->mutex);
+    while (sim->reading == slot)
+      sim->released.wait(lock);
+  }
+
+  *sim->snapshots[slot] = *sim->state;
+  std::lock_guard<std::mutex> lock(sim->mutex);
+  sim->latest = slot;
+}
+
+void simulation_run(Simulation *sim) {
+  double next_tick = sim->state->time + sim->tick_duration;
+  for (;;) {
+    {
+      std::lock_guard<std::mutex> lock(sim->mutex);
+      if (sim->quit)
+        return;
+    }
+
+    sleep_until(next_tick);
+    double start = glfwGetTime();
+    // Don't try to catch up after a long stall (e.g. window drag)
+    double backlog = GAME_MAX_TICKS_PER_FRAME * sim->tick_duration;
+    if (start - next_tick > backlog)
+      next_tick = start - backlog;
+
+    simulation_tick(sim, next_tick);
+    next_tick += sim->tick_duration;
+    simulation_publish(sim);
+
+    std::lock_guard<std::mutex> lock(sim->mutex);
+    sim->busy += glfwGetTime() - start;
+    if (sim->state->over)
+      return;
+  }
+}
+
+// Starts ticking on a thread of its own, the first tick being due a tick
+// after time. snapshots holds two snapshots to publish into.
+void simulation_start(Simulation *sim, GameSnapshot *snapshots,
+                      double tick_duration, double time) {
+  sim->state->time = time;
+  sim->snapshots[0] = &snapshots[0];
+  sim->snapshots[1] = &snapshots[1];
+  snapshots[0] = snapshots[1] = *sim->state;
+  sim->tick_duration = tick_duration;
+  sim->pipelined = true;
+  sim->thread = std::thread(simulation_run, sim);
+}
+
+void simulation_stop(Simulation *sim) {
+  if (!sim->pipelined)
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(sim->mutex);
+    sim->quit = true;
+  }
+  sim->thread.join();
+  sim->pipelined = false;
+}
+
+// The snapshot to draw, held until simulation_release; busy gets the
+// time spent simulating since the last call
+const GameSnapshot *simulation_acquire(Simulation *sim, double *busy) {
+  if (!sim->pipelined) {
+    *busy = 0.0;
+    return sim->state;
+  }
+
+  std::lock_guard<std::mutex> lock(sim->mutex);
+  sim->reading = sim->latest;
+  *busy = sim->busy;
+  sim->busy = 0.0;
+  return sim->snapshots[sim->reading];
+}
+
+void simulation_release(Simulation *sim) {
+  if (!sim->pipelined)
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(sim->mutex);
+    sim->reading = 2;
+  }
+  sim->released.notify_one();
+}
+
+//** GL State */
+GlState gl_state = {0, 0, 0};
+
+void gl_state_reset() {
+  gl_state.program = 0;
+  gl_state.texture = 0;
+  gl_state.vao = 0;
+}
+
+inline void gl_use_program(GLuint program) {
+  if (gl_state.program != program) {
+    glUseProgram(program);
+    gl_state.program = program;
+  }
+}
+
+inline void gl_bind_texture(GLuint texture) {
+  if (gl_state.texture != texture) {
+    glBindTexture(GL_TEXTURE_2D, texture);
+    gl_state.texture = texture;
+  }
+}
+
+inline void gl_bind_vertex_array(GLuint vao) {
+  if (gl_state.vao != vao) {
+    glBindVertexArray(vao);
+    gl_state.vao = vao;
+  }
+}
+
+//** Pixel Upload */
+// Streams the Buffer into the presentation texture. UPLOAD_DIRECT is a
+// plain glTexSubImage2D from client memory. UPLOAD_ORPHAN copies the dirty
+// rectangles into a freshly orphaned pixel buffer object so the transfer no
+// longer waits for the GPU. UPLOAD_PERSISTENT rotates the pixels through
+// a ring of persistently mapped PBOs, so the rasterizer draws straight into
+// upload memory and a fence protects each slot until the GPU has read it.
+bool pixel_stream_init(PixelStream *stream, PixelUploadMode mode,
+                       size_t num_slots, const Buffer &buffer) {
+  stream->mode = mode;
+  stream->num_slots = mode == UPLOAD_DIRECT ? 0 : num_slots;
+  stream->slot = 0;
+  stream->size = buffer.width * buffer.height * buffer_pixel_size(buffer);
+
+  if (stream->num_slots > PIXEL_STREAM_MAX_SLOTS)
+    return false;
+
+  for (size_t i = 0; i < PIXEL_STREAM_MAX_SLOTS; ++i) {
+    stream->mapped[i] = 0;
+    stream->fences[i] = 0;
+  }
+
+  glGenBuffers(stream->num_slots, stream->pbos);
+  for (size_t i = 0; i < stream->num_slots; ++i) {
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stream->pbos[i]);
+
+    if (mode == UPLOAD_PERSISTENT) {
+      const GLbitfield flags =
+          GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+      glBufferStorage(GL_PIXEL_UNPACK_BUFFER, stream->size, 0, flags);
+      stream->mapped[i] = (uint8_t *)glMapBufferRange(
+          GL_PIXEL_UNPACK_BUFFER, 0, stream->size, flags);
+      if (!stream->mapped[i]) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        return false;
+      }
+    } else {
+      glBufferData(GL_PIXEL_UNPACK_BUFFER, stream->size, 0, GL_STREAM_DRAW);
+    }
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+  return true;
+}
+
+void pixel_stream_free(PixelStream *stream) {
+  for (size_t i = 0; i < stream->num_slots; ++i) {
+    if (stream->fences[i])
+      glDeleteSync(stream->fences[i]);
+    if (stream->mapped[i]) {
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stream->pbos[i]);
+      glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    }
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  glDeleteBuffers(stream->num_slots, stream->pbos);
+  stream->num_slots = 0;
+}
+
+// How many frames ago the memory handed out by pixel_stream_begin_frame was
+// last drawn, for buffer_begin_frame
+size_t pixel_stream_buffer_age(const PixelStream &stream) {
+  return stream.mode == UPLOAD_PERSISTENT ? stream.num_slots : 1;
+}
+
+// Points the buffer's pixels at the slot to draw this frame into
+void pixel_stream_begin_frame(PixelStream *stream, Buffer *buffer) {
+  if (stream->mode != UPLOAD_PERSISTENT)
+    return;
+
+  GLsync &fence = stream->fences[stream->slot];
+  if (fence) {
+    while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) ==
+           GL_TIMEOUT_EXPIRED) {
+    }
+    glDeleteSync(fence);
+    fence = 0;
+  }
+
+  if (buffer->indices)
+    buffer->indices = stream->mapped[stream->slot];
+  else
+    buffer->data = (uint32_t *)stream->mapped[stream->slot];
+}
+
+// Uploads the rectangles of the buffer to texture
+void pixel_stream_upload(PixelStream *stream, GLuint texture,
+                         const Buffer &buffer, const DirtyRect *rects,
+                         size_t num_rects) {
+  gl_bind_texture(texture);
+  size_t pixel_size = buffer_pixel_size(buffer);
+  const uint8_t *pixels = buffer_pixels(buffer);
+
+  if (stream->mode != UPLOAD_DIRECT) {
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stream->pbos[stream->slot]);
+    // Offsets into the bound PBO, which has the same layout as the buffer
+    pixels = 0;
+  }
+
+  if (stream->mode == UPLOAD_ORPHAN) {
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, stream->size, 0, GL_STREAM_DRAW);
+    uint8_t *mapped = (uint8_t *)glMapBufferRange(
+        GL_PIXEL_UNPACK_BUFFER, 0, stream->size,
+        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (mapped) {
+      for (size_t i = 0; i < num_rects; ++i) {
+        const DirtyRect &rect = rects[i];
+        for (size_t y = rect.y; y < rect.y + rect.height; ++y) {
+          size_t offset = (y * buffer.width + rect.x) * pixel_size;
+          memcpy(mapped + offset, pixels + offset, rect.width * pixel_size);
+        }
+      }
+      glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    } else {
+      // Mapping can fail (e.g. lost context); upload from client memory
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+      pixels = buffer_pixels(buffer);
+    }
+  }
+
+  for (size_t i = 0; i < num_rects; ++i) {
+    const DirtyRect &rect = rects[i];
+    const uint8_t *first =
+        pixels + (rect.y * buffer.width + rect.x) * pixel_size;
+    if (buffer.indices) {
+      glTexSubImage2D(GL_TEXTURE_2D, 0, rect.x, rect.y, rect.width,
+                      rect.height, GL_RED, GL_UNSIGNED_BYTE, first);
+    } else {
+      glTexSubImage2D(GL_TEXTURE_2D, 0, rect.x, rect.y, rect.width,
+                      rect.height, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, first);
+    }
+  }
+
+  if (stream->mode == UPLOAD_PERSISTENT) {
+    stream->fences[stream->slot] =
+        glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  }
+  if (stream->mode != UPLOAD_DIRECT) {
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    stream->slot = (stream->slot + 1) % stream->num_slots;
+  }
+}
+
+//** Profiler */
+const char *profile_phase_names[PROFILE_NUM_PHASES] = {
+    "FRAME",   "SIM",    "CLEAR",  "HUD",  "ALIENS", "BULLETS",
+    "RASTER",  "UPLOAD", "DRAW",   "SWAP", "GPU",    "POST",
+    "INPUT",   "LATE"};
+
+double profiler_now() {
+  using namespace std::chrono;
+  return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+// A disabled profiler stays zeroed and every call on it returns at once
+void profiler_init(Profiler *profiler, bool enabled, bool gpu) {
+  memset(profiler, 0, sizeof(*profiler));
+  profiler->enabled = enabled;
+  profiler->gpu = enabled && gpu;
+  if (profiler->gpu)
+    glGenQueries(PROFILE_GPU_QUERIES, profiler->gpu_queries);
+}
+
+void profiler_free(Profiler *profiler) {
+  if (profiler->gpu)
+    glDeleteQueries(PROFILE_GPU_QUERIES, profiler->gpu_queries);
+}
+
+void profiler_begin(Profiler *profiler, ProfilePhase phase) {
+  if (profiler->enabled)
+    profiler->start[phase] = profiler_now();
+}
+
+// Phases may be entered several times a frame; their times add up
+void profiler_end(Profiler *profiler, ProfilePhase phase) {
+  if (profiler->enabled)
+    profiler->current[phase] += profiler_now() - profiler->start[phase];
+}
+
+// Adds time measured elsewhere, e.g. on another thread, to this frame
+void profiler_add(Profiler *profiler, ProfilePhase phase, double seconds) {
+  if (profiler->enabled)
+    profiler->current[phase] += seconds;
+}
+
+void profiler_record(Profiler *profiler, ProfilePhase phase, double seconds) {
+  size_t i = profiler->count[phase]++ % PROFILE_HISTORY;
+  profiler->history[phase][i] = seconds;
+  profiler->total[phase] += seconds;
+}
+
+// Brackets GL work of a frame with a GL_TIME_ELAPSED query timing phase.
+// Ranges can't nest. They are skipped while every query is still in
+// flight rather than stalling on one.
+void profiler_gpu_begin(Profiler *profiler, ProfilePhase phase = PROFILE_GPU) {
+  if (!profiler->gpu ||
+      profiler->gpu_issued - profiler->gpu_read == PROFILE_GPU_QUERIES)
+    return;
+
+  size_t i = profiler->gpu_issued % PROFILE_GPU_QUERIES;
+  profiler->gpu_phases[i] = phase;
+  glBeginQuery(GL_TIME_ELAPSED, profiler->gpu_queries[i]);
+}
+
+void profiler_gpu_end(Profiler *profiler) {
+  if (!profiler->gpu ||
+      profiler->gpu_issued - profiler->gpu_read == PROFILE_GPU_QUERIES)
+    return;
+
+  glEndQuery(GL_TIME_ELAPSED);
+  ++profiler->gpu_issued;
+}
+
+// Commits this frame's CPU phases to the history and collects any GPU
+// results that have come back
+void profiler_end_frame(Profiler *profiler) {
+  if (!profiler->enabled)
+    return;
+
+  for (size_t phase = 0; phase < PROFILE_NUM_PHASES; ++phase) {
+    if (phase != PROFILE_GPU && phase != PROFILE_POST &&
+        phase != PROFILE_INPUT && phase != PROFILE_LATE)
+      profiler_record(profiler, (ProfilePhase)phase, profiler->current[phase]);
+    profiler->current[phase] = 0.0;
+  }
+
+  while (profiler->gpu_read < profiler->gpu_issued) {
+    size_t i = profiler->gpu_read % PROFILE_GPU_QUERIES;
+    GLuint query = profiler->gpu_queries[i];
+    GLint available = 0;
+    glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available)
+      break;
+
+    GLuint64 elapsed = 0;
+    glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+    profiler_record(profiler, profiler->gpu_phases[i], elapsed * 1e-9);
+    ++profiler->gpu_read;
+  }
+}
+
+// Call once the swap of a frame showing the first inputs queued actions
+// has returned: records how long ago the oldest action it is the first to
+// show was queued. *shown tracks the inputs earlier frames showed.
+void profiler_record_input(Profiler *profiler, size_t inputs, size_t *shown) {
+  if (inputs == *shown)
+    return;
+
+  double time;
+  if (profiler->enabled && input_queue_time(input_queue, *shown, &time))
+    profiler_record(profiler, PROFILE_INPUT, glfwGetTime() - time);
+  *shown = inputs;
+}
+
+// Min, mean and 99th percentile over the rolling window, in seconds
+ProfileStats profiler_stats(const Profiler &profiler, ProfilePhase phase) {
+  ProfileStats stats = {0.0, 0.0, 0.0};
+  size_t n = std::min(profiler.count[phase], (size_t)PROFILE_HISTORY);
+  if (n == 0)
+    return stats;
+
+  float samples[PROFILE_HISTORY];
+  memcpy(samples, profiler.history[phase], n * sizeof(float));
+  std::sort(samples, samples + n);
+
+  double sum = 0.0;
+  for (size_t i = 0; i < n; ++i)
+    sum += samples[i];
+
+  stats.min = samples[0];
+  stats.avg = sum / n;
+  stats.p99 = samples[(99 * n + 99) / 100 - 1];
+  return stats;
+}
+
+// One line per phase going down from y: name, then min, avg and p99 in
+// microseconds
+void profiler_draw(const Profiler &profiler, Buffer *buffer,
+                   const CompiledSprite &text_spritesheet,
+                   const CompiledSprite &number_spritesheet, size_t x,
+                   size_t y, uint32_t color) {
+  if (!profiler.enabled)
+    return;
+
+  size_t line_height = text_spritesheet.height + 2;
+  size_t column = 6 * (text_spritesheet.width + 1);
+  size_t stats_x = x + 8 * (text_spritesheet.width + 1);
+  buffer_draw_text(buffer, text_spritesheet, "US", x, y, color);
+  buffer_draw_text(buffer, text_spritesheet, "MIN", stats_x, y, color);
+  buffer_draw_text(buffer, text_spritesheet, "AVG", stats_x + column, y,
+                   color);
+  buffer_draw_text(buffer, text_spritesheet, "P99", stats_x + 2 * column, y,
+                   color);
+
+  for (size_t phase = 0; phase < PROFILE_NUM_PHASES; ++phase) {
+    y -= line_height;
+    ProfileStats stats = profiler_stats(profiler, (ProfilePhase)phase);
+    buffer_draw_text(buffer, text_spritesheet, profile_phase_names[phase], x,
+                     y, color);
+    buffer_draw_number(buffer, number_spritesheet, stats.min * 1e6 + 0.5,
+                       stats_x, y, color);
+    buffer_draw_number(buffer, number_spritesheet, stats.avg * 1e6 + 0.5,
+                       stats_x + column, y, color);
+    buffer_draw_number(buffer, number_spritesheet, stats.p99 * 1e6 + 0.5,
+                       stats_x + 2 * column, y, color);
+  }
+}
+
+bool profiler_write_csv(const Profiler &profiler, const char *path) {
+  FILE *file = fopen(path, "w");
+  if (!file)
+    return false;
+
+  fprintf(file, "phase,samples,min_us,avg_us,p99_us,run_avg_us\n");
+  for (size_t phase = 0; phase < PROFILE_NUM_PHASES; ++phase) {
+    ProfileStats stats = profiler_stats(profiler, (ProfilePhase)phase);
+    size_t count = profiler.count[phase];
+    double run_avg = count ? profiler.total[phase] / count : 0.0;
+    fprintf(file, "%s,%zu,%.1f,%.1f,%.1f,%.1f\n", profile_phase_names[phase],
+            count, stats.min * 1e6, stats.avg * 1e6, stats.p99 * 1e6,
+            run_avg * 1e6);
+  }
+
+  fclose(file);
+  return true;
+}
+
+// Parses "WIDTHxHEIGHT"
+bool parse_size(const char *text, size_t *width, size_t *height) {
+  char *end;
+  *width = strtoul(text, &end, 10);
+  if (end == text || *end != 'x')
+    return false;
+
+  const char *rest = end + 1;
+  *height = strtoul(rest, &end, 10);
+  return end != rest && *end == '\0';
+}
+
+bool options_parse(Options *options, int argc, char const *argv[]) {
+  options->width = GAME_MIN_WIDTH;
+  options->height = GAME_MIN_HEIGHT;
+  options->window_width = 0;
+  options->window_height = 0;
+  options->fullscreen = false;
+  options->scaling = SCALING_INTEGER;
+  options->blit_kernels = 0;
+  options->dirty_rects = true;
+  options->sim_thread = true;
+  options->raster_threads = 1;
+  options->upload = "direct";
+  options->pbo_slots = 3;
+  options->tick_rate = 60.0;
+  options->pacing = PACING_VSYNC;
+  options->swap_interval = 1;
+  options->max_fps = 0.0;
+  options->interpolate = false;
+  options->collision_mode = COLLISION_AABB;
+  options->profile = false;
+  options->profile_csv = 0;
+  options->headless = false;
+  options->frames = 0;
+  options->seek = 0;
+  options->batch = 0;
+  options->batch_threads = 0;
+  options->batch_observe = 0;
+  options->replay = 0;
+  options->record = 0;
+  options->renderer = RENDERER_SOFTWARE;
+  options->indexed = false;
+  options->crt = false;
+  options->assets = "assets";
+  options->stage = 1;
+
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    if (strncmp(arg, "--kernels=", 10) == 0) {
+      options->blit_kernels = arg + 10;
+    } else if (strcmp(arg, "--no-dirty-rects") == 0) {
+      options->dirty_rects = false;
+    } else if (strcmp(arg, "--no-sim-thread") == 0) {
+      options->sim_thread = false;
+    } else if (strncmp(arg, "--raster-threads=", 17) == 0) {
+      options->raster_threads = strtoul(arg + 17, 0, 10);
+      if (options->raster_threads > RASTER_MAX_THREADS) {
+        fprintf(stderr, "--raster-threads must be at most %d\n",
+                RASTER_MAX_THREADS);
+        return false;
+      }
+    } else if (strncmp(arg, "--upload=", 9) == 0) {
+      options->upload = arg + 9;
+      if (strcmp(options->upload, "direct") != 0 &&
+          strcmp(options->upload, "pbo") != 0 &&
+          strcmp(options->upload, "orphan") != 0) {
+        fprintf(stderr, "--upload must be direct, pbo or orphan\n");
+        return false;
+      }
+    } else if (strncmp(arg, "--tick-rate=", 12) == 0) {
+      options->tick_rate = atof(arg + 12);
+      if (options->tick_rate <= 0.0) {
+        fprintf(stderr, "--tick-rate must be positive\n");
+        return false;
+      }
+    } else if (strncmp(arg, "--swap-interval=", 16) == 0) {
+      options->swap_interval = atoi(arg + 16);
+    } else if (strncmp(arg, "--max-fps=", 10) == 0) {
+      options->max_fps = atof(arg + 10);
+      options->pacing = PACING_CAPPED;
+      if (options->max_fps <= 0.0) {
+        fprintf(stderr, "--max-fps must be positive\n");
+        return false;
+      }
+    } else if (strcmp(arg, "--pacing=vsync") == 0) {
+      options->pacing = PACING_VSYNC;
+    } else if (strcmp(arg, "--pacing=adaptive") == 0) {
+      options->pacing = PACING_ADAPTIVE;
+    } else if (strcmp(arg, "--pacing=uncapped") == 0) {
+      options->pacing = PACING_UNCAPPED;
+    } else if (strcmp(arg, "--pacing=capped") == 0) {
+      options->pacing = PACING_CAPPED;
+    } else if (strcmp(arg, "--interpolate") == 0) {
+      options->interpolate = true;
+    } else if (strcmp(arg, "--collision=aabb") == 0) {
+      options->collision_mode = COLLISION_AABB;
+    } else if (strcmp(arg, "--collision=pixel") == 0) {
+      options->collision_mode = COLLISION_PIXEL;
+    } else if (strcmp(arg, "--profile") == 0) {
+      options->profile = true;
+    } else if (strncmp(arg, "--profile-csv=", 14) == 0) {
+      options->profile = true;
+      options->profile_csv = arg + 14;
+    } else if (strncmp(arg, "--resolution=", 13) == 0) {
+      if (!parse_size(arg + 13, &options->width, &options->height) ||
+          options->width < GAME_MIN_WIDTH ||
+          options->height < GAME_MIN_HEIGHT ||
+          options->width > GAME_MAX_SIZE || options->height > GAME_MAX_SIZE) {
+        fprintf(stderr, "--resolution must be WxH, from %dx%d to %dx%d\n",
+                GAME_MIN_WIDTH, GAME_MIN_HEIGHT, GAME_MAX_SIZE, GAME_MAX_SIZE);
+        return false;
+      }
+    } else if (strncmp(arg, "--window=", 9) == 0) {
+      if (!parse_size(arg + 9, &options->window_width,
+                      &options->window_height) ||
+          options->window_width == 0 || options->window_height == 0) {
+        fprintf(stderr, "--window must be WxH\n");
+        return false;
+      }
+    } else if (strcmp(arg, "--fullscreen") == 0) {
+      options->fullscreen = true;
+    } else if (strcmp(arg, "--scaling=integer") == 0) {
+      options->scaling = SCALING_INTEGER;
+    } else if (strcmp(arg, "--scaling=fit") == 0) {
+      options->scaling = SCALING_FIT;
+    } else if (strcmp(arg, "--scaling=stretch") == 0) {
+      options->scaling = SCALING_STRETCH;
+    } else if (strncmp(arg, "--assets=", 9) == 0) {
+      options->assets = arg + 9;
+    } else if (strncmp(arg, "--stage=", 8) == 0) {
+      options->stage = strtoul(arg + 8, 0, 10);
+      if (options->stage == 0) {
+        fprintf(stderr, "--stage must be 1 or more\n");
+        return false;
+      }
+    } else if (strcmp(arg, "--indexed") == 0) {
+      options->indexed = true;
+    } else if (strcmp(arg, "--crt") == 0) {
+      options->crt = true;
+    } else if (strcmp(arg, "--renderer=software") == 0) {
+      options->renderer = RENDERER_SOFTWARE;
+    } else if (strcmp(arg, "--renderer=gpu") == 0) {
+      options->renderer = RENDERER_GPU;
+    } else if (strcmp(arg, "--headless") == 0) {
+      options->headless = true;
+    } else if (strncmp(arg, "--frames=", 9) == 0) {
+      options->frames = strtoul(arg + 9, 0, 10);
+    } else if (strncmp(arg, "--replay=", 9) == 0) {
+      options->replay = arg + 9;
+    } else if (strncmp(arg, "--seek=", 7) == 0) {
+      options->seek = strtoul(arg + 7, 0, 10);
+    } else if (strncmp(arg, "--batch=", 8) == 0) {
+      options->batch = strtoul(arg + 8, 0, 10);
+      options->headless = true;
+    } else if (strncmp(arg, "--batch-threads=", 16) == 0) {
+      options->batch_threads = strtoul(arg + 16, 0, 10);
+      if (options->batch_threads > BATCH_MAX_THREADS) {
+        fprintf(stderr, "--batch-threads must be at most %d\n",
+                BATCH_MAX_THREADS);
+        return false;
+      }
+    } else if (strncmp(arg, "--batch-observe=", 16) == 0) {
+      options->batch_observe = strtoul(arg + 16, 0, 10);
+    } else if (strncmp(arg, "--record=", 9) == 0) {
+      options->record = arg + 9;
+    } else if (strncmp(arg, "--pbo-slots=", 12) == 0) {
+      options->pbo_slots = strtoul(arg + 12, 0, 10);
+      if (options->pbo_slots < 2 ||
+          options->pbo_slots > PIXEL_STREAM_MAX_SLOTS) {
+        fprintf(stderr, "--pbo-slots must be 2 or 3\n");
+        return false;
+      }
+    } else {
+      fprintf(stderr, "Unknown option: %s\n", arg);
+      return false;
+    }
+  }
+
+  if (options->headless && options->renderer == RENDERER_GPU) {
+    fprintf(stderr, "--renderer=gpu needs a window\n");
+    return false;
+  }
+
+  if (options->indexed && options->renderer == RENDERER_GPU) {
+    fprintf(stderr, "--indexed draws with the software renderer\n");
+    return false;
+  }
+
+  // A headless run has no window to close
+  if (options->headless && options->frames == 0)
+    options->frames = 1000;
+
+  return true;
+}
+
+//** Batch Runner */
+// Draws what a bot sees of game into an indexed buffer
+void game_draw_observation(Buffer *buffer, const Game &game,
+                           const GameAssets &assets) {
+  buffer_clear(buffer, OBSERVE_EMPTY);
+  const ShieldStore &shields = game.shields;
+  for (size_t si = 0; si < shields.count; ++si) {
+    buffer_sprite_draw(buffer, shield_store_sprite(shields, si),
+                       shields.x[si], shields.y[si], OBSERVE_SHIELD);
+  }
+
+  const AlienStore &aliens = game.aliens;
+  for (size_t i = 0; i < aliens.num_live; ++i) {
+    size_t ai = aliens.live[i];
+    buffer_sprite_draw(buffer,
+                       animation_compiled_sprite(game.animation,
+                                                 assets.alien_animation,
+                                                 aliens.type[ai] - 1),
+                       aliens.x[ai] + game.formation.x,
+                       aliens.y[ai] + game.formation.y, OBSERVE_ALIEN);
+  }
+
+  const BulletPool &bullets = game.bullets;
+  for (size_t bi = 0; bi < bullets.count; ++bi) {
+    buffer_sprite_draw(buffer, *assets.compiled_bullet_sprite, bullets.x[bi],
+                       bullets.y[bi],
+                       bullets.dir[bi] > 0 ? OBSERVE_PLAYER_BULLET
+                                           : OBSERVE_ALIEN_BULLET);
+  }
+  buffer_sprite_draw(buffer, *assets.compiled_player_sprite, game.player.x,
+                     game.player.y, OBSERVE_PLAYER);
+}
+
+// ORs each scale x scale block of a full-size observation into one pixel
+// of obs. A block row is ORed down into a local row 8 pixels at a time,
+// then that row across. Sizes are copied to locals since the byte stores
+// could alias them.
+void batch_runner_downsample(const BatchRunner &runner, const Buffer &scratch,
+                             uint8_t *obs) {
+  const size_t scale = runner.scale;
+  const size_t width = scratch.width, height = scratch.height;
+  const size_t obs_width = runner.obs_width;
+  const size_t words = width / 8;
+  if (scale == 1) {
+    memcpy(obs, scratch.indices, width * height);
+    return;
+  }
+
+  uint64_t pooled[GAME_MAX_SIZE / 8];
+  uint8_t *pooled_bytes = (uint8_t *)pooled;
+  for (size_t oy = 0; oy < runner.obs_height; ++oy) {
+    memset(pooled, 0, (width + 7) / 8 * 8);
+    size_t y_end = std::min((oy + 1) * scale, height);
+    for (size_t y = oy * scale; y < y_end; ++y) {
+      const uint8_t *row = scratch.indices + y * width;
+      for (size_t w = 0; w < words; ++w) {
+        uint64_t bits;
+        memcpy(&bits, row + 8 * w, 8);
+        pooled[w] |= bits;
+      }
+      for (size_t x = 8 * words; x < width; ++x)
+        pooled_bytes[x] |= row[x];
+    }
+
+    uint8_t *obs_row = obs + oy * obs_width;
+    for (size_t ox = 0; ox < obs_width; ++ox) {
+      size_t x_end = std::min((ox + 1) * scale, width);
+      uint8_t flags = OBSERVE_EMPTY;
+      for (size_t x = ox * scale; x < x_end; ++x)
+        flags |= pooled_bytes[x];
+      obs_row[ox] = flags;
+    }
+  }
+}
+
+void batch_runner_step_env(BatchRunner *runner, size_t i, Buffer *scratch) {
+  GameSnapshot *env = &runner->envs[i];
+  const BatchAction &action = runner->actions[i];
+  size_t score = env->game.score;
+  game_step(env, runner->assets, action.move_dir, action.fire);
+  runner->rewards[i] = (int32_t)(env->game.score - score);
+  runner->done[i] = env->over;
+  if (env->over)
+    game_snapshot_restore(env, *runner->initial);
+
+  if (action.observe && runner->scale) {
+    game_draw_observation(scratch, env->game, *runner->assets);
+    batch_runner_downsample(
+        *runner, *scratch,
+        runner->observations + i * runner->obs_width * runner->obs_height);
+  }
+}
+
+// Steps chunks until the tickets below end are taken; see rasterizer_run
+void batch_runner_run(BatchRunner *runner, size_t end, size_t thread) {
+  size_t first = end - runner->num_chunks;
+  size_t ticket = runner->next_chunk.load();
+  while (ticket < end) {
+    if (!runner->next_chunk.compare_exchange_weak(ticket, ticket + 1))
+      continue;
+
+    size_t begin = (ticket - first) * BATCH_CHUNK;
+    size_t stop = std::min(begin + BATCH_CHUNK, runner->num_envs);
+    for (size_t i = begin; i < stop; ++i) {
+      batch_runner_step_env(runner, i, &runner->scratch[thread]);
+    }
+    if (runner->chunks_done.fetch_add(1) + 1 == end) {
+      std::lock_guard<std::mutex> lock(runner->mutex);
+      runner->done_stepping.notify_one();
+    }
+    ticket = runner->next_chunk.load();
+  }
+}
+
+void batch_runner_worker(BatchRunner *runner, size_t thread) {
+  size_t generation = 0;
+  for (;;) {
+    size_t end;
+    {
+      std::unique_lock<std::mutex> lock(runner->mutex);
+      while (!runner->quit && runner->generation == generation)
+        runner->wake.wait(lock);
+      if (runner->quit)
+        return;
+      generation = runner->generation;
+      end = runner->chunk_end;
+    }
+    batch_runner_run(runner, end, thread);
+  }
+}
+
+// Starts num_envs environments at initial. Everything is allocated from
+// arena; scale is buffer pixels per observation pixel, 0 for none.
+// num_threads - 1 workers are started, the thread stepping makes up the
+// rest.
+void batch_runner_init(BatchRunner *runner, Arena *arena,
+                       const GameSnapshot &initial, GameAssets *assets,
+                       size_t num_envs, size_t scale, size_t num_threads) {
+  runner->num_envs = num_envs;
+  runner->envs = arena_push<GameSnapshot>(arena, num_envs);
+  for (size_t i = 0; i < num_envs; ++i) {
+    game_snapshot_save(initial, &runner->envs[i]);
+  }
+  runner->initial = &initial;
+  runner->assets = assets;
+  runner->actions = 0;
+  runner->rewards = arena_push<int32_t>(arena, num_envs);
+  runner->done = arena_push<uint8_t>(arena, num_envs);
+
+  const Game &game = initial.game;
+  runner->scale = scale;
+  runner->obs_width = scale ? (game.width + scale - 1) / scale : 0;
+  runner->obs_height = scale ? (game.height + scale - 1) / scale : 0;
+  runner->observations = arena_push<uint8_t>(
+      arena, num_envs * runner->obs_width * runner->obs_height);
+  for (size_t t = 0; t < num_threads; ++t) {
+    Buffer &scratch = runner->scratch[t];
+    scratch.width = game.width;
+    scratch.height = game.height;
+    scratch.data = 0;
+    scratch.indices =
+        scale ? arena_push<uint8_t>(arena, game.width * game.height) : 0;
+    scratch.dirty = 0;
+    scratch.raster = 0;
+  }
+
+  runner->num_threads = num_threads;
+  runner->num_chunks = (num_envs + BATCH_CHUNK - 1) / BATCH_CHUNK;
+  runner->generation = 0;
+  runner->chunk_end = 0;
+  runner->quit = false;
+  runner->next_chunk.store(0);
+  runner->chunks_done.store(0);
+  for (size_t t = 0; t + 1 < num_threads; ++t) {
+    runner->workers[t] = std::thread(batch_runner_worker, runner, t);
+  }
+}
+
+void batch_runner_free(BatchRunner *runner) {
+  {
+    std::lock_guard<std::mutex> lock(runner->mutex);
+    runner->quit = true;
+  }
+  runner->wake.notify_all();
+  for (size_t t = 0; t + 1 < runner->num_threads; ++t) {
+    runner->workers[t].join();
+  }
+}
+
+// Steps every environment once with actions[i]. Returns once rewards,
+// done and the observations asked for hold the results; environments
+// that ended have been reset.
+void batch_runner_step(BatchRunner *runner, const BatchAction *actions) {
+  size_t end;
+  {
+    std::lock_guard<std::mutex> lock(runner->mutex);
+    runner->actions = actions;
+    runner->chunk_end += runner->num_chunks;
+    end = runner->chunk_end;
+    ++runner->generation;
+  }
+  runner->wake.notify_all();
+  batch_runner_run(runner, end, runner->num_threads - 1);
+
+  std::unique_lock<std::mutex> lock(runner->mutex);
+  while (runner->chunks_done.load() != end)
+    runner->done_stepping.wait(lock);
+}
+
+// Runs options.batch environments for options.frames steps under a random
+// policy, as a throughput benchmark. The hash covers every reward, done
+// flag and the last observations; it doesn't depend on the thread count.
+void batch_benchmark(const Options &options, const GameSnapshot &initial,
+                     GameAssets *assets) {
+  size_t num_threads = options.batch_threads;
+  if (num_threads == 0) {
+    num_threads = std::min((size_t)std::thread::hardware_concurrency(),
+                           (size_t)BATCH_MAX_THREADS);
+  }
+  num_threads = std::max(num_threads, (size_t)1);
+
+  size_t num_envs = options.batch;
+  size_t scale = options.batch_observe;
+  size_t obs_size = scale ? ((initial.game.width + scale - 1) / scale) *
+                                ((initial.game.height + scale - 1) / scale)
+                          : 0;
+  size_t scratch_size = scale ? initial.game.width * initial.game.height : 0;
+  Arena batch_arena;
+  arena_init(&batch_arena, "batch",
+             num_envs * (sizeof(GameSnapshot) + sizeof(BatchAction) +
+                         sizeof(int32_t) + 1 + obs_size + sizeof(uint32_t)) +
+                 num_threads * scratch_size + ARENA_SLACK);
+
+  BatchRunner *runner = new BatchRunner;
+  batch_runner_init(runner, &batch_arena, initial, assets, num_envs, scale,
+                    num_threads);
+  BatchAction *actions = arena_push<BatchAction>(&batch_arena, num_envs);
+  uint32_t *random = arena_push<uint32_t>(&batch_arena, num_envs);
+  for (size_t i = 0; i < num_envs; ++i) {
+    random[i] = 2654435761u * (uint32_t)(i + 1);
+  }
+
+  uint64_t hash = 14695981039346656037ull;
+  size_t episodes = 0;
+  int64_t total_reward = 0;
+  double start = profiler_now();
+  for (size_t step = 0; step < options.frames; ++step) {
+    // Stands in for a bot: moves held for a while and shots now and then
+    for (size_t i = 0; i < num_envs; ++i) {
+      uint32_t &r = random[i];
+      r ^= r << 13;
+      r ^= r >> 17;
+      r ^= r << 5;
+      if ((r & 15) == 0)
+        actions[i].move_dir = (int8_t)((r >> 4) % 3) - 1;
+      actions[i].fire = (r >> 8) % 8 == 0;
+      actions[i].observe = scale > 0;
+    }
+
+    batch_runner_step(runner, actions);
+    for (size_t i = 0; i < num_envs; ++i) {
+      total_reward += runner->rewards[i];
+      episodes += runner->done[i];
+      hash = (hash ^ (uint32_t)runner->rewards[i]) * 1099511628211ull;
+      hash = (hash ^ runner->done[i]) * 1099511628211ull;
+    }
+  }
+  double elapsed = profiler_now() - start;
+  for (size_t i = 0; i < num_envs * obs_size; ++i) {
+    hash = (hash ^ runner->observations[i]) * 1099511628211ull;
+  }
+
+  double env_steps = (double)num_envs * options.frames;
+  printf("Batch: %zu environments x %zu steps on %zu threads in %.3f s "
+         "(%.0f env-steps/s)\n",
+         num_envs, options.frames, num_threads, elapsed,
+         elapsed > 0.0 ? env_steps / elapsed : 0.0);
+  if (scale) {
+    printf("Batch: observations %zux%zu\n", runner->obs_width,
+           runner->obs_height);
+  }
+  printf("Batch: %zu episodes ended, reward %lld, hash %016llx\n", episodes,
+         (long long)total_reward, (unsigned long long)hash);
+
+  batch_runner_free(runner);
+  delete runner;
+  arena_free(&batch_arena);
+}
+
+//** Programs */
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t size) {
+  const uint8_t *bytes = (const uint8_t *)data;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+// Loads dir/programs.bin. A missing, damaged or other driver's file leaves
+// the cache empty and is replaced on exit.
+void program_cache_init(ProgramCache *cache, const char *dir) {
+  memset(cache, 0, sizeof(*cache));
+  snprintf(cache->path, sizeof(cache->path), "%s/programs.bin", dir);
+  GLint num_formats = 0;
+  if (GLEW_ARB_get_program_binary)
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+  cache->enabled = num_formats > 0;
+  if (!cache->enabled)
+    return;
+
+  const GLenum strings[3] = {GL_VENDOR, GL_RENDERER, GL_VERSION};
+  cache->driver = 14695981039346656037ull;
+  for (size_t i = 0; i < 3; ++i) {
+    const char *string = (const char *)glGetString(strings[i]);
+    if (string)
+      cache->driver = hash_bytes(cache->driver, string, strlen(string) + 1);
+  }
+
+  FILE *file = fopen(cache->path, "rb");
+  if (!file)
+    return;
+
+  ProgramCacheHeader header;
+  if (fread(&header, sizeof(header), 1, file) == 1 &&
+      header.magic == PROGRAM_CACHE_MAGIC && header.driver == cache->driver &&
+      header.num_programs <= PROGRAM_CACHE_MAX) {
+    for (size_t i = 0; i < header.num_programs; ++i) {
+      ProgramCacheRecord &record = cache->records[cache->num_programs];
+      if (fread(&record, sizeof(record), 1, file) != 1 ||
+          record.size > 16 * 1024 * 1024)
+        break;
+
+      uint8_t *binary = new uint8_t[record.size];
+      if (fread(binary, 1, record.size, file) != record.size) {
+        delete[] binary;
+        break;
+      }
+      cache->binaries[cache->num_programs++] = binary;
+    }
+  }
+  fclose(file);
+}
+
+// Keeps a linked program's binary under key, replacing an older one
+void program_cache_store(ProgramCache *cache, uint64_t key, GLuint program) {
+  GLint size = 0;
+  glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+  if (size <= 0)
+    return;
+
+  size_t i = 0;
+  while (i < cache->num_programs && cache->records[i].key != key)
+    ++i;
+  if (i == PROGRAM_CACHE_MAX)
+    return;
+
+  uint8_t *binary = new uint8_t[size];
+  GLenum format = 0;
+  GLsizei length = 0;
+  glGetProgramBinary(program, size, &length, &format, binary);
+  if (length <= 0) {
+    delete[] binary;
+    return;
+  }
+
+  if (i == cache->num_programs)
+    ++cache->num_programs;
+  else
+    delete[] cache->binaries[i];
+  cache->records[i].key = key;
+  cache->records[i].format = format;
+  cache->records[i].size = length;
+  cache->binaries[i] = binary;
+  cache->changed = true;
+}
+
+// Writes the cache back if a program was added, the same way as the asset
+// cache: to a temporary file that is renamed over the old one
+void program_cache_free(ProgramCache *cache) {
+  if (cache->changed) {
+    char temp_path[ASSET_MAX_PATH + 8];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", cache->path);
+    FILE *file = fopen(temp_path, "wb");
+    bool ok = file != 0;
+    if (ok) {
+      ProgramCacheHeader header = {PROGRAM_CACHE_MAGIC,
+                                   (uint32_t)cache->num_programs,
+                                   cache->driver};
+      ok = fwrite(&header, sizeof(header), 1, file) == 1;
+      for (size_t i = 0; ok && i < cache->num_programs; ++i) {
+        const ProgramCacheRecord &record = cache->records[i];
+        ok = fwrite(&record, sizeof(record), 1, file) == 1 &&
+             fwrite(cache->binaries[i], 1, record.size, file) == record.size;
+      }
+      ok = fclose(file) == 0 && ok;
+    }
+    if (ok)
+      ok = rename(temp_path, cache->path) == 0;
+    if (!ok) {
+      remove(temp_path);
+      fprintf(stderr, "Could not write %s\n", cache->path);
+    }
+  }
+
+  for (size_t i = 0; i < cache->num_programs; ++i) {
+    delete[] cache->binaries[i];
+  }
+  cache->num_programs = 0;
+}
+
+void validate_shader(GLuint shader, const char *file = 0) {
+  static const unsigned int BUFFER_SIZE = 512;
+  char buffer[BUFFER_SIZE];
+  GLsizei length = 0;
+
+  glGetShaderInfoLog(shader, BUFFER_SIZE, &length, buffer);
+
+  if (length > 0) {
+    printf("Shader %d(%s) compile error: %s\n", shader, (file ? file : ""),
+           buffer);
+  }
+}
+
+bool validate_program(GLuint program) {
+  static const GLsizei BUFFER_SIZE = 512;
+  GLchar buffer[BUFFER_SIZE];
+  GLsizei length = 0;
+
+  glGetProgramInfoLog(program, BUFFER_SIZE, &length, buffer);
+
+  if (length > 0) {
+    printf("Program %d link error: %s\n", program, buffer);
+    return false;
+  }
+
+  return true;
+}
+
+// Compiles and links a vertex and fragment shader, or loads the binary a
+// previous run cached for them on this driver. Returns 0 on failure.
+GLuint program_create(ProgramCache *cache, const char *vertex_shader,
+                      const char *fragment_shader) {
+  double start = profiler_now();
+  uint64_t key = hash_bytes(cache->driver, vertex_shader,
+                            strlen(vertex_shader) + 1);
+  key = hash_bytes(key, fragment_shader, strlen(fragment_shader) + 1);
+  for (size_t i = 0; cache->enabled && i < cache->num_programs; ++i) {
+    const ProgramCacheRecord &record = cache->records[i];
+    if (record.key != key)
+      continue;
+
+    // The driver may still refuse a binary, e.g. after an update that kept
+    // its version string; then the program is built again
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, record.format, cache->binaries[i], record.size);
+    GLint linked = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if (linked) {
+      ++cache->hits;
+      cache->seconds += profiler_now() - start;
+      return program;
+    }
+    glDeleteProgram(program);
+    break;
+  }
+
+  GLuint program = glCreateProgram();
+  if (cache->enabled)
+    glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+
+  const char *sources[2] = {vertex_shader, fragment_shader};
+  const GLenum types[2] = {GL_VERTEX_SHADER, GL_FRAGMENT_SHADER};
+  for (size_t i = 0; i < 2; ++i) {
+    GLuint shader = glCreateShader(types[i]);
+
+    glShaderSource(shader, 1, &sources[i], 0);
+    glCompileShader(shader);
+    validate_shader(shader, sources[i]);
+    glAttachShader(program, shader);
+
+    glDeleteShader(shader);
+  }
+
+  glLinkProgram(program);
+
+  if (!validate_program(program)) {
+    glDeleteProgram(program);
+    return 0;
+  }
+
+  if (cache->enabled)
+    program_cache_store(cache, key, program);
+  ++cache->misses;
+  cache->seconds += profiler_now() - start;
+  return program;
+}
+
+//** Frame Pacing */
+const char *pacing_mode_names[PACING_NUM_MODES] = {"vsync", "adaptive vsync",
+                                                   "uncapped", "capped"};
+
+// Switches modes, falling back to plain vsync for adaptive without tear
+// control. Needs the window's context current.
+void frame_pacer_set_mode(FramePacer *pacer, PacingMode mode) {
+  if (mode == PACING_ADAPTIVE && !pacer->tear_control)
+    mode = PACING_VSYNC;
+
+  pacer->mode = mode;
+  pacer->deadline = 0.0;
+  pacer->last_swap = 0.0;
+  if (mode == PACING_VSYNC)
+    glfwSwapInterval(pacer->swap_interval);
+  else if (mode == PACING_ADAPTIVE)
+    glfwSwapInterval(-1); // negative intervals tear when late
+  else
+    glfwSwapInterval(0);
+
+  if (mode == PACING_CAPPED)
+    printf("Pacing: capped at %.0f fps\n", 1.0 / pacer->cap_interval);
+  else
+    printf("Pacing: %s\n", pacing_mode_names[mode]);
+}
+
+// The refresh rate is the primary monitor's, which windows on another
+// monitor may not have
+void frame_pacer_init(FramePacer *pacer, const Options &options) {
+  GLFWmonitor *monitor = glfwGetPrimaryMonitor();
+  const GLFWvidmode *mode = monitor ? glfwGetVideoMode(monitor) : 0;
+  double refresh_rate = mode && mode->refreshRate > 0 ? mode->refreshRate : 60;
+
+  // GLFW reads the WGL or GLX extension string, whichever is in use
+  pacer->tear_control = glfwExtensionSupported("WGL_EXT_swap_control_tear") ||
+                        glfwExtensionSupported("GLX_EXT_swap_control_tear");
+  pacer->swap_interval = std::max(options.swap_interval, 0);
+  pacer->refresh_interval = 1.0 / refresh_rate;
+  pacer->cap_interval =
+      1.0 / (options.max_fps > 0.0 ? options.max_fps : refresh_rate);
+  pacer->spin = 0.002;
+  pacer->frames = 0;
+  pacer->late = 0;
+  if (options.pacing == PACING_ADAPTIVE && !pacer->tear_control)
+    printf("Adaptive vsync is unsupported (no EXT_swap_control_tear)\n");
+  frame_pacer_set_mode(pacer, options.pacing);
+}
+
+// Waits until glfwGetTime() reaches time. Sleeps can overshoot by a
+// scheduler tick, so the sleep stops spin seconds early and the rest is
+// spun; spin follows the worst recent overshoot.
+void frame_pacer_wait(FramePacer *pacer, double time) {
+  double sleep_end = time - pacer->spin;
+  if (glfwGetTime() < sleep_end) {
+    sleep_until(sleep_end);
+    double overshoot = glfwGetTime() - sleep_end;
+    pacer->spin =
+        std::min(std::max(std::max(0.99 * pacer->spin, 1.25 * overshoot),
+                          PACING_MIN_SPIN),
+                 PACING_MAX_SPIN);
+  }
+  while (glfwGetTime() < time)
+    std::this_thread::yield();
+}
+
+// Call once the swap has returned: waits out the rest of a capped frame
+// and counts the frame if it was late
+void frame_pacer_end_frame(FramePacer *pacer, Profiler *profiler) {
+  double now = glfwGetTime();
+  double late = 0.0;
+  if (pacer->mode == PACING_VSYNC || pacer->mode == PACING_ADAPTIVE) {
+    // A frame that misses its vblank swaps a whole refresh later (or tears
+    // right away, but still after its vblank)
+    int interval = pacer->mode == PACING_VSYNC ? pacer->swap_interval : 1;
+    double expected = std::max(interval, 1) * pacer->refresh_interval;
+    double elapsed = now - pacer->last_swap;
+    if (pacer->last_swap > 0.0 && elapsed > 1.5 * expected)
+      late = elapsed - expected;
+  } else if (pacer->mode == PACING_CAPPED) {
+    // Small overruns come out of the next frame's time; a missed frame
+    // restarts the cadence rather than rushing the ones after it
+    if (pacer->deadline == 0.0) {
+      pacer->deadline = now;
+    } else if (now > pacer->deadline + 0.25 * pacer->cap_interval) {
+      late = now - pacer->deadline;
+      pacer->deadline = now;
+    } else {
+      frame_pacer_wait(pacer, pacer->deadline);
+    }
+    pacer->deadline += pacer->cap_interval;
+  }
+  pacer->last_swap = now;
+
+  ++pacer->frames;
+  if (late > 0.0) {
+    ++pacer->late;
+    if (profiler->enabled)
+      profiler_record(profiler, PROFILE_LATE, late);
+  }
+}
+
+//** Display */
+// Fits the buffer into the framebuffer with glViewport, so scaling costs
+// the GPU fill rate only: the buffer and its uploads keep their size and
+// the fullscreen triangle samples it with GL_NEAREST.
+void display_update_viewport(Display *display) {
+  int framebuffer_width, framebuffer_height;
+  glfwGetFramebufferSize(display->window, &framebuffer_width,
+                         &framebuffer_height);
+
+  int width = framebuffer_width;
+  int height = framebuffer_height;
+  int buffer_width = display->buffer_width;
+  int buffer_height = display->buffer_height;
+  if (display->scaling != SCALING_STRETCH) {
+    int scale = std::min(framebuffer_width / buffer_width,
+                         framebuffer_height / buffer_height);
+    if (display->scaling == SCALING_INTEGER && scale >= 1) {
+      width = scale * buffer_width;
+      height = scale * buffer_height;
+    } else if (framebuffer_width * buffer_height >
+               framebuffer_height * buffer_width) {
+      width = framebuffer_height * buffer_width / buffer_height;
+    } else {
+      height = framebuffer_width * buffer_height / buffer_width;
+    }
+  }
+
+  display->viewport_x = (framebuffer_width - width) / 2;
+  display->viewport_y = (framebuffer_height - height) / 2;
+  display->viewport_width = width;
+  display->viewport_height = height;
+  glViewport(display->viewport_x, display->viewport_y, width, height);
+  display->letterboxed =
+      width != framebuffer_width || height != framebuffer_height;
+
+  if (display->crt_program) {
+    // Nothing is read from a pixel buffer: the storage starts undefined
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    gl_bind_texture(display->crt_texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB,
+                 GL_UNSIGNED_BYTE, 0);
+  }
+}
+
+// Sets up the CRT pass: a program and a framebuffer whose texture
+// display_update_viewport sizes. Returns false if the driver can't do it.
+bool display_crt_init(Display *display, const char *vertex_shader,
+                      size_t buffer_width, size_t buffer_height) {
+  // Barrel curvature, a little bloom from the neighboring buffer pixels
+  // and a scanline per buffer row, all at output resolution
+  const char *crt_fragment_shader =
+      "\n"
+      "#version 330\n"
+      "\n"
+      "uniform sampler2D frame;\n"
+      "uniform vec2 source_size;\n"
+      "noperspective in vec2 TexCoord;\n"
+      "\n"
+      "out vec3 outColor;\n"
+      "\n"
+      "void main(void){\n"
+      "    vec2 centered = 2.0 * TexCoord - 1.0;\n"
+      "    centered += centered * centered.yx * centered.yx * 0.06;\n"
+      "    vec2 uv = 0.5 * centered + 0.5;\n"
+      "    if (any(lessThan(uv, vec2(0.0))) ||\n"
+      "        any(greaterThan(uv, vec2(1.0)))) {\n"
+      "        outColor = vec3(0.0);\n"
+      "        return;\n"
+      "    }\n"
+      "\n"
+      "    vec2 texel = 1.0 / source_size;\n"
+      "    vec3 color = texture(frame, uv).rgb;\n"
+      "    vec3 glow = texture(frame, uv + vec2(texel.x, 0.0)).rgb +\n"
+      "                texture(frame, uv - vec2(texel.x, 0.0)).rgb +\n"
+      "                texture(frame, uv + vec2(0.0, texel.y)).rgb +\n"
+      "                texture(frame, uv - vec2(0.0, texel.y)).rgb;\n"
+      "    color += 0.1 * glow;\n"
+      "\n"
+      "    float row = fract(uv.y * source_size.y);\n"
+      "    color *= mix(0.55, 1.0, sin(3.14159265 * row));\n"
+      "    color *= 1.0 - 0.125 * dot(centered, centered);\n"
+      "    outColor = color;\n"
+      "}\n";
+
+  display->crt_program = program_create(&display->programs, vertex_shader,
+                                        crt_fragment_shader);
+  if (!display->crt_program)
+    return false;
+
+  gl_use_program(display->crt_program);
+  glUniform1i(glGetUniformLocation(display->crt_program, "frame"), 0);
+  glUniform2f(glGetUniformLocation(display->crt_program, "source_size"),
+              buffer_width, buffer_height);
+
+  // Linear so the curvature resamples smoothly
+  glGenTextures(1, &display->crt_texture);
+  gl_bind_texture(display->crt_texture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, 1, 1, 0, GL_RGB, GL_UNSIGNED_BYTE,
+               0);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+  glGenFramebuffers(1, &display->crt_framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, display->crt_framebuffer);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                         display->crt_texture, 0);
+  bool complete =
+      glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  if (!complete) {
+    glDeleteFramebuffers(1, &display->crt_framebuffer);
+    glDeleteTextures(1, &display->crt_texture);
+    glDeleteProgram(display->crt_program);
+    gl_state_reset();
+    display->crt_program = 0;
+    return false;
+  }
+  return true;
+}
+
+
+// Creates the window and the GL objects that present the buffer. On failure
+// everything is torn down again.
+bool display_init(Display *display, const Options &options,
+                  const Buffer &buffer) {
+  glfwSetErrorCallback(error_callback);
+
+  if (!glfwInit()) {
+    return false;
+  }
+
+  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+  glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+
+  // Fullscreen takes the monitor's current mode so it doesn't switch modes
+  int window_width = options.window_width ? options.window_width : buffer.width;
+  int window_height =
+      options.window_height ? options.window_height : buffer.height;
+  GLFWmonitor *monitor = 0;
+  if (options.fullscreen) {
+    monitor = glfwGetPrimaryMonitor();
+    const GLFWvidmode *mode = monitor ? glfwGetVideoMode(monitor) : 0;
+    if (mode) {
+      window_width = mode->width;
+      window_height = mode->height;
+      glfwWindowHint(GLFW_REFRESH_RATE, mode->refreshRate);
+    } else {
+      monitor = 0;
+    }
+  }
+
+  //* Create a windowed-mode window and its OpenGL context */
+  GLFWwindow *window =
+      glfwCreateWindow(window_width, window_height, "Title", monitor, NULL);
+  if (!window) {
+    glfwTerminate();
+    return false;
+  }
+
+  glfwMakeContextCurrent(window);
+  glfwSetKeyCallback(window, key_callback);
+  glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+
+  GLenum err = glewInit();
+  if (err != GLEW_OK) {
+    fprintf(stderr, "Error initializing GLEW.\n");
+    glfwTerminate();
+    return false;
+  }
+
+  // Call OpenGL
+  int glVersion[2] = {-1, 1};
+  glGetIntegerv(GL_MAJOR_VERSION, &glVersion[0]);
+  glGetIntegerv(GL_MAJOR_VERSION, &glVersion[1]);
+
+  printf("Using OpenGL: %d.%d\n", glVersion[0], glVersion[1]);
+  printf("Renderer used: %s\n", glGetString(GL_RENDERER));
+  printf("Shading Language: %s\n", glGetString(GL_SHADING_LANGUAGE_VERSION));
+  gl_state_reset();
+  program_cache_init(&display->programs, options.assets);
+
+  // Shows in the letterbox bars
+  glClearColor(0.0, 0.0, 0.0, 1.0);
+
+  //* Texture for presenting buffer to OpenGL */
+  GLuint buffer_texture;
+  glGenTextures(1, &buffer_texture);
+  // specify image format and standard parameters
+  gl_bind_texture(buffer_texture);
+  if (buffer.indices) {
+    // Rows of indices are only byte aligned
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, buffer.width, buffer.height, 0,
+                 GL_RED, GL_UNSIGNED_BYTE, buffer.indices);
+  } else {
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, buffer.width, buffer.height, 0,
+                 GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, buffer.data);
+  }
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  // Dirty rectangles are uploaded straight out of the full-width buffer
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, buffer.width);
+
+  PixelUploadMode upload_mode = UPLOAD_DIRECT;
+  if (strcmp(options.upload, "pbo") == 0) {
+    upload_mode = GLEW_ARB_buffer_storage ? UPLOAD_PERSISTENT : UPLOAD_ORPHAN;
+  } else if (strcmp(options.upload, "orphan") == 0) {
+    upload_mode = UPLOAD_ORPHAN;
+  }
+
+  PixelStream &pixel_stream = display->pixel_stream;
+  if (!pixel_stream_init(&pixel_stream, upload_mode, options.pbo_slots,
+                         buffer)) {
+    fprintf(stderr, "Error creating pixel buffers, uploading directly.\n");
+    pixel_stream_free(&pixel_stream);
+    pixel_stream_init(&pixel_stream, UPLOAD_DIRECT, 0, buffer);
+  }
+
+  const char *upload_mode_names[] = {"direct", "orphaned PBO",
+                                     "persistent PBO"};
+  printf("Texture upload: %s\n", upload_mode_names[pixel_stream.mode]);
+
+  // vertex array object (VAO) for generating fullscreen triangle
+  GLuint fullscreen_triangle_vao;
+  glGenVertexArrays(1, &fullscreen_triangle_vao);
+  // glBindVertexArray(fullscreen_triangle_vao);
+
+  // Shaders for displaying buffers
+  const char *fragment_shader =
+      "\n"
+      "#version 330\n"
+      "\n"
+      "uniform sampler2D buffer;\n"
+      "noperspective in vec2 TexCoord;\n"
+      "\n"
+      "out vec3 outColor;\n"
+      "\n"
+      "void main(void){\n"
+      "    outColor = texture(buffer, TexCoord).rgb;\n"
+      "}\n";
+
+  // Indexed buffers hold palette indices in the red channel
+  const char *palette_fragment_shader =
+      "\n"
+      "#version 330\n"
+      "\n"
+      "uniform sampler2D buffer;\n"
+      "uniform vec3 palette[16];\n" // PALETTE_SIZE
+      "noperspective in vec2 TexCoord;\n"
+      "\n"
+      "out vec3 outColor;\n"
+      "\n"
+      "void main(void){\n"
+      "    int index = int(texture(buffer, TexCoord).r * 255.0 + 0.5);\n"
+      "    outColor = palette[index & 15];\n"
+      "}\n";
+
+  const char *vertex_shader =
+      "\n"
+      "#version 330\n"
+      "\n"
+      "noperspective out vec2 TexCoord;\n"
+      "\n"
+      "void main(void){\n"
+      "\n"
+      "    TexCoord.x = (gl_VertexID == 2)? 2.0: 0.0;\n"
+      "    TexCoord.y = (gl_VertexID == 1)? 2.0: 0.0;\n"
+      "    \n"
+      "    gl_Position = vec4(2.0 * TexCoord - 1.0, 0.0, 1.0);\n"
+      "}\n";
+
+  // Compile 2 shaders into code the GPU can understand and linked into a shader
+  // program
+  GLuint shader_id = program_create(
+      &display->programs, vertex_shader,
+      buffer.indices ? palette_fragment_shader : fragment_shader);
+  if (!shader_id) {
+    fprintf(stderr, "Error while validating shader.\n");
+    glDeleteVertexArrays(1, &fullscreen_triangle_vao);
+    program_cache_free(&display->programs);
+    glfwTerminate();
+    return false;
+  }
+
+  gl_use_program(shader_id);
+
+  GLint location = glGetUniformLocation(shader_id, "buffer");
+  glUniform1i(location, 0);
+  display->palette_location =
+      buffer.indices ? glGetUniformLocation(shader_id, "palette") : -1;
+
+  display->crt = false;
+  display->crt_program = 0;
+  if (display_crt_init(display, vertex_shader, buffer.width, buffer.height)) {
+    display->crt = options.crt;
+  } else {
+    fprintf(stderr, "Error setting up the CRT pass, it is unavailable.\n");
+  }
+
+  // OpenGL setup for Buffer Display
+  glDisable(GL_DEPTH_TEST);
+  gl_bind_vertex_array(fullscreen_triangle_vao);
+
+  // V-sync mode on, unless pacing says otherwise
+  // https://www.glfw.org/docs/latest/group__context.html#ga6d4e0cdf151b5e579bd67f13202994ed
+  frame_pacer_init(&display->pacer, options);
+
+  display->window = window;
+  display->texture = buffer_texture;
+  display->vao = fullscreen_triangle_vao;
+  display->program = shader_id;
+
+  display->scaling = options.scaling;
+  display->buffer_width = buffer.width;
+  display->buffer_height = buffer.height;
+  display_update_viewport(display);
+  return true;
+}
+
+void display_free(Display *display) {
+  pixel_stream_free(&display->pixel_stream);
+  glDeleteVertexArrays(1, &display->vao);
+  glDeleteTextures(1, &display->texture);
+  glDeleteProgram(display->program);
+  if (display->crt_program) {
+    glDeleteFramebuffers(1, &display->crt_framebuffer);
+    glDeleteTextures(1, &display->crt_texture);
+    glDeleteProgram(display->crt_program);
+  }
+  program_cache_free(&display->programs);
+
+  glfwDestroyWindow(display->window);
+  glfwTerminate();
+}
+
+// Sets the colors indexed buffers are shown with. Swapping palettes is free,
+// which makes flashes and color cycling cheap.
+void display_set_palette(Display *display, const uint32_t *colors,
+                         size_t num_colors) {
+  if (display->palette_location < 0)
+    return;
+
+  GLfloat rgb[3 * PALETTE_SIZE] = {0};
+  for (size_t i = 0; i < num_colors && i < PALETTE_SIZE; ++i) {
+    rgb[3 * i + 0] = ((colors[i] >> 16) & 0xFF) / 255.0f;
+    rgb[3 * i + 1] = ((colors[i] >> 8) & 0xFF) / 255.0f;
+    rgb[3 * i + 2] = (colors[i] & 0xFF) / 255.0f;
+  }
+  gl_use_program(display->program);
+  glUniform3fv(display->palette_location, PALETTE_SIZE, rgb);
+}
+
+// Picks up framebuffer resizes and CRT and pacing toggles, then points
+// drawing at the screen, clearing the bars around the viewport, or at the
+// CRT pass
+void display_begin_frame(Display *display) {
+  if (framebuffer_resized) {
+    framebuffer_resized = false;
+    display_update_viewport(display);
+  }
+  if (pacing_cycled) {
+    pacing_cycled = false;
+    int mode = (display->pacer.mode + 1) % PACING_NUM_MODES;
+    if (mode == PACING_ADAPTIVE && !display->pacer.tear_control)
+      ++mode;
+    frame_pacer_set_mode(&display->pacer, (PacingMode)mode);
+  }
+  if (crt_toggled) {
+    crt_toggled = false;
+    display->crt = !display->crt && display->crt_program;
+  }
+
+  if (display->crt) {
+    glBindFramebuffer(GL_FRAMEBUFFER, display->crt_framebuffer);
+    glViewport(0, 0, display->viewport_width, display->viewport_height);
+  } else if (display->letterboxed) {
+    glClear(GL_COLOR_BUFFER_BIT);
+  }
+}
+
+// Runs the CRT pass, if on, from the drawn frame onto the screen. It is
+// timed on the GPU as its own phase.
+void display_end_frame(Display *display, Profiler *profiler) {
+  if (!display->crt)
+    return;
+
+  profiler_gpu_begin(profiler, PROFILE_POST);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glViewport(display->viewport_x, display->viewport_y,
+             display->viewport_width, display->viewport_height);
+  if (display->letterboxed)
+    glClear(GL_COLOR_BUFFER_BIT);
+  gl_use_program(display->crt_program);
+  gl_bind_texture(display->crt_texture);
+  gl_bind_vertex_array(display->vao);
+  glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+  profiler_gpu_end(profiler);
+}
+
+// Draws the uploaded buffer over the viewport
+void display_draw(Display *display) {
+  gl_use_program(display->program);
+  gl_bind_texture(display->texture);
+  gl_bind_vertex_array(display->vao);
+  glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+}
+
+// Puts the frame on screen and paces the loop. inputs is how many input
+// actions the frame shows, for profiler_record_input. Events are polled by
+// the caller, just before the simulation uses them.
+void display_present(Display *display, Profiler *profiler, size_t inputs,
+                     size_t *inputs_shown) {
+  profiler_begin(profiler, PROFILE_SWAP);
+  glfwSwapBuffers(display->window);
+  profiler_end(profiler, PROFILE_SWAP);
+  profiler_record_input(profiler, inputs, inputs_shown);
+  frame_pacer_end_frame(&display->pacer, profiler);
+}
+
+//** Sprite Renderer */
+void sprite_atlas_init(SpriteAtlas *atlas) {
+  atlas->width = SPRITE_ATLAS_WIDTH;
+  atlas->height = 0;
+  atlas->num_entries = 0;
+  atlas->shelf_x = 0;
+  atlas->shelf_y = 0;
+  atlas->shelf_height = 0;
+}
+
+// Packs num_frames consecutive bitmaps of the sprite's size. Returns the
+// entry of the first frame, the rest follow it, or -1 when the atlas is
+// full.
+ptrdiff_t sprite_atlas_add(SpriteAtlas *atlas, const Sprite &sprite,
+                           size_t num_frames = 1) {
+  if (atlas->num_entries + num_frames > SPRITE_ATLAS_MAX_ENTRIES ||
+      sprite.width > atlas->width)
+    return -1;
+
+  size_t first = atlas->num_entries;
+  for (size_t i = 0; i < num_frames; ++i) {
+    if (atlas->shelf_x + sprite.width > atlas->width) {
+      atlas->shelf_y += atlas->shelf_height;
+      atlas->shelf_x = 0;
+      atlas->shelf_height = 0;
+    }
+
+    AtlasEntry &entry = atlas->entries[atlas->num_entries++];
+    entry.x = atlas->shelf_x;
+    entry.y = atlas->shelf_y;
+    entry.width = sprite.width;
+    entry.height = sprite.height;
+    entry.data = sprite.data + i * sprite.width * sprite.height;
+
+    atlas->shelf_x += sprite.width;
+    if (sprite.height > atlas->shelf_height)
+      atlas->shelf_height = sprite.height;
+  }
+  atlas->height = atlas->shelf_y + atlas->shelf_height;
+
+  return first;
+}
+
+// Writes the packed bitmaps into width * height texels, 255 where opaque
+void sprite_atlas_rasterize(const SpriteAtlas &atlas, uint8_t *texels) {
+  memset(texels, 0, atlas.width * atlas.height);
+  for (size_t i = 0; i < atlas.num_entries; ++i) {
+    const AtlasEntry &entry = atlas.entries[i];
+    for (size_t yi = 0; yi < entry.height; ++yi) {
+      uint8_t *row = texels + (entry.y + yi) * atlas.width + entry.x;
+      for (size_t xi = 0; xi < entry.width; ++xi) {
+        row[xi] = entry.data[yi * entry.width + xi] ? 255 : 0;
+      }
+    }
+  }
+}
+
+// The atlas is rasterized into scratch memory that is given back on return
+bool sprite_renderer_init(SpriteRenderer *renderer, const SpriteAtlas &atlas,
+                          size_t width, size_t height, Arena *scratch,
+                          ProgramCache *programs) {
+  // Corners come from gl_VertexID, everything else from the instance
+  const char *vertex_shader =
+      "\n"
+      "#version 330\n"
+      "\n"
+      "uniform vec2 viewport;\n"
+      "layout(location = 0) in ivec4 rect;\n"
+      "layout(location = 1) in ivec2 atlas_origin;\n"
+      "layout(location = 2) in vec4 color;\n"
+      "\n"
+      "out vec2 local;\n"
+      "flat out ivec4 source;\n"
+      "flat out vec4 tint;\n"
+      "\n"
+      "void main(void){\n"
+      "    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);\n"
+      "    local = corner * vec2(rect.zw);\n"
+      "    source = ivec4(atlas_origin, rect.zw);\n"
+      "    tint = color;\n"
+      "    vec2 position = (vec2(rect.xy) + local) / viewport;\n"
+      "    gl_Position = vec4(2.0 * position - 1.0, 0.0, 1.0);\n"
+      "}\n";
+
+  // Sprite rows run top to bottom while the buffer's y goes up
+  const char *fragment_shader =
+      "\n"
+      "#version 330\n"
+      "\n"
+      "uniform sampler2D atlas;\n"
+      "in vec2 local;\n"
+      "flat in ivec4 source;\n"
+      "flat in vec4 tint;\n"
+      "\n"
+      "out vec3 outColor;\n"
+      "\n"
+      "void main(void){\n"
+      "    if (source.x >= 0) {\n"
+      "        ivec2 texel = ivec2(local);\n"
+      "        texel.y = source.w - 1 - texel.y;\n"
+      "        if (texelFetch(atlas, source.xy + texel, 0).r < 0.5)\n"
+      "            discard;\n"
+      "    }\n"
+      "    outColor = tint.rgb;\n"
+      "}\n";
+
+  renderer->program = program_create(programs, vertex_shader, fragment_shader);
+  if (!renderer->program)
+    return false;
+
+  // Uniforms stay with the program, so they are set once here
+  gl_use_program(renderer->program);
+  glUniform1i(glGetUniformLocation(renderer->program, "atlas"), 0);
+  renderer->viewport_location =
+      glGetUniformLocation(renderer->program, "viewport");
+  renderer->viewport_width = width;
+  renderer->viewport_height = height;
+  glUniform2f(renderer->viewport_location, width, height);
+  renderer->num_instances = 0;
+
+  size_t mark = scratch->used;
+  uint8_t *texels = arena_push<uint8_t>(scratch, atlas.width * atlas.height);
+  if (!texels) {
+    glDeleteProgram(renderer->program);
+    return false;
+  }
+  sprite_atlas_rasterize(atlas, texels);
+  glGenTextures(1, &renderer->atlas_texture);
+  gl_bind_texture(renderer->atlas_texture);
+  // The display sets a row length for its dirty rectangles
+  GLint row_length, alignment;
+  glGetIntegerv(GL_UNPACK_ROW_LENGTH, &row_length);
+  glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, atlas.width, atlas.height, 0, GL_RED,
+               GL_UNSIGNED_BYTE, texels);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, row_length);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  arena_reset(scratch, mark);
+
+  glGenVertexArrays(1, &renderer->vao);
+  gl_bind_vertex_array(renderer->vao);
+  glGenBuffers(1, &renderer->instance_vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, renderer->instance_vbo);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(renderer->instances), 0,
+               GL_STREAM_DRAW);
+
+  const GLsizei stride = sizeof(SpriteInstance);
+  glEnableVertexAttribArray(0);
+  glVertexAttribIPointer(0, 4, GL_SHORT, stride,
+                         (void *)offsetof(SpriteInstance, x));
+  glEnableVertexAttribArray(1);
+  glVertexAttribIPointer(1, 2, GL_SHORT, stride,
+                         (void *)offsetof(SpriteInstance, atlas_x));
+  glEnableVertexAttribArray(2);
+  glVertexAttribPointer(2, GL_BGRA, GL_UNSIGNED_BYTE, GL_TRUE, stride,
+                        (void *)offsetof(SpriteInstance, color));
+  for (GLuint i = 0; i < 3; ++i)
+    glVertexAttribDivisor(i, 1);
+
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  gl_bind_vertex_array(0);
+  return true;
+}
+
+void sprite_renderer_free(SpriteRenderer *renderer) {
+  gl_state_reset();
+  glDeleteBuffers(1, &renderer->instance_vbo);
+  glDeleteVertexArrays(1, &renderer->vao);
+  glDeleteTextures(1, &renderer->atlas_texture);
+  glDeleteProgram(renderer->program);
+}
+
+void sprite_renderer_push(SpriteRenderer *renderer, int16_t x, int16_t y,
+                          int16_t width, int16_t height, int16_t atlas_x,
+                          int16_t atlas_y, uint32_t color) {
+  if (renderer->num_instances == SPRITE_RENDERER_MAX_INSTANCES)
+    return;
+
+  SpriteInstance &instance = renderer->instances[renderer->num_instances++];
+  instance.x = x;
+  instance.y = y;
+  instance.width = width;
+  instance.height = height;
+  instance.atlas_x = atlas_x;
+  instance.atlas_y = atlas_y;
+  instance.color = color;
+}
+
+void sprite_renderer_draw(SpriteRenderer *renderer, const AtlasEntry &entry,
+                          int16_t x, int16_t y, uint32_t color) {
+  sprite_renderer_push(renderer, x, y, entry.width, entry.height, entry.x,
+                       entry.y, color);
+}
+
+void sprite_renderer_fill_rect(SpriteRenderer *renderer, int16_t x, int16_t y,
+                               int16_t width, int16_t height, uint32_t color) {
+  sprite_renderer_push(renderer, x, y, width, height, -1, 0, color);
+}
+
+// Draws a bitmap that changes too often for the atlas, like a worn shield,
+// as one filled instance per run of set bits of each row
+void sprite_renderer_draw_mask(SpriteRenderer *renderer,
+                               const CompiledSprite &sprite, int16_t x,
+                               int16_t y, uint32_t color) {
+  for (size_t yi = 0; yi < sprite.height; ++yi) {
+    int16_t row_y = y + sprite.height - 1 - yi;
+    for (size_t w = 0; w < sprite.stride; ++w) {
+      uint32_t bits = sprite.rows[yi * sprite.stride + w];
+      while (bits) {
+        unsigned start = bit_scan_forward(bits);
+        uint32_t past = ~(bits >> start); // lowest set bit ends the run
+        unsigned end = past ? start + bit_scan_forward(past) : 32;
+        sprite_renderer_fill_rect(renderer, x + w * 32 + start, row_y,
+                                  end - start, 1, color);
+        bits = end < 32 ? bits & (~0u << end) : 0;
+      }
+    }
+  }
+}
+
+void sprite_renderer_begin_frame(SpriteRenderer *renderer,
+                                 uint32_t clear_color) {
+  renderer->num_instances = 0;
+  glClearColor(((clear_color >> 16) & 0xFF) / 255.0f,
+               ((clear_color >> 8) & 0xFF) / 255.0f,
+               (clear_color & 0xFF) / 255.0f, 1.0f);
+  glClear(GL_COLOR_BUFFER_BIT);
+}
+
+// Streams the batched instances into an orphaned buffer and draws them all
+// with one call
+void sprite_renderer_flush(SpriteRenderer *renderer) {
+  gl_use_program(renderer->program);
+  gl_bind_texture(renderer->atlas_texture);
+  gl_bind_vertex_array(renderer->vao);
+
+  glBindBuffer(GL_ARRAY_BUFFER, renderer->instance_vbo);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(renderer->instances), 0,
+               GL_STREAM_DRAW);
+  glBufferSubData(GL_ARRAY_BUFFER, 0,
+                  renderer->num_instances * sizeof(SpriteInstance),
+                  renderer->instances);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, renderer->num_instances);
+  renderer->num_instances = 0;
+}
+
+//** Render List */
+// Returns the handle of a sprite for render_list_sprite
+size_t render_list_add_sprite(RenderList *list, const CompiledSprite &sprite,
+                              int32_t atlas_entry) {
+  if (list->num_sprites == RENDER_LIST_MAX_SPRITES) {
+    fprintf(stderr, "Render list is out of sprite handles\n");
+    abort();
+  }
+
+  RenderSprite &entry = list->sprites[list->num_sprites];
+  entry.compiled = sprite;
+  entry.atlas_entry = atlas_entry;
+  return list->num_sprites++;
+}
+
+void render_list_begin(RenderList *list) {
+  list->num_bitmaps = 0;
+  list->num_commands = 0;
+}
+
+// Draws past RENDER_LIST_MAX_COMMANDS are dropped, like renderer instances
+RenderCommand *render_list_push(RenderList *list, RenderLayer layer,
+                                RenderCommandType type, size_t sprite,
+                                int16_t x, int16_t y, uint8_t color) {
+  if (list->num_commands == RENDER_LIST_MAX_COMMANDS)
+    return 0;
+
+  RenderCommand *command = &list->commands[list->num_commands++];
+  command->layer = layer;
+  command->type = type;
+  command->sprite = sprite;
+  command->x = x;
+  command->y = y;
+  command->width = 0;
+  command->height = 0;
+  command->color = color;
+  return command;
+}
+
+void render_list_sprite(RenderList *list, RenderLayer layer, size_t sprite,
+                        int16_t x, int16_t y, uint8_t color) {
+  render_list_push(list, layer, RENDER_SPRITE, sprite, x, y, color);
+}
+
+// The bitmap's rows must stay valid until the list has been drawn
+void render_list_bitmap(RenderList *list, RenderLayer layer,
+                        const CompiledSprite &bitmap, int16_t x, int16_t y,
+                        uint8_t color) {
+  if (list->num_bitmaps == RENDER_LIST_MAX_BITMAPS)
+    return;
+
+  list->bitmaps[list->num_bitmaps] = bitmap;
+  render_list_push(list, layer, RENDER_BITMAP, list->num_bitmaps++, x, y,
+                   color);
+}
+
+void render_list_fill(RenderList *list, RenderLayer layer, int16_t x,
+                      int16_t y, int16_t width, int16_t height,
+                      uint8_t color) {
+  RenderCommand *command =
+      render_list_push(list, layer, RENDER_FILL, 0, x, y, color);
+  if (command) {
+    command->width = width;
+    command->height = height;
+  }
+}
+
+inline uint32_t render_command_key(const RenderCommand &command) {
+  return (uint32_t)command.layer << 24 | (uint32_t)command.type << 16 |
+         command.sprite;
+}
+
+// Dense form of the key, ordered the same way: one bucket per layer,
+// command type and sprite or bitmap index below num_indices
+inline size_t render_command_bucket(const RenderCommand &command,
+                                    size_t num_indices) {
+  return (command.layer * RENDER_NUM_TYPES + command.type) * num_indices +
+         command.sprite;
+}
+
+// Worst case of the scratch memory render_list_sort takes
+size_t render_list_sort_scratch_size() {
+  size_t num_indices =
+      std::max(RENDER_LIST_MAX_SPRITES, RENDER_LIST_MAX_BITMAPS);
+  return LAYER_NUM_LAYERS * RENDER_NUM_TYPES * num_indices * sizeof(uint16_t) +
+         RENDER_LIST_MAX_COMMANDS * sizeof(RenderCommand);
+}
+
+// Groups the draws by layer, then by sprite. It is a counting sort through
+// scratch memory, given back on return: stable, so a list always comes out
+// in the same order and so do the pixels, and free of allocations.
+void render_list_sort(RenderList *list, Arena *scratch) {
+  size_t num_indices = std::max<size_t>(
+      std::max(list->num_sprites, list->num_bitmaps), 1);
+  size_t num_buckets = LAYER_NUM_LAYERS * RENDER_NUM_TYPES * num_indices;
+  size_t mark = scratch->used;
+  uint16_t *starts = arena_push<uint16_t>(scratch, num_buckets);
+  RenderCommand *sorted =
+      arena_push<RenderCommand>(scratch, list->num_commands);
+  if (!starts || !sorted) {
+    arena_reset(scratch, mark);
+    return;
+  }
+
+  for (size_t i = 0; i < list->num_commands; ++i) {
+    ++starts[render_command_bucket(list->commands[i], num_indices)];
+  }
+  size_t offset = 0;
+  for (size_t b = 0; b < num_buckets; ++b) {
+    size_t count = starts[b];
+    starts[b] = offset;
+    offset += count;
+  }
+  for (size_t i = 0; i < list->num_commands; ++i) {
+    const RenderCommand &command = list->commands[i];
+    sorted[starts[render_command_bucket(command, num_indices)]++] = command;
+  }
+
+  memcpy(list->commands, sorted, list->num_commands * sizeof(sorted[0]));
+  arena_reset(scratch, mark);
+}
+
+// Software backend, for one thread or the banded rasterizer behind the
+// buffer. colors maps palette indices to the buffer's format.
+void buffer_draw_list(Buffer *buffer, const RenderList &list,
+                      const uint32_t *colors) {
+  size_t i = 0;
+  while (i < list.num_commands) {
+    const RenderCommand &first = list.commands[i];
+    if (first.type == RENDER_FILL) {
+      buffer_fill_rect(buffer, first.x, first.y, first.width, first.height,
+                       colors[first.color]);
+      ++i;
+      continue;
+    }
+
+    // The sprite is looked up once for its whole run
+    const CompiledSprite &sprite = first.type == RENDER_SPRITE
+                                       ? list.sprites[first.sprite].compiled
+                                       : list.bitmaps[first.sprite];
+    uint32_t key = render_command_key(first);
+    for (; i < list.num_commands &&
+           render_command_key(list.commands[i]) == key;
+         ++i) {
+      const RenderCommand &command = list.commands[i];
+      buffer_sprite_draw(buffer, sprite, command.x, command.y,
+                         colors[command.color]);
+    }
+  }
+}
+
+// GPU backend: sprites become atlas instances, and bitmaps and sprites not
+// in the atlas go through sprite_renderer_draw_mask
+void sprite_renderer_draw_list(SpriteRenderer *renderer,
+                               const SpriteAtlas &atlas,
+                               const RenderList &list,
+                               const uint32_t *palette) {
+  for (size_t i = 0; i < list.num_commands; ++i) {
+    const RenderCommand &command = list.commands[i];
+    uint32_t color = palette[command.color];
+    if (command.type == RENDER_FILL) {
+      sprite_renderer_fill_rect(renderer, command.x, command.y, command.width,
+                                command.height, color);
+    } else if (command.type == RENDER_BITMAP) {
+      sprite_renderer_draw_mask(renderer, list.bitmaps[command.sprite],
+                                command.x, command.y, color);
+    } else if (list.sprites[command.sprite].atlas_entry >= 0) {
+      const RenderSprite &sprite = list.sprites[command.sprite];
+      sprite_renderer_draw(renderer, atlas.entries[sprite.atlas_entry],
+                           command.x, command.y, color);
+    } else {
+      sprite_renderer_draw_mask(renderer,
+                                list.sprites[command.sprite].compiled,
+                                command.x, command.y, color);
+    }
+  }
+}
+
+//** Assets */
+// Sprites and stages are authored as text in the asset directory and
+// compiled into one binary cache next to them, holding everything the game
+// derives from them: texels, row bitmasks, the atlas layout and the stage
+// cells. Startup maps the cache and points Sprites, CompiledSprites and the
+// atlas straight into it; the text is only parsed again once it changes.
+void asset_blob_init(AssetBlob *blob) {
+  blob->data = 0;
+  blob->size = 0;
+  blob->capacity = 0;
+}
+
+void asset_blob_free(AssetBlob *blob) {
+  delete[] blob->data;
+  asset_blob_init(blob);
+}
+
+// Appends size zeroed bytes at the next 4-byte boundary and returns their
+// offset. The blob may move, so pointers into it don't survive this.
+size_t asset_blob_alloc(AssetBlob *blob, size_t size) {
+  size_t offset = (blob->size + 3) & ~(size_t)3;
+  size_t end = offset + size;
+  if (end > blob->capacity) {
+    size_t capacity = blob->capacity ? 2 * blob->capacity : 4096;
+    while (capacity < end)
+      capacity *= 2;
+    uint8_t *data = new uint8_t[capacity];
+    if (blob->size)
+      memcpy(data, blob->data, blob->size);
+    delete[] blob->data;
+    blob->data = data;
+    blob->capacity = capacity;
+  }
+
+  memset(blob->data + blob->size, 0, end - blob->size);
+  blob->size = end;
+  return offset;
+}
+
+// Changes whenever either source is edited; 0 when one can't be found
+uint64_t asset_source_stamp(const char *sprites_path, const char *stages_path) {
+  const char *paths[2] = {sprites_path, stages_path};
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < 2; ++i) {
+    struct stat info;
+    if (stat(paths[i], &info) != 0)
+      return 0;
+
+    uint64_t values[2] = {(uint64_t)info.st_size, (uint64_t)info.st_mtime};
+    for (size_t v = 0; v < 2; ++v) {
+      for (size_t byte = 0; byte < 8; ++byte) {
+        hash ^= (values[v] >> (8 * byte)) & 0xFF;
+        hash *= 1099511628211ull;
+      }
+    }
+  }
+  return hash ? hash : 1;
+}
+
+// Reads the next line that isn't blank or a comment, without its newline
+bool asset_read_line(FILE *file, char *line, size_t size,
+                     size_t *line_number) {
+  while (fgets(line, size, file)) {
+    ++*line_number;
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] != '\0' && line[0] != '#')
+      return true;
+  }
+  return false;
+}
+
+bool asset_parse_sprites(AssetBlob *blob, AssetSprite *sprites,
+                         size_t *num_sprites, const char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "Could not open %s\n", path);
+    return false;
+  }
+
+  char line[2 * SPRITE_ATLAS_WIDTH];
+  size_t line_number = 0;
+  bool ok = true;
+  while (ok && asset_read_line(file, line, sizeof(line), &line_number)) {
+    AssetSprite sprite;
+    memset(&sprite, 0, sizeof(sprite));
+    unsigned width = 0, height = 0, num_frames = 1;
+    int fields = sscanf(line, "sprite %23s %u %u %u", sprite.name, &width,
+                        &height, &num_frames);
+    ok = fields >= 3 && width > 0 && width <= SPRITE_ATLAS_WIDTH &&
+         height > 0 && height <= SPRITE_ATLAS_WIDTH && num_frames > 0 &&
+         num_frames <= SPRITE_ATLAS_MAX_ENTRIES &&
+         *num_sprites < ASSET_MAX_SPRITES;
+    for (size_t i = 0; ok && i < *num_sprites; ++i) {
+      ok = strcmp(sprites[i].name, sprite.name) != 0;
+    }
+    if (!ok) {
+      fprintf(stderr, "%s:%zu: bad or duplicate sprite\n", path, line_number);
+      break;
+    }
+
+    sprite.width = width;
+    sprite.height = height;
+    sprite.num_frames = num_frames;
+    sprite.stride = (width + 31) / 32;
+    sprite.data_offset = asset_blob_alloc(blob, width * height * num_frames);
+    for (size_t row = 0; ok && row < height * num_frames; ++row) {
+      ok = asset_read_line(file, line, sizeof(line), &line_number) &&
+           strspn(line, "@.") == width && line[width] == '\0';
+      if (!ok) {
+        fprintf(stderr, "%s:%zu: expected %u texels of \"@\" or \".\"\n",
+                path, line_number, width);
+        break;
+      }
+
+      uint8_t *texels = blob->data + sprite.data_offset + row * width;
+      for (size_t xi = 0; xi < width; ++xi) {
+        texels[xi] = line[xi] == '@';
+      }
+    }
+    sprites[(*num_sprites)++] = sprite;
+  }
+
+  fclose(file);
+  return ok;
+}
+
+// Copies the cells collected for stage into the blob
+bool asset_finish_stage(AssetBlob *blob, AssetStage *stage,
+                        const uint8_t *cells, const char *path) {
+  if (stage->rows == 0) {
+    fprintf(stderr, "%s: stage %s has no formation\n", path, stage->name);
+    return false;
+  }
+
+  size_t num_cells = stage->columns * stage->rows;
+  stage->cells_offset = asset_blob_alloc(blob, num_cells);
+  memcpy(blob->data + stage->cells_offset, cells, num_cells);
+  return true;
+}
+
+bool asset_parse_stages(AssetBlob *blob, AssetStage *stages,
+                        size_t *num_stages, const char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "Could not open %s\n", path);
+    return false;
+  }
+
+  char line[256];
+  size_t line_number = 0;
+  uint8_t cells[GAME_MAX_ALIENS];
+  AssetStage *stage = 0;
+  bool ok = true;
+  while (ok && asset_read_line(file, line, sizeof(line), &line_number)) {
+    unsigned x, y;
+    if (strncmp(line, "stage ", 6) == 0) {
+      ok = (!stage || asset_finish_stage(blob, stage, cells, path)) &&
+           *num_stages < ASSET_MAX_STAGES;
+      if (!ok)
+        break;
+
+      stage = &stages[(*num_stages)++];
+      memset(stage, 0, sizeof(*stage));
+      ok = sscanf(line, "stage %23s", stage->name) == 1;
+      stage->spacing_x = 16;
+      stage->spacing_y = 17;
+      stage->origin_x = 20;
+      stage->origin_y = 128;
+      stage->shields = 4;
+    } else if (stage && sscanf(line, "spacing %u %u", &x, &y) == 2) {
+      stage->spacing_x = x;
+      stage->spacing_y = y;
+    } else if (stage && sscanf(line, "origin %u %u", &x, &y) == 2) {
+      stage->origin_x = x;
+      stage->origin_y = y;
+    } else if (stage && sscanf(line, "shields %u", &x) == 1) {
+      ok = x <= GAME_MAX_SHIELDS;
+      stage->shields = x;
+    } else {
+      // A formation row; every row of a stage has the same length
+      size_t columns = strspn(line, "ABC.");
+      ok = stage && columns > 0 && line[columns] == '\0' &&
+           (stage->rows == 0 || columns == stage->columns) &&
+           (stage->rows + 1) * columns <= GAME_MAX_ALIENS;
+      if (!ok)
+        break;
+
+      for (size_t xi = 0; xi < columns; ++xi) {
+        cells[stage->rows * columns + xi] =
+            line[xi] == '.' ? 0 : line[xi] - 'A' + 1;
+      }
+      stage->columns = columns;
+      ++stage->rows;
+    }
+  }
+
+  if (!ok) {
+    fprintf(stderr, "%s:%zu: bad stage line\n", path, line_number);
+  } else if (!stage) {
+    fprintf(stderr, "%s: no stages\n", path);
+    ok = false;
+  } else {
+    ok = asset_finish_stage(blob, stage, cells, path);
+  }
+
+  fclose(file);
+  return ok;
+}
+
+Sprite asset_sprite_view(const AssetBlob &blob, const AssetSprite &sprite) {
+  Sprite view;
+  view.width = sprite.width;
+  view.height = sprite.height;
+  view.data = blob.data + sprite.data_offset;
+  return view;
+}
+
+// Parses the sources and lays out the cache: header, texels, stage cells,
+// row bitmasks, then the sprite, stage and atlas tables
+bool asset_cache_build(AssetBlob *blob, const char *sprites_path,
+                       const char *stages_path, uint64_t stamp) {
+  AssetSprite sprites[ASSET_MAX_SPRITES];
+  AssetStage stages[ASSET_MAX_STAGES];
+  size_t num_sprites = 0, num_stages = 0;
+  asset_blob_alloc(blob, sizeof(AssetCacheHeader));
+  if (!asset_parse_sprites(blob, sprites, &num_sprites, sprites_path) ||
+      !asset_parse_stages(blob, stages, &num_stages, stages_path))
+    return false;
+
+  SpriteAtlas atlas;
+  sprite_atlas_init(&atlas);
+  for (size_t i = 0; i < num_sprites; ++i) {
+    AssetSprite &sprite = sprites[i];
+    CompiledSprite compiled =
+        sprite_compile(asset_sprite_view(*blob, sprite), sprite.num_frames);
+    size_t rows_size =
+        sprite.height * sprite.num_frames * sprite.stride * sizeof(uint32_t);
+    sprite.rows_offset = asset_blob_alloc(blob, rows_size);
+    memcpy(blob->data + sprite.rows_offset, compiled.rows, rows_size);
+    delete[] compiled.rows;
+
+    ptrdiff_t entry = sprite_atlas_add(
+        &atlas, asset_sprite_view(*blob, sprite), sprite.num_frames);
+    if (entry < 0) {
+      fprintf(stderr, "%s: sprite %s doesn't fit in the atlas\n",
+              sprites_path, sprite.name);
+      return false;
+    }
+    sprite.atlas_entry = entry;
+  }
+
+  size_t sprites_offset =
+      asset_blob_alloc(blob, num_sprites * sizeof(AssetSprite));
+  memcpy(blob->data + sprites_offset, sprites,
+         num_sprites * sizeof(AssetSprite));
+  size_t stages_offset =
+      asset_blob_alloc(blob, num_stages * sizeof(AssetStage));
+  memcpy(blob->data + stages_offset, stages, num_stages * sizeof(AssetStage));
+
+  // Atlas entries refer to the texels by offset, frames in order
+  size_t atlas_offset =
+      asset_blob_alloc(blob, atlas.num_entries * sizeof(AssetAtlasEntry));
+  AssetAtlasEntry *entries = (AssetAtlasEntry *)(blob->data + atlas_offset);
+  for (size_t i = 0; i < num_sprites; ++i) {
+    const AssetSprite &sprite = sprites[i];
+    for (size_t frame = 0; frame < sprite.num_frames; ++frame) {
+      const AtlasEntry &source = atlas.entries[sprite.atlas_entry + frame];
+      AssetAtlasEntry &entry = entries[sprite.atlas_entry + frame];
+      entry.x = source.x;
+      entry.y = source.y;
+      entry.width = source.width;
+      entry.height = source.height;
+      entry.data_offset =
+          sprite.data_offset + frame * sprite.width * sprite.height;
+    }
+  }
+
+  AssetCacheHeader *header = (AssetCacheHeader *)blob->data;
+  header->magic = ASSET_CACHE_MAGIC;
+  header->version = ASSET_CACHE_VERSION;
+  header->source_stamp = stamp;
+  header->size = blob->size;
+  header->num_sprites = num_sprites;
+  header->num_stages = num_stages;
+  header->num_atlas_entries = atlas.num_entries;
+  header->atlas_width = atlas.width;
+  header->atlas_height = atlas.height;
+  header->sprites_offset = sprites_offset;
+  header->stages_offset = stages_offset;
+  header->atlas_offset = atlas_offset;
+  return true;
+}
+
+// Written next to the final path and renamed over it, so a reader never
+// maps a half-written cache
+bool asset_cache_write(const AssetBlob &blob, const char *path) {
+  char temp_path[ASSET_MAX_PATH + 8];
+  snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+  FILE *file = fopen(temp_path, "wb");
+  if (!file)
+    return false;
+
+  bool ok = fwrite(blob.data, 1, blob.size, file) == blob.size;
+  ok = fclose(file) == 0 && ok;
+  if (ok)
+    ok = rename(temp_path, path) == 0;
+  if (!ok)
+    remove(temp_path);
+  return ok;
+}
+
+#if defined(_WIN32)
+// No mmap: the cache is small enough to read in one go
+bool asset_file_map(const char *path, const uint8_t **base, size_t *size) {
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    return false;
+
+  fseek(file, 0, SEEK_END);
+  long length = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  uint8_t *data = length > 0 ? new uint8_t[length] : 0;
+  bool ok = data && fread(data, 1, length, file) == (size_t)length;
+  fclose(file);
+  if (!ok) {
+    delete[] data;
+    return false;
+  }
+
+  *base = data;
+  *size = length;
+  return true;
+}
+
+void asset_file_unmap(const uint8_t *base, size_t size) { delete[] base; }
+#else
+bool asset_file_map(const char *path, const uint8_t **base, size_t *size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat info;
+  void *mapped = MAP_FAILED;
+  if (fstat(fd, &info) == 0 && info.st_size > 0)
+    mapped = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED)
+    return false;
+
+  *base = (const uint8_t *)mapped;
+  *size = info.st_size;
+  return true;
+}
+
+void asset_file_unmap(const uint8_t *base, size_t size) {
+  munmap((void *)base, size);
+}
+#endif
+
+bool asset_range_valid(const AssetPack &pack, size_t offset, size_t size) {
+  return offset <= pack.size && size <= pack.size - offset;
+}
+
+// Checks the cache was built from the current sources (any stamp when 0)
+// by this version, and that every offset stays inside it
+bool asset_pack_validate(AssetPack *pack, uint64_t stamp) {
+  if (pack->size < sizeof(AssetCacheHeader))
+    return false;
+
+  const AssetCacheHeader &header = *(const AssetCacheHeader *)pack->base;
+  if (header.magic != ASSET_CACHE_MAGIC ||
+      header.version != ASSET_CACHE_VERSION || header.size != pack->size ||
+      (stamp && header.source_stamp != stamp) ||
+      (header.sprites_offset | header.stages_offset | header.atlas_offset) %
+          4 ||
+      !asset_range_valid(*pack, header.sprites_offset,
+                         header.num_sprites * sizeof(AssetSprite)) ||
+      !asset_range_valid(*pack, header.stages_offset,
+                         header.num_stages * sizeof(AssetStage)) ||
+      !asset_range_valid(*pack, header.atlas_offset,
+                         header.num_atlas_entries * sizeof(AssetAtlasEntry)) ||
+      header.num_atlas_entries > SPRITE_ATLAS_MAX_ENTRIES)
+    return false;
+
+  pack->header = &header;
+  pack->sprites = (const AssetSprite *)(pack->base + header.sprites_offset);
+  pack->stages = (const AssetStage *)(pack->base + header.stages_offset);
+  pack->atlas_entries =
+      (const AssetAtlasEntry *)(pack->base + header.atlas_offset);
 
-//** Helper Functions */
-void buffer_sprite_draw(Buffer *buffer, const Sprite &sprite, size_t x,
-                        size_t y, uint32_t color) {
-  for (size_t xi = 0; xi < sprite.width; ++xi) {
-    for (size_t yi = 0; yi < sprite.height; ++yi) {
-      size_t sy = sprite.height - 1 + y - yi;
-      size_t sx = x + xi;
-      if (sprite.data[yi * sprite.width + xi] && sy < buffer->height &&
-          sx < buffer->width) {
-        buffer->data[sy * buffer->width + sx] = color;
-      }
+  for (size_t i = 0; i < header.num_sprites; ++i) {
+    const AssetSprite &sprite = pack->sprites[i];
+    size_t num_rows = sprite.height * sprite.num_frames;
+    if (!memchr(sprite.name, '\0', ASSET_NAME_SIZE) ||
+        sprite.stride != (sprite.width + 31) / 32 ||
+        sprite.atlas_entry + sprite.num_frames > header.num_atlas_entries ||
+        !asset_range_valid(*pack, sprite.data_offset,
+                           num_rows * sprite.width) ||
+        sprite.rows_offset % 4 ||
+        !asset_range_valid(*pack, sprite.rows_offset,
+                           num_rows * sprite.stride * sizeof(uint32_t)))
+      return false;
+  }
+  for (size_t i = 0; i < header.num_stages; ++i) {
+    const AssetStage &stage = pack->stages[i];
+    size_t num_cells = (size_t)stage.columns * stage.rows;
+    if (!memchr(stage.name, '\0', ASSET_NAME_SIZE) ||
+        stage.shields > GAME_MAX_SHIELDS || num_cells > GAME_MAX_ALIENS ||
+        !asset_range_valid(*pack, stage.cells_offset, num_cells))
+      return false;
+
+    // Cells index the alien types, as the text parser leaves them
+    const uint8_t *cells = pack->base + stage.cells_offset;
+    for (size_t ci = 0; ci < num_cells; ++ci) {
+      if (cells[ci] > 3)
+        return false;
     }
   }
+  for (size_t i = 0; i < header.num_atlas_entries; ++i) {
+    const AssetAtlasEntry &entry = pack->atlas_entries[i];
+    if (entry.x + entry.width > header.atlas_width ||
+        entry.y + entry.height > header.atlas_height ||
+        !asset_range_valid(*pack, entry.data_offset,
+                           entry.width * entry.height))
+      return false;
+  }
+  return true;
 }
 
-void buffer_draw_text(Buffer *buffer, const Sprite &text_spritesheet,
-                      const char *text, size_t x, size_t y, uint32_t color) {
-  size_t xp = x;
-  size_t stride = text_spritesheet.width * text_spritesheet.height;
-  Sprite sprite = text_spritesheet;
-  for (const char *charp = text; *charp != '\0'; ++charp) {
-    char character = *charp - 32;
-    if (character < 0 || character >= 65)
-      continue;
+void asset_pack_close(AssetPack *pack) {
+  if (pack->mapped)
+    asset_file_unmap(pack->base, pack->size);
+  else
+    delete[] pack->base;
+  pack->base = 0;
+  pack->size = 0;
+}
 
-    sprite.data = text_spritesheet.data + character * stride;
-    buffer_sprite_draw(buffer, sprite, xp, y, color);
-    xp += sprite.width + 1;
+bool asset_pack_map(AssetPack *pack, const char *path, uint64_t stamp) {
+  if (!asset_file_map(path, &pack->base, &pack->size))
+    return false;
+
+  pack->mapped = true;
+  if (!asset_pack_validate(pack, stamp)) {
+    asset_pack_close(pack);
+    return false;
   }
+  return true;
 }
 
-void buffer_draw_number(Buffer *buffer, const Sprite &number_spritesheet,
-                        size_t number, size_t x, size_t y, uint32_t color) {
-  uint8_t digits[64];
-  size_t num_digits = 0;
+// Maps dir/assets.bin, first rebuilding it from dir/sprites.txt and
+// dir/stages.txt if it is missing or older than them. Without the sources
+// the cache is used as is.
+bool asset_pack_load(AssetPack *pack, const char *dir) {
+  char sprites_path[ASSET_MAX_PATH], stages_path[ASSET_MAX_PATH];
+  char cache_path[ASSET_MAX_PATH];
+  snprintf(sprites_path, sizeof(sprites_path), "%s/sprites.txt", dir);
+  snprintf(stages_path, sizeof(stages_path), "%s/stages.txt", dir);
+  snprintf(cache_path, sizeof(cache_path), "%s/assets.bin", dir);
 
-  size_t current_number = number;
-  do {
-    digits[num_digits++] = current_number % 10;
-    current_number = current_number / 10;
-  } while (current_number > 0);
+  uint64_t stamp = asset_source_stamp(sprites_path, stages_path);
+  if (asset_pack_map(pack, cache_path, stamp)) {
+    printf("Assets: %s\n", cache_path);
+    return true;
+  }
+  if (!stamp) {
+    fprintf(stderr, "No assets found in %s\n", dir);
+    return false;
+  }
 
-  size_t xp = x;
-  size_t stride = number_spritesheet.width * number_spritesheet.height;
-  Sprite sprite = number_spritesheet;
-  for (size_t i = 0; i < num_digits; ++i) {
-    uint8_t digit = digits[num_digits - i - 1];
-    sprite.data = number_spritesheet.data + digit * stride;
-    buffer_sprite_draw(buffer, sprite, xp, y, color);
-    xp += sprite.width + 1;
+  AssetBlob blob;
+  asset_blob_init(&blob);
+  if (!asset_cache_build(&blob, sprites_path, stages_path, stamp)) {
+    asset_blob_free(&blob);
+    return false;
   }
-}
 
-bool sprite_overlap_check(const Sprite &sp_a, size_t x_a, size_t y_a,
-                          const Sprite &sp_b, size_t x_b, size_t y_b) {
-  // NOTE: For simplicity we just check for overlap of the sprite
-  // rectangles. Instead, if the rectangles overlap, we should
-  // further check if any pixel of sprite A overlap with any of
-  // sprite B.
-  if (x_a < x_b + sp_b.width && x_a + sp_a.width > x_b &&
-      y_a < y_b + sp_b.height && y_a + sp_a.height > y_b) {
+  printf("Assets: %s (rebuilt)\n", cache_path);
+  if (asset_cache_write(blob, cache_path) &&
+      asset_pack_map(pack, cache_path, stamp)) {
+    asset_blob_free(&blob);
     return true;
   }
 
-  return false;
+  // E.g. a read-only install: run from the freshly built copy instead
+  fprintf(stderr, "Could not write %s\n", cache_path);
+  pack->base = blob.data;
+  pack->size = blob.size;
+  pack->mapped = false;
+  return asset_pack_validate(pack, stamp);
 }
 
-void validate_shader(GLuint shader, const char *file = 0) {
-  static const unsigned int BUFFER_SIZE = 512;
-  char buffer[BUFFER_SIZE];
-  GLsizei length = 0;
+// Views of a sprite in the pack, which must have the frame count the game
+// draws it with. The bitmaps are read-only.
+const AssetSprite *asset_pack_sprite(const AssetPack &pack, const char *name,
+                                     size_t num_frames, Sprite *sprite,
+                                     CompiledSprite *compiled) {
+  for (size_t i = 0; i < pack.header->num_sprites; ++i) {
+    const AssetSprite &asset = pack.sprites[i];
+    if (strcmp(asset.name, name) != 0)
+      continue;
 
-  glGetShaderInfoLog(shader, BUFFER_SIZE, &length, buffer);
+    if (asset.num_frames != num_frames) {
+      fprintf(stderr, "Sprite %s needs %zu frames\n", name, num_frames);
+      return 0;
+    }
 
-  if (length > 0) {
-    printf("Shader %d(%s) compile error: %s\n", shader, (file ? file : ""),
-           buffer);
+    sprite->width = asset.width;
+    sprite->height = asset.height;
+    sprite->data = (uint8_t *)pack.base + asset.data_offset;
+    compiled->width = asset.width;
+    compiled->height = asset.height;
+    compiled->stride = asset.stride;
+    compiled->rows = (uint32_t *)(pack.base + asset.rows_offset);
+    return &asset;
   }
-}
-
-bool validate_program(GLuint program) {
-  static const GLsizei BUFFER_SIZE = 512;
-  GLchar buffer[BUFFER_SIZE];
-  GLsizei length = 0;
 
-  glGetProgramInfoLog(program, BUFFER_SIZE, &length, buffer);
+  fprintf(stderr, "Sprite %s not found\n", name);
+  return 0;
+}
 
-  if (length > 0) {
-    printf("Program %d link error: %s\n", program, buffer);
-    return false;
+// Stages are numbered from 1 in file order
+const AssetStage *asset_pack_stage(const AssetPack &pack, size_t number) {
+  if (number == 0 || number > pack.header->num_stages) {
+    fprintf(stderr, "Stage %zu not found, there are %u\n", number,
+            pack.header->num_stages);
+    return 0;
   }
-
-  return true;
+  return &pack.stages[number - 1];
 }
 
-uint32_t rgb_to_uint32(uint8_t r, uint8_t g, uint8_t b) {
-  return (r << 24) | (g << 16) | (b << 8) | 255;
+// Alien type of each cell, top row first
+const uint8_t *asset_pack_stage_cells(const AssetPack &pack,
+                                      const AssetStage &stage) {
+  return pack.base + stage.cells_offset;
 }
 
-void buffer_clear(Buffer *buffer, uint32_t color) {
-  for (size_t i = 0; i < buffer->width * buffer->height; ++i) {
-    buffer->data[i] = color;
+// Fills the atlas with the layout packed at build time; entries are in
+// sprite order, so AssetSprite::atlas_entry indexes it
+void asset_pack_atlas(const AssetPack &pack, SpriteAtlas *atlas) {
+  sprite_atlas_init(atlas);
+  for (size_t i = 0; i < pack.header->num_atlas_entries; ++i) {
+    const AssetAtlasEntry &source = pack.atlas_entries[i];
+    AtlasEntry &entry = atlas->entries[i];
+    entry.x = source.x;
+    entry.y = source.y;
+    entry.width = source.width;
+    entry.height = source.height;
+    entry.data = pack.base + source.data_offset;
   }
+  atlas->num_entries = pack.header->num_atlas_entries;
+  atlas->width = pack.header->atlas_width;
+  atlas->height = pack.header->atlas_height;
+  atlas->shelf_y = atlas->height; // later additions start a new shelf
 }
 
 //** Main */
+// Builds that reuse the game as a library, like bench/benchmark.cpp, define
+// GAME_NO_MAIN and bring their own
+#ifndef GAME_NO_MAIN
 int main(int argc, char const *argv[]) {
-  const size_t buffer_width = 224;
-  const size_t buffer_height = 256;
-
-  glfwSetErrorCallback(error_callback);
-
-  GLFWwindow *window;
+  Options options;
+  if (!options_parse(&options, argc, argv)) {
+    return -1;
+  }
 
-  if (!glfwInit()) {
+  if (!blit_kernels_init(options.blit_kernels)) {
+    fprintf(stderr, "Blit kernels \"%s\" not available.\n",
+            options.blit_kernels);
     return -1;
   }
 
-  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-  glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+  printf("Blit kernels: %s\n", blit_kernels.name);
 
-  //* Create a windowed-mode window and its OpenGL context */
-  window = glfwCreateWindow(buffer_width, buffer_height, "Title", NULL, NULL);
-  if (!window) {
-    glfwTerminate();
+  //* Assets */
+  AssetPack pack;
+  if (!asset_pack_load(&pack, options.assets))
     return -1;
-  }
 
-  glfwMakeContextCurrent(window);
-  glfwSetKeyCallback(window, key_callback);
+  // Views into the pack. Alien frames go two per type into alien_sprites.
+  Sprite alien_sprites[6], alien_death_sprite, player_sprite, bullet_sprite;
+  Sprite text_spritesheet;
+  CompiledSprite compiled_alien_sprites[6], compiled_alien_death_sprite;
+  CompiledSprite compiled_player_sprite, compiled_bullet_sprite;
+  CompiledSprite compiled_text_spritesheet;
+  Sprite shield_sprite, shield_hit_sprite;
+  CompiledSprite compiled_shield_sprite, compiled_shield_hit_sprite;
+  const char *alien_names[3] = {"alien1", "alien2", "alien3"};
+  const AssetSprite *alien_assets[3];
+  bool assets_found = true;
+  for (size_t i = 0; i < 3; ++i) {
+    alien_assets[i] =
+        asset_pack_sprite(pack, alien_names[i], 2, &alien_sprites[2 * i],
+                          &compiled_alien_sprites[2 * i]);
+    if (!alien_assets[i]) {
+      assets_found = false;
+      continue;
+    }
 
-  GLenum err = glewInit();
-  if (err != GLEW_OK) {
-    fprintf(stderr, "Error initializing GLEW.\n");
-    glfwTerminate();
+    alien_sprites[2 * i + 1] = sprite_frame(alien_sprites[2 * i], 1);
+    compiled_alien_sprites[2 * i + 1] =
+        compiled_sprite_frame(compiled_alien_sprites[2 * i], 1);
+  }
+  const AssetSprite *alien_death_asset =
+      asset_pack_sprite(pack, "alien_death", 1, &alien_death_sprite,
+                        &compiled_alien_death_sprite);
+  const AssetSprite *player_asset = asset_pack_sprite(
+      pack, "player", 1, &player_sprite, &compiled_player_sprite);
+  const AssetSprite *bullet_asset = asset_pack_sprite(
+      pack, "bullet", 1, &bullet_sprite, &compiled_bullet_sprite);
+  const AssetSprite *font_asset = asset_pack_sprite(
+      pack, "font", 65, &text_spritesheet, &compiled_text_spritesheet);
+  const AssetSprite *shield_asset = asset_pack_sprite(
+      pack, "shield", 1, &shield_sprite, &compiled_shield_sprite);
+  const AssetSprite *shield_hit_asset = asset_pack_sprite(
+      pack, "shield_hit", 1, &shield_hit_sprite, &compiled_shield_hit_sprite);
+  if (shield_asset && (compiled_shield_sprite.stride != 1 ||
+                       shield_sprite.height > SHIELD_MAX_HEIGHT)) {
+    fprintf(stderr, "Sprite shield must fit in 32x%d\n", SHIELD_MAX_HEIGHT);
+    shield_asset = 0;
+  }
+  // The collision grid is laid out for aliens of at most a cell, and each
+  // alien is centered on its death sprite
+  for (size_t i = 0; assets_found && i < 6; ++i) {
+    if (alien_sprites[i].width > GAME_GRID_CELL_SIZE ||
+        alien_sprites[i].height > GAME_GRID_CELL_SIZE) {
+      fprintf(stderr, "Sprite %s must fit in %dx%d\n", alien_names[i / 2],
+              GAME_GRID_CELL_SIZE, GAME_GRID_CELL_SIZE);
+      assets_found = false;
+    } else if (alien_death_asset &&
+               alien_death_sprite.width < alien_sprites[i].width) {
+      fprintf(stderr, "Sprite alien_death must be as wide as %s\n",
+              alien_names[i / 2]);
+      alien_death_asset = 0;
+    }
+  }
+  // Text runs take a single word of each glyph row
+  if (font_asset && compiled_text_spritesheet.stride != 1) {
+    fprintf(stderr, "Sprite font must be at most 32 wide\n");
+    font_asset = 0;
+  }
+  const AssetStage *stage = asset_pack_stage(pack, options.stage);
+  // shield_store_init spreads the shields over the gaps left between them
+  if (stage && shield_asset &&
+      stage->shields * shield_sprite.width > options.width) {
+    fprintf(stderr, "Stage %s has more shields than fit %zu pixels\n",
+            stage->name, options.width);
+    stage = 0;
+  }
+  if (!assets_found || !alien_death_asset || !player_asset ||
+      !bullet_asset || !font_asset || !shield_asset || !shield_hit_asset ||
+      !stage) {
+    asset_pack_close(&pack);
     return -1;
   }
 
-  // Call OpenGL
-  int glVersion[2] = {-1, 1};
-  glGetIntegerv(GL_MAJOR_VERSION, &glVersion[0]);
-  glGetIntegerv(GL_MAJOR_VERSION, &glVersion[1]);
-
-  printf("Using OpenGL: %d.%d\n", glVersion[0], glVersion[1]);
-  printf("Renderer used: %s\n", glGetString(GL_RENDERER));
-  printf("Shading Language: %s\n", glGetString(GL_SHADING_LANGUAGE_VERSION));
+  Sprite number_spritesheet = sprite_frame(text_spritesheet, 16);
+  CompiledSprite compiled_number_spritesheet =
+      compiled_sprite_frame(compiled_text_spritesheet, 16);
 
-  glClearColor(1.0, 0.0, 0.0, 1.0);
+  //* Memory */
+  // What lives as long as the run comes from arena and what lives as long
+  // as a stage from stage_arena, each a single block freed in one go.
+  // Per-frame temporaries take the top of stage_arena, which goes back to
+  // a mark at the start of every frame. Budgets cover the buffer, dirty
+  // tiles, GPU renderer, atlas texels and frame scratch at the chosen
+  // resolution; the slack covers the small tables.
+  size_t num_pixels = options.width * options.height;
+  size_t num_tiles = ((options.width + DIRTY_TILE_SIZE - 1) / DIRTY_TILE_SIZE) *
+                     ((options.height + DIRTY_TILE_SIZE - 1) / DIRTY_TILE_SIZE);
+  Arena arena, stage_arena;
+  arena_init(&arena, "game",
+             num_pixels * sizeof(uint32_t) +
+                 DIRTY_REGION_MAX_HISTORY * num_tiles +
+                 sizeof(SpriteRenderer) + sizeof(RenderList) + ARENA_SLACK);
+  size_t frame_scratch_size =
+      DISPLAY_MAX_DIRTY_RECTS * sizeof(DirtyRect) +
+      render_list_sort_scratch_size();
+  arena_init(&stage_arena, "stage",
+             3 * sizeof(GameSnapshot) +
+                 pack.header->atlas_width * pack.header->atlas_height +
+                 frame_scratch_size + ARENA_SLACK);
 
   //* Graphics buffer */
   Buffer buffer;
-  buffer.width = buffer_width;
-  buffer.height = buffer_height;
-  buffer.data = new uint32_t[buffer.width * buffer.height];
-
-  buffer_clear(&buffer, 0);
-
-  //* Texture for presenting buffer to OpenGL */
-  GLuint buffer_texture;
-  glGenTextures(1, &buffer_texture);
-  // specify image format and standard parameters
-  glBindTexture(GL_TEXTURE_2D, buffer_texture);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, buffer.width, buffer.height, 0,
-               GL_RGBA, GL_UNSIGNED_INT_8_8_8_8, buffer.data);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-
-  // vertex array object (VAO) for generating fullscreen triangle
-  GLuint fullscreen_triangle_vao;
-  glGenVertexArrays(1, &fullscreen_triangle_vao);
-  // glBindVertexArray(fullscreen_triangle_vao);
-
-  // Shaders for displaying buffers
-  const char *fragment_shader =
-      "\n"
-      "#version 330\n"
-      "\n"
-      "uniform sampler2D buffer;\n"
-      "noperspective in vec2 TexCoord;\n"
-      "\n"
-      "out vec3 outColor;\n"
-      "\n"
-      "void main(void){\n"
-      "    outColor = texture(buffer, TexCoord).rgb;\n"
-      "}\n";
-
-  const char *vertex_shader =
-      "\n"
-      "#version 330\n"
-      "\n"
-      "noperspective out vec2 TexCoord;\n"
-      "\n"
-      "void main(void){\n"
-      "\n"
-      "    TexCoord.x = (gl_VertexID == 2)? 2.0: 0.0;\n"
-      "    TexCoord.y = (gl_VertexID == 1)? 2.0: 0.0;\n"
-      "    \n"
-      "    gl_Position = vec4(2.0 * TexCoord - 1.0, 0.0, 1.0);\n"
-      "}\n";
-
-  // Compile 2 shaders into code the GPU can understand and linked into a shader
-  // program
-  GLuint shader_id = glCreateProgram();
-  // Create vertex shader
-  {
-    GLuint shader_vp = glCreateShader(GL_VERTEX_SHADER);
-
-    glShaderSource(shader_vp, 1, &vertex_shader, 0);
-    glCompileShader(shader_vp);
-    validate_shader(shader_vp, vertex_shader);
-    glAttachShader(shader_id, shader_vp);
-
-    glDeleteShader(shader_vp);
+  buffer.width = options.width;
+  buffer.height = options.height;
+  // Client memory; with persistent PBOs frames are drawn into mapped upload
+  // memory instead
+  if (options.indexed) {
+    buffer.data = 0;
+    buffer.indices = arena_push<uint8_t>(&arena, num_pixels);
+  } else {
+    buffer.data = arena_push<uint32_t>(&arena, num_pixels);
+    buffer.indices = 0;
   }
-  // Create fragment shader
-  {
-    GLuint shader_fp = glCreateShader(GL_FRAGMENT_SHADER);
-
-    glShaderSource(shader_fp, 1, &fragment_shader, 0);
-    glCompileShader(shader_fp);
-    validate_shader(shader_fp, fragment_shader);
-    glAttachShader(shader_id, shader_fp);
+  buffer.dirty = 0;
+  buffer.raster = 0;
 
-    glDeleteShader(shader_fp);
+  // Everything is drawn with these. Indexed buffers store the index and the
+  // display shader looks the color up, which quarters the bytes drawn and
+  // uploaded every frame.
+  enum { COLOR_BLACK, COLOR_RED, COLOR_GREEN, COLOR_GRAY, NUM_COLORS };
+  const uint32_t palette[NUM_COLORS] = {
+      rgb_to_uint32(0, 0, 0), rgb_to_uint32(128, 0, 0),
+      rgb_to_uint32(0, 128, 0), rgb_to_uint32(128, 128, 128)};
+  uint32_t colors[NUM_COLORS]; // in the buffer's format
+  for (size_t i = 0; i < NUM_COLORS; ++i) {
+    colors[i] = options.indexed ? i : palette[i];
   }
 
-  glLinkProgram(shader_id);
+  buffer_clear(&buffer, colors[COLOR_BLACK]);
 
-  if (!validate_program(shader_id)) {
-    fprintf(stderr, "Error while validating shader.\n");
-    glfwTerminate();
-    glDeleteVertexArrays(1, &fullscreen_triangle_vao);
-    delete[] buffer.data;
+  Display display;
+  if (options.headless) {
+    // Nothing is presented; drawing always goes to client memory
+    display.pixel_stream.mode = UPLOAD_DIRECT;
+    display.pixel_stream.num_slots = 0;
+  } else if (!display_init(&display, options, buffer)) {
+    arena_free(&stage_arena);
+    arena_free(&arena);
+    asset_pack_close(&pack);
     return -1;
+  } else {
+    display_set_palette(&display, palette, NUM_COLORS);
   }
 
-  glUseProgram(shader_id);
-
-  GLint location = glGetUniformLocation(shader_id, "buffer");
-  glUniform1i(location, 0);
-
-  // OpenGL setup for Buffer Display
-  glDisable(GL_DEPTH_TEST);
-  glBindVertexArray(fullscreen_triangle_vao);
+  DirtyRegion dirty_region;
+  if (options.dirty_rects) {
+    // Persistent slots come back around after a full ring, so the region
+    // has to remember that many frames
+    dirty_region_init(&dirty_region, &arena, buffer.width, buffer.height,
+                      pixel_stream_buffer_age(display.pixel_stream) + 1);
+    buffer.dirty = &dirty_region;
+  }
 
   //* Game *//
 
-  // Sprite bitmap
-  Sprite alien_sprite;
-  alien_sprite.width = 11;
-  alien_sprite.height = 8;
-  alien_sprite.data = new uint8_t[11 * 8]{
-      0, 0, 1, 0, 0, 0, 0, 0, 1, 0, 0, // ..@.....@..
-      0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, // ...@...@...
-      0, 0, 1, 1, 1, 1, 1, 1, 1, 0, 0, // ..@@@@@@@..
-      0, 1, 1, 0, 1, 1, 1, 0, 1, 1, 0, // .@@.@@@.@@.
-      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // @@@@@@@@@@@
-      1, 0, 1, 1, 1, 1, 1, 1, 1, 0, 1, // @.@@@@@@@.@
-      1, 0, 1, 0, 0, 0, 0, 0, 1, 0, 1, // @.@.....@.@
-      0, 0, 0, 1, 1, 0, 1, 1, 0, 0, 0  // ...@@.@@...
-  };
-
-  Sprite alien_sprite_alt; // alternate bitmap for animation
-  alien_sprite_alt.width = 11;
-  alien_sprite_alt.height = 8;
-  alien_sprite_alt.data = new uint8_t[88]{
-      0, 0, 1, 0, 0, 0, 0, 0, 1, 0, 0, // ..@.....@..
-      1, 0, 0, 1, 0, 0, 0, 1, 0, 0, 1, // @..@...@..@
-      1, 0, 1, 1, 1, 1, 1, 1, 1, 0, 1, // @.@@@@@@@.@
-      1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1, // @@@.@@@.@@@
-      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // @@@@@@@@@@@
-      0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, // .@@@@@@@@@.
-      0, 0, 1, 0, 0, 0, 0, 0, 1, 0, 0, // ..@.....@..
-      0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0  // .@.......@.
-  };
-
-  // Player bitmap
-  Sprite player_sprite;
-  player_sprite.width = 11;
-  player_sprite.height = 7;
-  player_sprite.data = new uint8_t[11 * 7]{
-      0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, // .....@.....
-      0, 0, 0, 0, 1, 1, 1, 0, 0, 0, 0, // ....@@@....
-      0, 0, 0, 0, 1, 1, 1, 0, 0, 0, 0, // ....@@@....
-      0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, // .@@@@@@@@@.
-      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // @@@@@@@@@@@
-      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // @@@@@@@@@@@
-      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // @@@@@@@@@@@
-  };
-
-  // Bullet bitmap
-  Sprite bullet_sprite;
-  bullet_sprite.width = 1;
-  bullet_sprite.height = 3;
-  bullet_sprite.data = new uint8_t[3]{
-      1, // @
-      1, // @
-      1  // @
-  };
-
-  // Alien types
-  Sprite alien_sprites[6];
-
-  alien_sprites[0].width = 8;
-  alien_sprites[0].height = 8;
-  alien_sprites[0].data = new uint8_t[64]{
-      0, 0, 0, 1, 1, 0, 0, 0, // ...@@...
-      0, 0, 1, 1, 1, 1, 0, 0, // ..@@@@..
-      0, 1, 1, 1, 1, 1, 1, 0, // .@@@@@@.
-      1, 1, 0, 1, 1, 0, 1, 1, // @@.@@.@@
-      1, 1, 1, 1, 1, 1, 1, 1, // @@@@@@@@
-      0, 1, 0, 1, 1, 0, 1, 0, // .@.@@.@.
-      1, 0, 0, 0, 0, 0, 0, 1, // @......@
-      0, 1, 0, 0, 0, 0, 1, 0  // .@....@.
-  };
-
-  alien_sprites[1].width = 8;
-  alien_sprites[1].height = 8;
-  alien_sprites[1].data = new uint8_t[64]{
-      0, 0, 0, 1, 1, 0, 0, 0, // ...@@...
-      0, 0, 1, 1, 1, 1, 0, 0, // ..@@@@..
-      0, 1, 1, 1, 1, 1, 1, 0, // .@@@@@@.
-      1, 1, 0, 1, 1, 0, 1, 1, // @@.@@.@@
-      1, 1, 1, 1, 1, 1, 1, 1, // @@@@@@@@
-      0, 0, 1, 0, 0, 1, 0, 0, // ..@..@..
-      0, 1, 0, 1, 1, 0, 1, 0, // .@.@@.@.
-      1, 0, 1, 0, 0, 1, 0, 1  // @.@..@.@
-  };
-
-  alien_sprites[2].width = 11;
-  alien_sprites[2].height = 8;
-  alien_sprites[2].data = new uint8_t[88]{
-      0, 0, 1, 0, 0, 0, 0, 0, 1, 0, 0, // ..@.....@..
-      0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, // ...@...@...
-      0, 0, 1, 1, 1, 1, 1, 1, 1, 0, 0, // ..@@@@@@@..
-      0, 1, 1, 0, 1, 1, 1, 0, 1, 1, 0, // .@@.@@@.@@.
-      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // @@@@@@@@@@@
-      1, 0, 1, 1, 1, 1, 1, 1, 1, 0, 1, // @.@@@@@@@.@
-      1, 0, 1, 0, 0, 0, 0, 0, 1, 0, 1, // @.@.....@.@
-      0, 0, 0, 1, 1, 0, 1, 1, 0, 0, 0  // ...@@.@@...
-  };
-
-  alien_sprites[3].width = 11;
-  alien_sprites[3].height = 8;
-  alien_sprites[3].data = new uint8_t[88]{
-      0, 0, 1, 0, 0, 0, 0, 0, 1, 0, 0, // ..@.....@..
-      1, 0, 0, 1, 0, 0, 0, 1, 0, 0, 1, // @..@...@..@
-      1, 0, 1, 1, 1, 1, 1, 1, 1, 0, 1, // @.@@@@@@@.@
-      1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1, // @@@.@@@.@@@
-      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // @@@@@@@@@@@
-      0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, // .@@@@@@@@@.
-      0, 0, 1, 0, 0, 0, 0, 0, 1, 0, 0, // ..@.....@..
-      0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0  // .@.......@.
-  };
-
-  alien_sprites[4].width = 12;
-  alien_sprites[4].height = 8;
-  alien_sprites[4].data = new uint8_t[96]{
-      0, 0, 0, 0, 1, 1, 1, 1, 0, 0, 0, 0, // ....@@@@....
-      0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, // .@@@@@@@@@@.
-      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // @@@@@@@@@@@@
-      1, 1, 1, 0, 0, 1, 1, 0, 0, 1, 1, 1, // @@@..@@..@@@
-      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // @@@@@@@@@@@@
-      0, 0, 0, 1, 1, 0, 0, 1, 1, 0, 0, 0, // ...@@..@@...
-      0, 0, 1, 1, 0, 1, 1, 0, 1, 1, 0, 0, // ..@@.@@.@@..
-      1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1  // @@........@@
-  };
-
-  alien_sprites[5].width = 12;
-  alien_sprites[5].height = 8;
-  alien_sprites[5].data = new uint8_t[96]{
-      0, 0, 0, 0, 1, 1, 1, 1, 0, 0, 0, 0, // ....@@@@....
-      0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, // .@@@@@@@@@@.
-      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // @@@@@@@@@@@@
-      1, 1, 1, 0, 0, 1, 1, 0, 0, 1, 1, 1, // @@@..@@..@@@
-      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // @@@@@@@@@@@@
-      0, 0, 1, 1, 1, 0, 0, 1, 1, 1, 0, 0, // ..@@@..@@@..
-      0, 1, 1, 0, 0, 1, 1, 0, 0, 1, 1, 0, // .@@..@@..@@.
-      0, 0, 1, 1, 0, 0, 0, 0, 1, 1, 0, 0  // ..@@....@@..
-  };
-
-  Sprite alien_death_sprite;
-  alien_death_sprite.width = 13;
-  alien_death_sprite.height = 7;
-  alien_death_sprite.data = new uint8_t[91]{
-      0, 1, 0, 0, 1, 0, 0, 0, 1, 0, 0, 1, 0, // .@..@...@..@.
-      0, 0, 1, 0, 0, 1, 0, 1, 0, 0, 1, 0, 0, // ..@..@.@..@..
-      0, 0, 0, 1, 0, 0, 0, 0, 0, 1, 0, 0, 0, // ...@.....@...
-      1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, // @@.........@@
-      0, 0, 0, 1, 0, 0, 0, 0, 0, 1, 0, 0, 0, // ...@.....@...
-      0, 0, 1, 0, 0, 1, 0, 1, 0, 0, 1, 0, 0, // ..@..@.@..@..
-      0, 1, 0, 0, 1, 0, 0, 0, 1, 0, 0, 1, 0  // .@..@...@..@.
-  };
+  // HUD strings never change and the score only on a hit
+  TextRun score_label, score_digits, title;
+  text_run_init(&score_label, &arena);
+  text_run_init(&score_digits, &arena);
+  text_run_init(&title, &arena);
+  text_run_set_text(&score_label, compiled_text_spritesheet, "SCORE");
+  text_run_set_text(&title, compiled_text_spritesheet, "SPACE INVADERS");
 
-  Sprite text_spritesheet;
-  text_spritesheet.width = 5;
-  text_spritesheet.height = 7;
-  text_spritesheet.data = new uint8_t[65 * 35]{
-      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0,
-      0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 1, 0,
-      0, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-      0, 0, 0, 0, 0, 0, 1, 0, 1, 0, 0, 1, 0, 1, 0, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0,
-      1, 1, 1, 1, 1, 0, 1, 0, 1, 0, 0, 1, 0, 1, 0, 0, 0, 1, 0, 0, 0, 1, 1, 1, 0,
-      1, 0, 1, 0, 0, 0, 1, 1, 1, 0, 0, 0, 1, 0, 1, 0, 1, 1, 1, 0, 0, 0, 1, 0, 0,
-      1, 1, 0, 1, 0, 1, 1, 0, 1, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0,
-      0, 1, 0, 1, 1, 0, 1, 0, 1, 1, 0, 1, 1, 0, 0, 1, 0, 0, 1, 0, 1, 0, 0, 1, 0,
-      0, 1, 1, 0, 0, 1, 0, 0, 1, 0, 1, 0, 0, 0, 1, 0, 1, 1, 1, 1, 0, 0, 0, 1, 0,
-      0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-      0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0,
-      0, 0, 1, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 1, 0, 0, 0,
-      0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 0,
-      0, 0, 1, 0, 0, 1, 0, 1, 0, 1, 0, 1, 1, 1, 0, 0, 0, 1, 0, 0, 0, 1, 1, 1, 0,
-      1, 0, 1, 0, 1, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0,
-      1, 1, 1, 1, 1, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0,
-      0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1,
-      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0,
-      0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0,
-      0, 1, 0, 0, 0, 0, 1, 0, 0, 0,
-
-      0, 1, 1, 1, 0, 1, 0, 0, 0, 1, 1, 0, 0, 1, 1, 1, 0, 1, 0, 1, 1, 1, 0, 0, 1,
-      1, 0, 0, 0, 1, 0, 1, 1, 1, 0, 0, 0, 1, 0, 0, 0, 1, 1, 0, 0, 0, 0, 1, 0, 0,
-      0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 1, 1, 1, 0, 0, 1, 1, 1, 0,
-      1, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 0,
-      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 1, 1, 0,
-      0, 0, 0, 0, 1, 1, 0, 0, 0, 1, 0, 1, 1, 1, 0, 0, 0, 0, 1, 0, 0, 0, 1, 1, 0,
-      0, 1, 0, 1, 0, 1, 0, 0, 1, 0, 1, 1, 1, 1, 1, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0,
-      1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1,
-      1, 0, 0, 0, 1, 0, 1, 1, 1, 0, 0, 1, 1, 1, 0, 1, 0, 0, 0, 1, 1, 0, 0, 0, 0,
-      1, 1, 1, 1, 0, 1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 0, 1, 1, 1, 0, 1, 1, 1, 1, 1,
-      0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0,
-      0, 1, 0, 0, 0, 0, 1, 1, 1, 0, 1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 0, 1, 1, 1, 0,
-      1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 0, 1, 1, 1, 0, 0, 1, 1, 1, 0, 1, 0, 0, 0, 1,
-      1, 0, 0, 0, 1, 0, 1, 1, 1, 1, 0, 0, 0, 0, 1, 1, 0, 0, 0, 1, 0, 1, 1, 1, 0,
-
-      0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-      0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0,
-      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 1,
-      0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 1, 0,
-      0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
-      1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 1, 0, 0, 0,
-      0, 0, 1, 0, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 0,
-      0, 1, 1, 1, 0, 1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0,
-      0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 1, 1, 1, 0, 1, 0, 0, 0, 1, 1, 0, 1, 0, 1,
-      1, 1, 0, 1, 1, 1, 0, 1, 0, 0, 1, 0, 0, 0, 1, 0, 1, 1, 1, 0,
-
-      0, 0, 1, 0, 0, 0, 1, 0, 1, 0, 1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 1, 1, 1, 1, 1,
-      1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 1, 1, 1, 1, 0, 1, 0, 0, 0, 1, 1, 0, 0, 0, 1,
-      1, 1, 1, 1, 0, 1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 1, 0,
-      1, 0, 0, 0, 1, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 1,
-      0, 1, 1, 1, 0, 1, 1, 1, 1, 0, 1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 1, 0, 0, 0, 1,
-      1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0,
-      1, 0, 0, 0, 0, 1, 1, 1, 1, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 1, 1, 1, 1,
-      1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 1, 1, 1, 0, 1, 0, 0, 0, 0,
-      1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 1, 1, 1, 0, 1, 0, 0, 0, 1, 1, 0, 0, 0, 0,
-      1, 0, 1, 1, 1, 1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 0, 1, 1, 1, 0, 1, 0, 0, 0, 1,
-      1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1, 0, 0, 0, 1,
-      1, 0, 0, 0, 1, 0, 1, 1, 1, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0,
-      0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 1, 1, 1, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1,
-      0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 1, 0, 0, 0, 1, 0, 1, 1, 1, 0,
-      1, 0, 0, 0, 1, 1, 0, 0, 1, 0, 1, 0, 1, 0, 0, 1, 1, 0, 0, 0, 1, 0, 1, 0, 0,
-      1, 0, 0, 1, 0, 1, 0, 0, 0, 1, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0,
-      1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1,
-      1, 1, 0, 1, 1, 1, 0, 1, 0, 1, 1, 0, 1, 0, 1, 1, 0, 0, 0, 1, 1, 0, 0, 0, 1,
-      1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 1, 1, 0, 0, 1, 1, 0, 1, 0, 1,
-      1, 0, 0, 1, 1, 1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 0, 1, 1, 1, 0, 1, 0, 0, 0, 1,
-      1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 0, 1, 1, 1, 0,
-      1, 1, 1, 1, 0, 1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 1, 1, 1, 1, 0, 1, 0, 0, 0, 0,
-      1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 1, 1, 1, 0, 1, 0, 0, 0, 1, 1, 0, 0, 0, 1,
-      1, 0, 0, 0, 1, 1, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1, 1, 0,
-      1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0, 0, 1, 0, 0, 1, 0,
-      1, 0, 0, 0, 1, 0, 1, 1, 1, 0, 1, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 0,
-      1, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 1, 1, 1, 0, 1, 1, 1, 1, 1, 0, 0, 1, 0, 0,
-      0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0,
-      1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 1, 0, 0, 0, 1,
-      1, 0, 0, 0, 1, 0, 1, 1, 1, 0, 1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 1, 0, 0, 0, 1,
-      1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 0, 1, 0, 1, 0, 0, 0, 1, 0, 0, 1, 0, 0, 0, 1,
-      1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 1, 0, 1, 0, 1, 1, 0, 1, 0, 1, 1, 1, 0, 1, 1,
-      1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 0, 1, 0, 1, 0, 0, 0, 1, 0, 0,
-      0, 1, 0, 1, 0, 1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 1, 0, 0, 0, 1,
-      0, 1, 0, 1, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0,
-      1, 1, 1, 1, 1, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0,
-      1, 0, 0, 0, 0, 1, 1, 1, 1, 1,
-
-      0, 0, 0, 1, 1, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0,
-      0, 0, 1, 0, 0, 0, 0, 0, 1, 1, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 1, 0, 0,
-      0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 1, 1, 0, 0, 0,
-      0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0,
-      1, 1, 0, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 1, 0, 1, 0, 0, 0, 1, 0, 0, 0, 0, 0,
-      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1,
-      0, 0, 1, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-      0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-
-  Sprite number_spritesheet = text_spritesheet;
-  number_spritesheet.data += 16 * 35;
-
-  // Init Game
-  Game game;
+  // Init Game. The first snapshot is the simulation's working state, the
+  // other two are published to the render side when pipelined.
+  GameSnapshot *snapshots = arena_push<GameSnapshot>(&stage_arena, 3);
+  Game &game = snapshots[0].game;
 
   game.width = buffer.width;
   game.height = buffer.height;
-  game.num_aliens = 60;
-  game.num_bullets = 0;
-  game.aliens = new Alien[game.num_aliens];
+  game.aliens.count = 0;
+  game.aliens.num_live = 0;
+  game.aliens.num_dying = 0;
+  game.bullets.count = 0;
+  game.bullets.num_kills = 0;
+  game.collision_mode = options.collision_mode;
 
   game.player.x = buffer.width / 2;
   game.player.y = 32;
   game.player.life = 3;
 
-  // Position the aliens
-  // TODO: customize this for multiple stages
-  for (size_t yi = 0; yi < 5; ++yi) {
-    for (size_t xi = 0; xi < 12; ++xi) {
-      Alien &alien = game.aliens[yi * 12 + xi];
-      alien.type = (5 - yi) / 2 + 1;
+  // Shields stand a little above the player
+  shield_store_init(&game.shields, compiled_shield_sprite, stage->shields,
+                    game.width, game.player.y + 16);
 
-      const Sprite &sprite = alien_sprites[2 * (alien.type - 1)];
+  // Position the aliens of the stage's formation, bottom row first,
+  // centered and as far from the top as on the smallest stage
+  size_t formation_x = (game.width - GAME_MIN_WIDTH) / 2;
+  size_t formation_y = game.height - GAME_MIN_HEIGHT;
+  const uint8_t *cells = asset_pack_stage_cells(pack, *stage);
+  // Every alien has to start on the playfield, which also keeps positions
+  // in int16_t range
+  bool stage_fits =
+      formation_init(&game.formation, stage->columns, stage->rows);
+  for (size_t yi = 0; yi < stage->rows && stage_fits; ++yi) {
+    for (size_t xi = 0; xi < stage->columns; ++xi) {
+      uint8_t type = cells[(stage->rows - 1 - yi) * stage->columns + xi];
+      if (!type)
+        continue;
+
+      const Sprite &sprite = alien_sprites[2 * (type - 1)];
+
+      size_t x = formation_x + stage->spacing_x * xi + stage->origin_x +
+                 (alien_death_sprite.width - sprite.width) / 2;
+      size_t y = formation_y + stage->spacing_y * yi + stage->origin_y;
+      if (x + sprite.width > game.width ||
+          y + sprite.height > game.height) {
+        stage_fits = false;
+        break;
+      }
 
-      alien.x = 16 * xi + 20 + (alien_death_sprite.width - sprite.width) / 2;
-      alien.y = 17 * yi + 128;
+      ptrdiff_t ai = alien_store_add(&game.aliens, x, y, type);
+      if (ai >= 0)
+        formation_add(&game.formation, ai, xi, yi);
     }
   }
+  if (!stage_fits) {
+    fprintf(stderr,
+            "Stage %s has more than %d cells or does not fit a %zux%zu "
+            "playfield\n",
+            stage->name, GAME_MAX_ALIENS, game.width, game.height);
+    if (!options.headless)
+      display_free(&display);
+    arena_free(&stage_arena);
+    arena_free(&arena);
+    asset_pack_close(&pack);
+    return -1;
+  }
 
   //* Animation */
   SpriteAnimation alien_animation[3];
@@ -630,193 +5890,389 @@ int main(int argc, char const *argv[]) {
     alien_animation[i].loop = true;
     alien_animation[i].num_frames = 2;
     alien_animation[i].frame_duration = 10;
-    alien_animation[i].time = 0;
-
-    alien_animation[i].frames = new Sprite *[2];
-    alien_animation[i].frames[0] = &alien_sprites[2 * i];
-    alien_animation[i].frames[1] = &alien_sprites[2 * i + 1];
+    for (size_t frame = 0; frame < 2; ++frame) {
+      alien_animation[i].frames[frame] = &alien_sprites[2 * i + frame];
+      alien_animation[i].compiled_frames[frame] =
+          &compiled_alien_sprites[2 * i + frame];
+    }
   }
+  animation_clock_init(&game.animation, alien_animation, 3);
 
-  // V-sync mode on
-  // https://www.glfw.org/docs/latest/group__context.html#ga6d4e0cdf151b5e579bd67f13202994ed
-  glfwSwapInterval(1);
 
-  uint32_t clear_color = rgb_to_uint32(0, 0, 0);
+  GameAssets assets;
+  assets.player_sprite = &player_sprite;
+  assets.compiled_player_sprite = &compiled_player_sprite;
+  assets.bullet_sprite = &bullet_sprite;
+  assets.alien_death_sprite = &alien_death_sprite;
+  assets.compiled_bullet_sprite = &compiled_bullet_sprite;
+  assets.compiled_shield_hit = &compiled_shield_hit_sprite;
+  assets.alien_animation = alien_animation;
+
+  collision_grid_build(&game.alien_grid, game, assets);
+  formation_measure(&game.formation, game.aliens, assets);
+
+  if (options.batch) {
+    batch_benchmark(options, snapshots[0], &assets);
+    arena_free(&stage_arena);
+    arena_free(&arena);
+    asset_pack_close(&pack);
+    return 0;
+  }
+
+  // The GPU renderer draws from the atlas packed into the asset cache
+  SpriteAtlas atlas;
+  SpriteRenderer *sprite_renderer = 0;
+  if (options.renderer == RENDERER_GPU) {
+    asset_pack_atlas(pack, &atlas);
+    sprite_renderer = arena_push<SpriteRenderer>(&arena);
+    if (!sprite_renderer_init(sprite_renderer, atlas, buffer.width,
+                              buffer.height, &stage_arena,
+                              &display.programs)) {
+      fprintf(stderr, "Error creating the GPU renderer, using software.\n");
+      sprite_renderer = 0;
+    }
+  }
+  printf("Renderer: %s\n", sprite_renderer ? "gpu" : "software");
+  if (!options.headless) {
+    const ProgramCache &programs = display.programs;
+    printf("Shader programs: %zu cached, %zu compiled in %.1f ms%s\n",
+           programs.hits, programs.misses, programs.seconds * 1e3,
+           programs.enabled ? "" : " (no program binaries)");
+  }
 
-  int player_move_dir = 1;
+  // Holds threads, so it lives outside the arenas
+  Rasterizer *rasterizer = 0;
+  size_t raster_threads = options.raster_threads;
+  if (raster_threads == 0) {
+    raster_threads = std::min((size_t)std::thread::hardware_concurrency(),
+                              (size_t)RASTER_MAX_THREADS);
+  }
+  if (!sprite_renderer && raster_threads > 1) {
+    rasterizer = new Rasterizer;
+    rasterizer_init(rasterizer, buffer, raster_threads);
+    printf("Raster threads: %zu (%zu bands)\n", raster_threads,
+           rasterizer->num_bands);
+  }
+  buffer.raster = rasterizer;
 
-  // Death
-  uint8_t *death_counters = new uint8_t[game.num_aliens];
-  for (size_t i = 0; i < game.num_aliens; i++) {
-    death_counters[i] = 10;
+  // Every frame is drawn through the render list. Alien frames get
+  // consecutive handles, so a frame's handle is its type's plus the frame.
+  RenderList *render_list = arena_push<RenderList>(&arena);
+  render_list->num_sprites = 0;
+  size_t alien_handles[3];
+  for (size_t i = 0; i < 3; ++i) {
+    alien_handles[i] = render_list_add_sprite(
+        render_list, compiled_alien_sprites[2 * i],
+        alien_assets[i]->atlas_entry);
+    render_list_add_sprite(render_list, compiled_alien_sprites[2 * i + 1],
+                           alien_assets[i]->atlas_entry + 1);
   }
+  size_t alien_death_handle =
+      render_list_add_sprite(render_list, compiled_alien_death_sprite,
+                             alien_death_asset->atlas_entry);
+  size_t bullet_handle = render_list_add_sprite(
+      render_list, compiled_bullet_sprite, bullet_asset->atlas_entry);
+  size_t player_handle = render_list_add_sprite(
+      render_list, compiled_player_sprite, player_asset->atlas_entry);
 
   //* START GAME! */
-  size_t score = 0;
+  game.score = 0;
   game_running = true;
 
-  while (!glfwWindowShouldClose(window) && game_running) {
-    buffer_clear(&buffer, clear_color);
+  // Simulation runs in fixed ticks, independent of the render rate
+  const double tick_duration = 1.0 / options.tick_rate;
+  Profiler profiler;
+  profiler_init(&profiler, options.profile, !options.headless);
 
-    // Draw score
-    buffer_draw_text(&buffer, text_spritesheet, "SCORE", 4,
-                     game.height - text_spritesheet.height - 7,
-                     rgb_to_uint32(128, 0, 0));
+  InputScript replay, record;
+  input_script_init(&replay);
+  input_script_init(&record);
+  if (options.replay && !input_script_load(&replay, options.replay)) {
+    fprintf(stderr, "Could not load input script %s\n", options.replay);
+    input_script_free(&replay);
+    options.replay = 0;
+  }
 
-    buffer_draw_number(&buffer, number_spritesheet, score,
-                       4 + 2 * number_spritesheet.width,
-                       game.height - 2 * number_spritesheet.height - 12,
-                       rgb_to_uint32(128, 0, 0));
+  Simulation simulation;
+  simulation_init(&simulation, &snapshots[0], &assets,
+                  options.replay ? &replay : 0,
+                  options.record ? &record : 0);
+  snapshots[0].previous_player_x = game.player.x;
+  if (options.seek > 0) {
+    double seek_start = profiler_now();
+    simulation_fast_forward(&simulation, options.seek);
+    printf("Seeked to tick %zu in %.1f ms\n", snapshots[0].tick,
+           (profiler_now() - seek_start) * 1e3);
+  }
 
-    buffer_draw_text(&buffer, text_spritesheet, "SPACE INVADERS", 164, 7,
-                     rgb_to_uint32(128, 0, 0));
+  double previous_time = options.headless ? 0.0 : glfwGetTime();
+  double tick_accumulator = 0.0;
+  size_t frame = 0;
+  size_t inputs_shown = 0; // input actions already on screen
+  double run_start = profiler_now();
+  // Headless runs keep one tick per frame on this thread
+  if (options.sim_thread && !options.headless) {
+    simulation_start(&simulation, &snapshots[1], tick_duration,
+                     previous_time);
+  }
+  printf("Simulation: %s\n",
+         simulation.pipelined ? "own thread" : "render thread");
 
-    for (size_t i = 0; i < game.width; ++i) {
-      buffer.data[game.width * 16 + i] = rgb_to_uint32(128, 0, 0);
-    }
+  size_t frame_mark = stage_arena.used;
+  while (game_running &&
+         (options.headless || !glfwWindowShouldClose(display.window))) {
+    if (options.frames && frame == options.frames)
+      break;
+    ++frame;
+    arena_reset(&stage_arena, frame_mark);
 
+    profiler_begin(&profiler, PROFILE_FRAME);
+    // Right before the simulation, so input is at most a tick old when used
+    if (!options.headless)
+      glfwPollEvents();
+
+    double frame_start = options.headless ? 0.0 : glfwGetTime();
+    const GameSnapshot *snapshot;
+    // How far rendering is between the last tick and the next one
+    double alpha = 1.0;
+    if (simulation.pipelined) {
+      double busy;
+      snapshot = simulation_acquire(&simulation, &busy);
+      profiler_add(&profiler, PROFILE_SIMULATION, busy);
+      if (options.interpolate) {
+        alpha = (frame_start - snapshot->time) / tick_duration;
+        alpha = std::min(std::max(alpha, 0.0), 1.0);
+      }
+    } else {
+      if (options.headless) {
+        // One tick per frame, so a run depends on nothing but its input
+        tick_accumulator = tick_duration;
+      } else {
+        tick_accumulator += frame_start - previous_time;
+        previous_time = frame_start;
+        // Don't try to catch up after a long stall (e.g. window drag)
+        if (tick_accumulator > GAME_MAX_TICKS_PER_FRAME * tick_duration)
+          tick_accumulator = GAME_MAX_TICKS_PER_FRAME * tick_duration;
+      }
+
+      profiler_begin(&profiler, PROFILE_SIMULATION);
+      while (tick_accumulator >= tick_duration) {
+        simulation_tick(&simulation, frame_start);
+        tick_accumulator -= tick_duration;
+      }
+      profiler_end(&profiler, PROFILE_SIMULATION);
+
+      snapshot = simulation.state;
+      if (options.interpolate)
+        alpha = tick_accumulator / tick_duration;
+    }
 
     // Game over
-    if (game.num_aliens == 0) {
+    if (snapshot->over) {
+      simulation_release(&simulation);
       game_running = false;
-      continue;
+      break;
     }
 
-    // Draw Aliens
-    for (size_t ai = 0; ai < game.num_aliens; ++ai) {
-      if (!death_counters[ai])
-        continue;
+    const Game &shown = snapshot->game;
+    size_t inputs = snapshot->inputs;
+    size_t player_x =
+        snapshot->previous_player_x +
+        (ptrdiff_t)floor(alpha * ((double)shown.player.x -
+                                  snapshot->previous_player_x) +
+                         0.5);
 
-      const Alien &alien = game.aliens[ai];
+    // Record the frame's draws, the same for either backend
+    render_list_begin(render_list);
+    profiler_begin(&profiler, PROFILE_HUD);
+    text_run_set_number(&score_digits, compiled_number_spritesheet,
+                        shown.score);
+    render_list_bitmap(render_list, LAYER_HUD, score_label.sprite, 4,
+                       shown.height - text_spritesheet.height - 7,
+                       COLOR_RED);
+    render_list_bitmap(render_list, LAYER_HUD, score_digits.sprite,
+                       4 + 2 * number_spritesheet.width,
+                       shown.height - 2 * number_spritesheet.height - 12,
+                       COLOR_RED);
+    render_list_bitmap(render_list, LAYER_HUD, title.sprite,
+                       shown.width - 60, 7, COLOR_RED);
+    render_list_fill(render_list, LAYER_HUD, 0, 16, shown.width, 1,
+                     COLOR_RED);
+    profiler_end(&profiler, PROFILE_HUD);
 
-      if (alien.type == ALIEN_DEAD) {
-        buffer_sprite_draw(&buffer, alien_death_sprite, alien.x, alien.y,
-                           rgb_to_uint32(128, 0, 0));
-      } else {
-        const SpriteAnimation &animation = alien_animation[alien.type - 1];
-        size_t current_frame = animation.time / animation.frame_duration;
-        const Sprite &sprite = *animation.frames[current_frame];
-        buffer_sprite_draw(&buffer, sprite, alien.x, alien.y,
-                           rgb_to_uint32(128, 0, 0));
-      }
+    profiler_begin(&profiler, PROFILE_ALIENS);
+    // Positions are relative to the formation
+    const AlienStore &aliens = shown.aliens;
+    const Formation &formation = shown.formation;
+    for (size_t i = 0; i < aliens.num_live; ++i) {
+      size_t ai = aliens.live[i];
+      size_t animation = aliens.type[ai] - 1;
+      render_list_sprite(render_list, LAYER_ALIENS,
+                         alien_handles[animation] +
+                             shown.animation.frame[animation],
+                         aliens.x[ai] + formation.x,
+                         aliens.y[ai] + formation.y, COLOR_RED);
     }
-
-    // Draw bullets
-    for (size_t bi = 0; bi < game.num_bullets; ++bi) {
-      const Bullet &bullet = game.bullets[bi];
-      const Sprite &sprite = bullet_sprite;
-      buffer_sprite_draw(&buffer, sprite, bullet.x, bullet.y,
-                         rgb_to_uint32(128, 0, 0));
+    for (size_t i = 0; i < aliens.num_dying; ++i) {
+      size_t ai = aliens.dying[i];
+      render_list_sprite(render_list, LAYER_ALIENS, alien_death_handle,
+                         aliens.x[ai] + formation.x,
+                         aliens.y[ai] + formation.y, COLOR_RED);
     }
+    profiler_end(&profiler, PROFILE_ALIENS);
 
-    buffer_sprite_draw(&buffer, player_sprite, game.player.x, game.player.y,
-                       rgb_to_uint32(0, 128, 0));
+    // Shields change with every hit, so they are bitmaps, not sprites
+    for (size_t si = 0; si < shown.shields.count; ++si) {
+      render_list_bitmap(render_list, LAYER_SHIELDS,
+                         shield_store_sprite(shown.shields, si),
+                         shown.shields.x[si], shown.shields.y[si],
+                         COLOR_GREEN);
+    }
 
-    // Render animations every iteration
-    for (size_t i = 0; i < 3; ++i) {
-      ++alien_animation[i].time;
-      if (alien_animation[i].time ==
-          alien_animation[i].num_frames * alien_animation[i].frame_duration) {
-        alien_animation[i].time = 0;
-      }
+    // Bullets are stepped back towards where they were on the last tick
+    profiler_begin(&profiler, PROFILE_BULLETS);
+    const BulletPool &bullets = shown.bullets;
+    for (size_t bi = 0; bi < bullets.count; ++bi) {
+      int offset = (int)floor((alpha - 1.0) * bullets.dir[bi] + 0.5);
+      render_list_sprite(render_list, LAYER_BULLETS, bullet_handle,
+                         bullets.x[bi], bullets.y[bi] + offset, COLOR_RED);
     }
+    profiler_end(&profiler, PROFILE_BULLETS);
 
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, buffer.width, buffer.height,
-                    GL_RGBA, GL_UNSIGNED_INT_8_8_8_8, buffer.data);
+    render_list_sprite(render_list, LAYER_PLAYER, player_handle, player_x,
+                       shown.player.y, COLOR_GREEN);
 
-    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    profiler_begin(&profiler, PROFILE_RASTER);
+    render_list_sort(render_list, &stage_arena);
+    profiler_end(&profiler, PROFILE_RASTER);
 
-    glfwSwapBuffers(window);
+    if (sprite_renderer) {
+      profiler_begin(&profiler, PROFILE_CLEAR);
+      display_begin_frame(&display);
+      sprite_renderer_begin_frame(sprite_renderer, palette[COLOR_BLACK]);
+      profiler_end(&profiler, PROFILE_CLEAR);
 
-    // Player's move animation
-    player_move_dir = 2 * move_dir;
+      profiler_begin(&profiler, PROFILE_RASTER);
+      sprite_renderer_draw_list(sprite_renderer, atlas, *render_list,
+                                palette);
+      profiler_end(&profiler, PROFILE_RASTER);
+      simulation_release(&simulation);
 
-    // Alien simulation
-    for (size_t ai = 0; ai < game.num_aliens; ++ai) {
-      const Alien &alien = game.aliens[ai];
-      if (alien.type == ALIEN_DEAD && death_counters[ai]) {
-        --death_counters[ai];
-      }
+      profiler_gpu_begin(&profiler);
+      profiler_begin(&profiler, PROFILE_DRAW);
+      sprite_renderer_flush(sprite_renderer);
+      profiler_end(&profiler, PROFILE_DRAW);
+      profiler_gpu_end(&profiler);
+      display_end_frame(&display, &profiler);
+
+      display_present(&display, &profiler, inputs, &inputs_shown);
+      profiler_end(&profiler, PROFILE_FRAME);
+      profiler_end_frame(&profiler);
+      continue;
     }
 
-    // Bullets simulation
-    for (size_t bi = 0; bi < game.num_bullets;) {
-      game.bullets[bi].y += game.bullets[bi].dir;
-      if (game.bullets[bi].y >= game.height ||
-          game.bullets[bi].y < bullet_sprite.height) {
-        game.bullets[bi] = game.bullets[game.num_bullets - 1];
-        --game.num_bullets;
-        continue;
-      }
+    profiler_begin(&profiler, PROFILE_UPLOAD);
+    pixel_stream_begin_frame(&display.pixel_stream, &buffer);
+    profiler_end(&profiler, PROFILE_UPLOAD);
 
-      // Bullet hit
-      for (size_t ai = 0; ai < game.num_aliens; ai++) {
-        const Alien &alien = game.aliens[ai];
-        if (alien.type == ALIEN_DEAD)
-          continue;
-
-        const SpriteAnimation &animation = alien_animation[alien.type - 1];
-        size_t current_frame = animation.time / animation.frame_duration;
-        const Sprite &alien_sprite = *animation.frames[current_frame];
-        bool overlap = sprite_overlap_check(bullet_sprite, game.bullets[bi].x,
-                                            game.bullets[bi].y, alien_sprite,
-                                            alien.x, alien.y);
-        if (overlap) {
-          score += 10 * (4 - game.aliens[ai].type);
-
-          game.aliens[ai].type = ALIEN_DEAD;
-          // NOTE: Hack to recenter death sprite
-          game.aliens[ai].x -=
-              (alien_death_sprite.width - alien_sprite.width) / 2;
-          game.bullets[bi] = game.bullets[game.num_bullets - 1];
-          --game.num_bullets;
-          continue;
-        }
-      }
+    profiler_begin(&profiler, PROFILE_CLEAR);
+    buffer_begin_frame(&buffer, colors[COLOR_BLACK],
+                       pixel_stream_buffer_age(display.pixel_stream));
+    profiler_end(&profiler, PROFILE_CLEAR);
 
-      ++bi;
-    }
+    profiler_begin(&profiler, PROFILE_RASTER);
+    buffer_draw_list(&buffer, *render_list, colors);
+    profiler_end(&profiler, PROFILE_RASTER);
 
-    if (player_move_dir != 0) {
-      if (game.player.x + player_sprite.width + player_move_dir >= game.width) {
-        game.player.x = game.width - player_sprite.width - player_move_dir;
-      } else if (game.player.x + player_move_dir <= 0) {
-        game.player.x = 0;
-      } else {
-        game.player.x += player_move_dir;
-      }
-    }
+    // Stats are a frame behind: this frame is only committed once presented
+    profiler_begin(&profiler, PROFILE_HUD);
+    profiler_draw(profiler, &buffer, compiled_text_spritesheet,
+                  compiled_number_spritesheet, 4, shown.height - 40,
+                  colors[COLOR_GRAY]);
+    profiler_end(&profiler, PROFILE_HUD);
 
-    // Process bullet events
-    if (fire_pressed && game.num_bullets < GAME_MAX_BULLETS) {
-      game.bullets[game.num_bullets].x =
-          game.player.x + player_sprite.width / 2;
-      game.bullets[game.num_bullets].y = game.player.y + player_sprite.height;
-      game.bullets[game.num_bullets].dir = 2;
-      ++game.num_bullets;
+    if (buffer.raster) {
+      profiler_begin(&profiler, PROFILE_RASTER);
+      rasterizer_flush(buffer.raster, &buffer);
+      profiler_end(&profiler, PROFILE_RASTER);
     }
-    fire_pressed = false;
+    // Queued shield blits read the snapshot until the flush
+    simulation_release(&simulation);
 
-    glfwPollEvents();
-  }
+    if (options.headless) {
+      profiler_end(&profiler, PROFILE_FRAME);
+      profiler_end_frame(&profiler);
+      continue;
+    }
 
-  glfwDestroyWindow(window);
-  glfwTerminate();
+    profiler_gpu_begin(&profiler);
+    profiler_begin(&profiler, PROFILE_UPLOAD);
+    DirtyRect *dirty_rects =
+        arena_push<DirtyRect>(&stage_arena, DISPLAY_MAX_DIRTY_RECTS);
+    size_t num_dirty_rects =
+        buffer_dirty_rects(&buffer, dirty_rects, DISPLAY_MAX_DIRTY_RECTS);
+    pixel_stream_upload(&display.pixel_stream, display.texture, buffer,
+                        dirty_rects, num_dirty_rects);
+    profiler_end(&profiler, PROFILE_UPLOAD);
 
-  glDeleteVertexArrays(1, &fullscreen_triangle_vao);
+    profiler_begin(&profiler, PROFILE_DRAW);
+    display_begin_frame(&display);
+    display_draw(&display);
+    profiler_end(&profiler, PROFILE_DRAW);
+    profiler_gpu_end(&profiler);
+    display_end_frame(&display, &profiler);
 
-  for (size_t i = 0; i < 6; ++i) {
-    delete[] alien_sprites[i].data;
+    display_present(&display, &profiler, inputs, &inputs_shown);
+    profiler_end(&profiler, PROFILE_FRAME);
+    profiler_end_frame(&profiler);
   }
+  simulation_stop(&simulation);
 
-  delete[] alien_death_sprite.data;
+  if (profiler.count[PROFILE_INPUT] > 0) {
+    ProfileStats latency = profiler_stats(profiler, PROFILE_INPUT);
+    printf("Input to photon: min %.1f ms, avg %.1f ms, p99 %.1f ms over the "
+           "last %zu inputs\n",
+           latency.min * 1e3, latency.avg * 1e3, latency.p99 * 1e3,
+           std::min(profiler.count[PROFILE_INPUT], (size_t)PROFILE_HISTORY));
+  }
+  if (!options.headless && display.pacer.late > 0) {
+    printf("Late frames: %zu of %zu (%.2f%%)\n", display.pacer.late,
+           display.pacer.frames,
+           100.0 * display.pacer.late / display.pacer.frames);
+  }
+  if (options.profile_csv &&
+      !profiler_write_csv(profiler, options.profile_csv)) {
+    fprintf(stderr, "Could not write %s\n", options.profile_csv);
+  }
+  if (options.headless) {
+    double elapsed = profiler_now() - run_start;
+    printf("Headless: %zu frames in %.3f s (%.1f frames/s), buffer hash "
+           "%016llx\n",
+           frame, elapsed, elapsed > 0.0 ? frame / elapsed : 0.0,
+           (unsigned long long)buffer_hash(buffer));
+  }
+  if (options.record && !input_script_save(record, options.record)) {
+    fprintf(stderr, "Could not write input script %s\n", options.record);
+  }
+  input_script_free(&replay);
+  input_script_free(&record);
 
-  for (size_t i = 0; i < 3; ++i) {
-    delete[] alien_animation[i].frames;
+  profiler_free(&profiler);
+  if (rasterizer) {
+    rasterizer_free(rasterizer);
+    delete rasterizer;
+  }
+  if (sprite_renderer) {
+    sprite_renderer_free(sprite_renderer);
   }
-  delete[] buffer.data;
-  delete[] game.aliens;
-  delete[] death_counters;
+  if (!options.headless) {
+    display_free(&display);
+  }
+
+  arena_free(&stage_arena);
+  arena_free(&arena);
+  asset_pack_close(&pack);
 
   return 0;
 }
+#endif